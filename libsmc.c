@@ -0,0 +1,361 @@
+/*
+ *  libsmc.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * The SMC for other programs (libsmc.h)
+ *
+ * The rest of smc works on the global transport, a connection per thread ('conn') and a
+ * process wide key info cache, and prints its errors. The functions here work on a handle
+ * instead, which holds its own transport, connection and key info cache, and only return
+ * error codes. So a program can read and write the SMC without starting smc for every
+ * sample:
+ *
+ *     SMCHandle_t *smc;
+ *     SMCVal_t     val;
+ *
+ *     if (SMCHandleOpen(NULL, &smc) == kIOReturnSuccess &&
+ *         SMCHandleRead(smc, "TC0P", &val) == kIOReturnSuccess)
+ *         ... val.dataType, val.dataSize and val.bytes hold the value ...
+ *     SMCHandleClose(smc);
+ *
+ * - The transport is the AppleSMC (NULL; only on macOS), or any other SMCTransport_t,
+ *   like SMCSimTransport after SMCSimLoad(), or one of the program's own for its tests.
+ * - A handle can be used from several threads at once. Its calls are made one at a time,
+ *   as they share its connection; for calls in parallel, open a handle per thread.
+ * - Only SMCHandleOpen() allocates memory. The key info cache is a table of fixed size,
+ *   allocated with the handle; once it is full, further keys are asked every time.
+ * - A program builds libsmc.c with smctypes.c (the conversions of bytes, key names and
+ *   values), smcqueue.c for queues, and the transports it uses: smciokit.c for the
+ *   AppleSMC, smcsim.c for the simulator. Link with -lpthread, and -lm for smcsim.c.
+ *
+ * smc reads through the same SMCReadWith() as a handle, so a key is read the same way in
+ * both. Around it, smc has its persistent key directory (smccache.c), the last written
+ * values that spare unchanged writes, -S statistics and a connection per thread (see
+ * readKey() in smc.c); a handle has a small key info cache of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libsmc.h"
+
+#define HANDLE_CACHE  1024      // Key infos cached per handle; a power of 2
+
+typedef struct {
+    UInt32                key;          // 0 for a free entry
+    SMCKeyData_keyInfo_t  keyInfo;
+} SMCHandleEntry_t;
+
+struct SMCHandle {
+    const SMCTransport_t *transport;
+    io_connect_t          conn;
+    pthread_mutex_t       lock;         // One call at a time on 'conn', and the cache
+    int                   cached;       // Entries in use
+    SMCHandleEntry_t      cache[HANDLE_CACHE];  // Open addressing on the key
+};
+
+// The key as a UInt32 (see bytes2uint32()); a shorter name is padded with spaces, like "LS!"
+static UInt32 handleKey(const char *key)
+{
+    UInt32Char_t name;
+
+    snprintf(name, sizeof(name), "%-4.4s", key);
+    return bytes2uint32(name, 4);
+}
+
+/*
+ * One exchange with the SMC; the SMC refusing it is an error too
+ * Must be called with the handle locked.
+ */
+static kern_return_t handleCall(SMCHandle_t *handle, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    kern_return_t result;
+
+    memset(outputStructurep, 0, sizeof(SMCKeyData_t));
+    result = handle->transport->call(handle->conn, KERNEL_INDEX_SMC, inputStructurep, outputStructurep);
+    if (result != kIOReturnSuccess)
+        return result;
+    return ((unsigned int)outputStructurep->result) & 0xff;
+}
+
+// The cache entry of 'key', or the free entry for it; NULL if it is not there and the cache is full
+static SMCHandleEntry_t *handleEntry(SMCHandle_t *handle, UInt32 key)
+{
+    UInt32 i, n;
+
+    for (i = key & (HANDLE_CACHE - 1), n = 0; n < HANDLE_CACHE; i = (i + 1) & (HANDLE_CACHE - 1), n++)
+    {
+        if (handle->cache[i].key == key)
+            return &handle->cache[i];
+        if (handle->cache[i].key == 0)
+            return handle->cached < HANDLE_CACHE - 1 ? &handle->cache[i] : NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Get the key info of 'key' into 'keyInfop', from the cache unless 'fresh' is set
+ * Must be called with the handle locked.
+ */
+static kern_return_t handleKeyInfo(SMCHandle_t *handle, UInt32 key, SMCKeyData_keyInfo_t *keyInfop, int fresh)
+{
+    SMCHandleEntry_t *entry = handleEntry(handle, key);
+    SMCKeyData_t      inputStructure, outputStructure;
+    kern_return_t     result;
+
+    if (entry != NULL && entry->key == key && !fresh)
+    {
+        *keyInfop = entry->keyInfo;
+        return kIOReturnSuccess;
+    }
+
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    inputStructure.key = key;
+    inputStructure.data8 = SMC_CMD_READ_KEYINFO;
+    result = handleCall(handle, &inputStructure, &outputStructure);
+    if (result != kIOReturnSuccess)
+        return result;
+    *keyInfop = outputStructure.keyInfo;
+
+    if (entry != NULL)
+    {
+        if (entry->key == 0)
+            handle->cached++;
+        entry->key = key;
+        entry->keyInfo = *keyInfop;
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Open a connection to the SMC through 'transport', or the AppleSMC if NULL, in '*handlep'
+ * Returns kIOReturnNoDevice if there is no such transport, kIOReturnNoMemory, or the
+ * error of opening it; then '*handlep' is NULL.
+ */
+kern_return_t SMCHandleOpen(const SMCTransport_t *transport, SMCHandle_t **handlep)
+{
+    SMCHandle_t   *handle;
+    kern_return_t  result;
+
+    *handlep = NULL;
+#ifdef __APPLE__
+    if (transport == NULL)
+        transport = &SMCIOKitTransport;
+#endif
+    if (transport == NULL)
+        return kIOReturnNoDevice;
+
+    handle = calloc(1, sizeof(SMCHandle_t));
+    if (handle == NULL)
+        return kIOReturnNoMemory;
+    handle->transport = transport;
+    result = transport->open(&handle->conn);
+    if (result != kIOReturnSuccess)
+    {
+        free(handle);
+        return result;
+    }
+    pthread_mutex_init(&handle->lock, NULL);
+    *handlep = handle;
+    return kIOReturnSuccess;
+}
+
+/*
+ * Close the connection of 'handle', and free it
+ * Returns the result of closing the connection. NULL is ignored.
+ */
+kern_return_t SMCHandleClose(SMCHandle_t *handle)
+{
+    kern_return_t result;
+
+    if (handle == NULL)
+        return kIOReturnSuccess;
+    result = handle->transport->close(handle->conn);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    return result;
+}
+
+/*
+ * Get the number of keys of the SMC (the value of "#KEY") into '*countp'
+ */
+kern_return_t SMCHandleKeyCount(SMCHandle_t *handle, UInt32 *countp)
+{
+    kern_return_t result;
+    SMCVal_t      val;
+    UInt32        i;
+
+    result = SMCHandleRead(handle, "#KEY", &val);
+    if (result != kIOReturnSuccess)
+        return result;
+    *countp = 0;
+    for (i = 0; i < val.dataSize && i < 4; i++)
+        *countp = (*countp << 8) | (unsigned char)val.bytes[i];
+    return kIOReturnSuccess;
+}
+
+/*
+ * Get the name of the key with index 'index' (0 to the number of keys - 1) into 'key'
+ * The SMC numbers its keys in sorted order.
+ */
+kern_return_t SMCHandleKeyAt(SMCHandle_t *handle, UInt32 index, UInt32Char_t key)
+{
+    SMCKeyData_t  inputStructure, outputStructure;
+    kern_return_t result;
+
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    inputStructure.data8 = SMC_CMD_READ_INDEX;
+    inputStructure.data32 = index;
+    pthread_mutex_lock(&handle->lock);
+    result = handleCall(handle, &inputStructure, &outputStructure);
+    pthread_mutex_unlock(&handle->lock);
+    if (result == kIOReturnSuccess)
+        uint32tostr(key, outputStructure.key);
+    return result;
+}
+
+/*
+ * Get the size, type and attributes of 'key' into 'keyInfop'
+ */
+kern_return_t SMCHandleKeyInfo(SMCHandle_t *handle, const char *key, SMCKeyData_keyInfo_t *keyInfop)
+{
+    kern_return_t result;
+
+    pthread_mutex_lock(&handle->lock);
+    result = handleKeyInfo(handle, handleKey(key), keyInfop, 0);
+    pthread_mutex_unlock(&handle->lock);
+    return result;
+}
+
+// SMCReadWith() on a handle; called with the handle locked
+static kern_return_t readerKeyInfo(void *context, UInt32 key, SMCKeyData_keyInfo_t *keyInfop, int fresh)
+{
+    return handleKeyInfo(context, key, keyInfop, fresh);
+}
+
+static kern_return_t readerCall(void *context, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    SMCHandle_t *handle = context;
+
+    memset(outputStructurep, 0, sizeof(SMCKeyData_t));
+    return handle->transport->call(handle->conn, KERNEL_INDEX_SMC, inputStructurep, outputStructurep);
+}
+
+static const SMCReader_t handleReader = { readerKeyInfo, readerCall, NULL };
+
+/*
+ * Read the value of 'key' into 'valp' with the key info and calls of 'reader'
+ * This is how every key is read, by smc (readKey() in smc.c) and by handles alike.
+ * 'inputp' must be cleared by the caller; only its key, dataSize and command are set here.
+ * 'valp' must be cleared by the caller, and have its key name filled in.
+ * Returns kIOReturnSuccess, an error code of 'reader', or the result code the SMC refused with.
+ */
+kern_return_t SMCReadWith(const SMCReader_t *reader, void *context, UInt32 key, SMCVal_t *valp,
+                          SMCKeyData_t *inputp, SMCKeyData_t *outputp)
+{
+    SMCKeyData_keyInfo_t keyInfo;
+    kern_return_t        result;
+    int                  retry;
+
+    inputp->key = key;
+    inputp->data8 = SMC_CMD_READ_BYTES;
+
+    // A cached size that the SMC no longer agrees with gets one retry with fresh key info
+    for (retry = 0; retry < 2; retry++)
+    {
+        result = reader->keyInfo(context, key, &keyInfo, retry);
+        if (result != kIOReturnSuccess)
+            return result;
+        valp->dataSize = keyInfo.dataSize > BYTECOUNT ? BYTECOUNT : keyInfo.dataSize;
+        uint32tostr(valp->dataType, keyInfo.dataType);
+        inputp->keyInfo.dataSize = keyInfo.dataSize;
+        result = reader->call(context, inputp, outputp);
+        if (result != kIOReturnSuccess)
+            return result;
+        result = ((unsigned int)outputp->result) & 0xff;
+        if (result != SMC_RESULT_KEY_SIZE_MISMATCH)
+            break;
+    }
+
+    // Still the wrong size after fresh key info, or a key the SMC no longer has
+    if (result != SMC_RESULT_SUCCESS)
+    {
+        if (reader->refused != NULL)
+            reader->refused(context, key);
+        return result;
+    }
+    memcpy(valp->bytes, outputp->bytes, valp->dataSize);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Read the value of 'key' into 'valp': its name, type, size and bytes
+ * Takes one call, or two the first time the handle reads the key.
+ */
+kern_return_t SMCHandleRead(SMCHandle_t *handle, const char *key, SMCVal_t *valp)
+{
+    SMCKeyData_t  inputStructure, outputStructure;
+    kern_return_t result;
+    UInt32        value = handleKey(key);
+
+    memset(valp, 0, sizeof(SMCVal_t));
+    uint32tostr(valp->key, value);
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+
+    pthread_mutex_lock(&handle->lock);
+    result = SMCReadWith(&handleReader, handle, value, valp, &inputStructure, &outputStructure);
+    pthread_mutex_unlock(&handle->lock);
+    return result;
+}
+
+/*
+ * Write the 'dataSize' bytes in 'valp' to its key
+ * The size must be that of the key; otherwise SMC_RESULT_KEY_SIZE_MISMATCH is returned
+ * and nothing is written.
+ */
+kern_return_t SMCHandleWrite(SMCHandle_t *handle, const SMCVal_t *valp)
+{
+    SMCKeyData_t          inputStructure, outputStructure;
+    SMCKeyData_keyInfo_t  keyInfo;
+    kern_return_t         result;
+
+    if (valp->dataSize > BYTECOUNT)
+        return kIOReturnBadArgument;
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    inputStructure.key = handleKey(valp->key);
+    inputStructure.data8 = SMC_CMD_WRITE_BYTES;
+    inputStructure.keyInfo.dataSize = valp->dataSize;
+    memcpy(inputStructure.bytes, valp->bytes, valp->dataSize);
+
+    pthread_mutex_lock(&handle->lock);
+    result = handleKeyInfo(handle, inputStructure.key, &keyInfo, 0);
+    if (result == kIOReturnSuccess && keyInfo.dataSize != valp->dataSize)
+        result = SMC_RESULT_KEY_SIZE_MISMATCH;
+    if (result == kIOReturnSuccess)
+        result = handleCall(handle, &inputStructure, &outputStructure);
+    pthread_mutex_unlock(&handle->lock);
+    return result;
+}
@@ -0,0 +1,72 @@
+/*
+ *  libsmc.h
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * The SMC for other programs (see libsmc.c and smcqueue.c)
+ *
+ * This is the header for programs that use the SMC through libsmc.c and smcqueue.c,
+ * instead of running smc. Only the functions below, and the types and transports they
+ * take from smctypes.h, are meant for them.
+ *
+ * All functions return kIOReturnSuccess, an error code of the transport, or the result
+ * code the SMC refused the call with (SMC_RESULT_KEY_NOT_FOUND, ...). None of them print.
+ */
+
+#ifndef __LIBSMC_H__
+#define __LIBSMC_H__
+
+#include "smctypes.h"
+
+typedef struct SMCHandle SMCHandle_t;
+
+kern_return_t SMCHandleOpen(const SMCTransport_t *transport, SMCHandle_t **handlep);
+kern_return_t SMCHandleClose(SMCHandle_t *handle);
+kern_return_t SMCHandleKeyCount(SMCHandle_t *handle, UInt32 *countp);
+kern_return_t SMCHandleKeyAt(SMCHandle_t *handle, UInt32 index, UInt32Char_t key);
+kern_return_t SMCHandleKeyInfo(SMCHandle_t *handle, const char *key, SMCKeyData_keyInfo_t *keyInfop);
+kern_return_t SMCHandleRead(SMCHandle_t *handle, const char *key, SMCVal_t *valp);
+kern_return_t SMCHandleWrite(SMCHandle_t *handle, const SMCVal_t *valp);
+
+// smcqueue.c
+enum {
+    SMC_REQUEST_READ,
+    SMC_REQUEST_WRITE
+};
+
+typedef struct {
+    int                   type;         // SMC_REQUEST_...
+    SMCVal_t              val;          // The key, and the value to write or that was read
+    void                 *userData;     // Handed back with the completion
+    kern_return_t         result;       // Of the completion
+} SMCRequest_t;
+
+typedef struct SMCQueue SMCQueue_t;
+
+kern_return_t SMCQueueCreate(const SMCTransport_t *transport, int workers, int depth, SMCQueue_t **queuep);
+void          SMCQueueDestroy(SMCQueue_t *queue);
+int           SMCQueueSubmit(SMCQueue_t *queue, const SMCRequest_t *requests, int count);
+int           SMCQueueReap(SMCQueue_t *queue, SMCRequest_t *completions, int max, int wait);
+int           SMCQueueFd(SMCQueue_t *queue);
+
+#endif
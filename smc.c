@@ -23,356 +23,228 @@
  */
 
 #include <unistd.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <IOKit/IOKitLib.h>
+#include <pthread.h>
+#include <fnmatch.h>
 
 #include "smc.h"
 
-io_connect_t conn;
+// The connection used by SMCCall(). Each thread has its own (see SMCPrintAll()).
+__thread io_connect_t conn;
+
+// The last known values of the keys written by this process (see SMCWriteKeys())
+static struct {
+    UInt32                key;
+    UInt32                dataSize;
+    SMCBytes_t            bytes;
+} known[MAXKNOWN];
+static int             knownCount = 0;
+static pthread_mutex_t knownLock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef __APPLE__
+SMCTransport_t *transport = &SMCIOKitTransport;
+#else
+SMCTransport_t *transport = NULL;   // No AppleSMC available; only the simulator (-s)
+#endif
 
 /*
- * Convert an array of bytes to a UInt32.
- * - bytes[0] is seen as the most significant byte in the array.
- * - The 'size' (values 1-4) gives the number of bytes read from 'bytes'.
- * The conversion is independent of the byte order ("endian-ness") of the system; bytes[0] will
- * always be the most significant part of the result.
- *
- * Renamed from _strtoul() to bytes2uint32() to better reflect the function
- * Dropped the 'base' parameter. No base conversion takes place, all it does
- * is move bytes around.
- * Solves the problem in the original in the cases where it was called with base=10.
+ * Open a connection to the SMC through the current transport
+ * - connection is returned through 'connp'
+ * - on error prints an error message and returns the error code
+ * - on success returns kIOReturnSuccess
+ * The transports only return error codes; the messages are printed here.
  */
-UInt32 bytes2uint32(char *bytes, int size)
+kern_return_t SMCOpen(io_connect_t *connp)
 {
-    UInt32 total = 0;
-    int i;
-    
-    for (i = 0; i < size; i++)
-    {
-        total = total * 256;
-        total += ((unsigned)bytes[i] & 0xff); // Explicitily promote to uint and chop off to prevent sign extension
-    }
-    return total;
+    kern_return_t result;
+
+    result = transport != NULL ? transport->open(connp) : kIOReturnNoDevice;
+    if (result == kIOReturnNoDevice)
+        printf("Error: no SMC found\n");
+    else if (result != kIOReturnSuccess)
+        printf("Error: cannot open the SMC (%s) = %08x\n", transport->name, result);
+    return result;
 }
 
 /*
- * Convert the bytes in 'val' to a string in 'str'
- * - MSB becomes the first character
- * - LSB becomes the last character
- * Input 'val' is limited to 32 bits (4 bytes), so output will never be more than 4 characters
- * However: it might be shorter than 4 characters, by including a '\0' byte.
- * The string is padded with spaces to fill up 4 characters.
+ * Close the connection given in 'conn'
  */
-void uint32tostr(char *str, UInt32 val)
+kern_return_t SMCClose(io_connect_t conn)
 {
-    sprintf(str, "%c%c%c%c",
-            (unsigned int) val >> 24,
-            (unsigned int) val >> 16,
-            (unsigned int) val >> 8,
-            (unsigned int) val);
-    // Pad with spaces if shorter than 4 characters
-    for (int i = (int)strlen(str); i < 4; i++) {
-        str[i] = ' ';
-    }
+    return transport->close(conn);
 }
 
 /*
- * Convert a single hexadecimal character to an int
- * For non-hex characters return -1.
+ * Exchange data with the SMC
+ * All reading and writing of data in this program goes through this call
+ * - 'index' is passed to the transport as the command to execute
+ * - 'inputStructure' contains data passed to the SMC
+ * - 'outputStructure' will contain data returned from the SMC
+ * - global variable 'conn' is used as the connection to use (one per thread)
+ * With -S every call is timed and counted (see smcstats.c).
  */
-int hex2int(char c)
+kern_return_t SMCCall(int index, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
 {
-    if ('0' <= c && c <= '9') {
-        return c - '0';
-    } else if ('A' <= c && c <= 'F') {
-        return c - 'A' + 10;
-    } else if ('a' <= c && c <= 'f') {
-        return c - 'a' + 10;
-    }
-    return -1;
+    kern_return_t result;
+    UInt64        start;
+
+    if (!SMCStatsEnabled)
+        return transport->call(conn, index, inputStructurep, outputStructurep);
+    start = SMCTimeNow();
+    result = transport->call(conn, index, inputStructurep, outputStructurep);
+    SMCStatsRecord(inputStructurep, outputStructurep, result, SMCTimeNow() - start);
+    return result;
 }
 
+
 /*
- * Convert an  SMCVal_t value that holds a fixed point value into a double
- * The exact format is encoded in val.dataType
- * This has the form "fpIF" or "spIF" where:
- * - "fp" and "sp" are litteral strings (for unsigned and signed)
- * - "I" is a hexadecimal digit that gives the number of bits in the integer part
- * - "F" is a hexadecimal digit that gives the number of bits in the fraction part
- * For signed fixed point numbers the topmost bit of the first byte is the sign
- * Example: "fpe2" is an unsigned fixed point number with 0xe=14 integer bits
- * and 2 fraction bits. Layout in two bytes: i i i i i i i i    i i i i i i f f
- * Example: "sp69" is a signed fixed point number with 6 integer bits
- * and 9 fraction bits. Layout in two bytes: s i i i i i i f    f f f f f f f f
- *
- * This interpretation of the format was surmised from the way the original version
- * of this program tried to convert "fpe2" numbers, and looking at all the other,
- * similar types listed with the -l option.
- * In all those types the total number of bits adds up to 16, and matches the 2 bytes
- * in the value. It is unclear if and how a value should be interpreted if the number
- * of bits in the value does not add up to a multiple of 8. Where will the stuffing bits
- * be? Before the sign bit? Between the sign bit and the integer bits? Between the
- * integer bits and the fraction bits? After the fraction bits? Any combination of these?
- *
- * For the time being we assume that there are always a whole number of bytes, so our algorithm
- * can assume that the bits are left-alligned.
- *
- * Approach: First convert the bytes to a number, then divide by 2 for the number of bits
- * in the fraction part. Also stick the sign in there somewhere.
+ * Get the information (size, type and attributes) about a key
+ * - Key is held in 'key' as a UInt32
+ * - The information is returned through 'keyInfop'
+ * Takes the information from the key info cache if possible, otherwise
+ * asks the SMC (and adds the answer to the cache).
+ * If the call fails, returns the error code
+ * If successful returns kIOReturnSuccess
  */
-double val2float(SMCVal_t val)
+kern_return_t SMCGetKeyInfo(UInt32 key, SMCKeyData_keyInfo_t *keyInfop)
 {
-    float total = 0.0;  // Running total of the return value
-    int signbits = 0;   // Number of sign bits (0 or 1)
-    int intbits = 0;    // Number of integer bits
-    int fracbits = 0;   // Number of fraction bits
-    unsigned char byte; // Temporary holder for a single byte
-    int sign = 0;       // Flag for sign bit. 1= negative, 0= positive
-    int i;
-    
-    // Analise the data type
-    if (val.dataType[0]=='s'){  // First letter is an s?
-        signbits = 1;           // Then we have a sign bit
-    }
-    intbits = hex2int(val.dataType[2]);     // Get the nr of integer bits
-    if (intbits < 0) {
-        fprintf(stderr, "Error: Expected hex digit in fp/sp data type. Found '%c' in '%s'\n", val.dataType[2], val.dataType);
-        return 0.0;
-    }
-    fracbits = hex2int(val.dataType[3]);    // Get the nr of fraction bits
-    if (fracbits < 0) {
-        fprintf(stderr, "Error: Expected hex digit in fp/sp data type. Found '%c' in '%s'\n", val.dataType[3], val.dataType);
-        return 0.0;
-    }
-
-    // Build up the number from the bytes
-    // The first byte may contain a sign
-    byte = val.bytes[0];
-    if (signbits > 0) {
-        sign = byte >> 7; // Isolate the top bit
-        byte &= 0x7f;     // Remove the sign bit from the value
-    }
+    kern_return_t result;
+    SMCKeyData_t  inputStructure;
+    SMCKeyData_t  outputStructure;
 
-    total = byte;
-    for (i = 1; i < (signbits+intbits+fracbits)/8; i++)
+    if (SMCCacheLookup(key, keyInfop))
     {
-        total *= (double)(1<<8);    // 'shift' the total 8 bits to the left (multiply by 256)
-        byte = val.bytes[i];    // go via 'byte' to prevent problems with signed char
-        total += byte;      // Add the next byte
+        // Keys that do not exist are cached with a data type of zero
+        return keyInfop->dataType != 0 ? kIOReturnSuccess : SMC_RESULT_KEY_NOT_FOUND;
     }
 
-    // Divide by 2 for each fractional bit
-    for (i = 0; i < fracbits; i++) {
-        total /= 2.0;   // Ensure floating point divide
-    }
-    
-    // Add the sign
-    // (Don't do this before we have all the bytes. Higher bytes might be zero, and we would lose the sign)
-    if (sign) {
-        total = - total;
-    }
-    return total;
-}
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
 
-/*
- * Print an SMCVal_t value that holds a fixed point representation of a number.
- */
-void printFixedPoint(SMCVal_t val)
-{
-    printf("%.6g ", val2float(val) );
-}
+    // Put the command to read info about the key in the inputStructure
+    inputStructure.key = key;
+    inputStructure.data8 = SMC_CMD_READ_KEYINFO;
 
-/*
- * Print the value of an SMCVal_t (which has an integer type of 8, 16 or 32 bits)
- * as a decimal integer value
- */
-void printUInt(SMCVal_t val)
-{
-    /*
-     * == Problem fixed: a value with bytes "01 14" were returned as '20', should be 276
-     * Solved by replacing "home brew" _strtoul() (with 'base' parameter) by
-     * bytes2uint32() (without a 'base' parameter).
-     */
-    printf("%u ", (unsigned int) bytes2uint32(val.bytes, val.dataSize));
+    // SMCCall with only the key filled in will fill outputStructure with:
+    // - dataSize
+    // - dataType
+    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+    if (result != kIOReturnSuccess)
+        return result;  // Quit if call fails
+
+    /**** Try this: read the 'result' entry in outputStructure to see if call was valid */
+    result = ((unsigned int)outputStructure.result) & 0xff; // Prevent unwanted sign extension
+    if (result == SMC_RESULT_KEY_NOT_FOUND)
+    {
+        memset(keyInfop, 0, sizeof(SMCKeyData_keyInfo_t));
+        SMCCacheStore(key, keyInfop);
+    }
+    if (result != kIOReturnSuccess)
+        return result;  // Quit if call fails
+
+    *keyInfop = outputStructure.keyInfo;
+    SMCCacheStore(key, keyInfop);
+    return kIOReturnSuccess;
 }
 
 /*
- * Print the value of an SMCVal_t as a sequence of bytes, in hexadecimal
- * - number of bytes is in val.dataSize
- * - bytes are in val.bytes[]
+ * Remember 'size' bytes in 'bytes' as the last known value of 'key', if the key
+ * was written before (or always, if 'add' is set)
  */
-void printBytesHex(SMCVal_t val)
+static void knownStore(UInt32 key, const char *bytes, UInt32 size, int add)
 {
     int i;
-    
-    printf("(bytes");
-    for (i = 0; i < val.dataSize; i++)
-        printf(" %02x", (unsigned char) val.bytes[i]);
-    printf(")\n");
-}
 
-/*
- * Print the information contained in an SMCVal_t
- */
-void printVal(SMCVal_t val)
-{
-    // - two spaces
-    // - 4 characters for the name of the key
-    // - 4 characters of the datatype of the key (in square braces).
-    // - two spaces
-    printf("  %s  [%s]  ", val.key, val.dataType);
-
-    // print the value only if the dataSize is bigger than zero
-    if (val.dataSize > 0)
+    if (!add && __atomic_load_n(&knownCount, __ATOMIC_ACQUIRE) == 0)
+        return;     // Nothing written yet; the usual case for reads
+    pthread_mutex_lock(&knownLock);
+    for (i = 0; i < knownCount && known[i].key != key; i++)
+        ;
+    if (i == knownCount && add && knownCount < MAXKNOWN)
     {
-        // For integer dataTypes use printUInt()
-        // For fp.. and sp.. dataType use printFixedPoint()
-        // For others print nothing
-        if ((strcmp(val.dataType, DATATYPE_UINT8) == 0)  ||
-            (strcmp(val.dataType, DATATYPE_UINT16) == 0) ||
-            (strcmp(val.dataType, DATATYPE_UINT32) == 0)
-           )
-            printUInt(val);
-        else if (strncmp(val.dataType, DATATYPE_FP, 2) == 0 ||
-                 strncmp(val.dataType, DATATYPE_SP, 2) == 0
-                 )
-            printFixedPoint(val);
-        
-        // Print the byte values in hexadecimal
-        printBytesHex(val);
+        known[i].key = key;
+        __atomic_store_n(&knownCount, knownCount + 1, __ATOMIC_RELEASE);
     }
-    else
+    if (i < knownCount)
     {
-        printf("no data\n");
+        known[i].dataSize = size;
+        memcpy(known[i].bytes, bytes, size);
     }
+    pthread_mutex_unlock(&knownLock);
 }
 
 /*
- * Open a connection to the "AppleSMC" kernel extension
- * - connection is returned through 'connp'
- * - on error prints an error message and returns 1
- * - on success returns kIOReturnSuccess
+ * Returns 1 if the last known value of 'key' is the 'size' bytes in 'bytes'
  */
-kern_return_t SMCOpen(io_connect_t *connp)
+static int knownEqual(UInt32 key, const char *bytes, UInt32 size)
 {
-    kern_return_t result;
-    mach_port_t   masterPort;
-    io_iterator_t iterator;
-    io_object_t   device;
-    
-    result = IOMasterPort(MACH_PORT_NULL, &masterPort);
-    
-    CFMutableDictionaryRef matchingDictionary = IOServiceMatching("AppleSMC");
-    result = IOServiceGetMatchingServices(masterPort, matchingDictionary, &iterator);
-    if (result != kIOReturnSuccess)
-    {
-        printf("Error: IOServiceGetMatchingServices() = %08x\n", result);
-        return 1;
-    }
-    
-    device = IOIteratorNext(iterator);
-    IOObjectRelease(iterator);
-    if (device == 0)
-    {
-        printf("Error: no SMC found\n");
-        return 1;
-    }
-    
-    result = IOServiceOpen(device, mach_task_self(), 0, connp);
-    IOObjectRelease(device);
-    if (result != kIOReturnSuccess)
+    int i, equal = 0;
+
+    pthread_mutex_lock(&knownLock);
+    for (i = 0; i < knownCount; i++)
     {
-        printf("Error: IOServiceOpen() = %08x\n", result);
-        return 1;
+        if (known[i].key == key)
+        {
+            equal = (known[i].dataSize == size && memcmp(known[i].bytes, bytes, size) == 0);
+            break;
+        }
     }
-    
-    return kIOReturnSuccess;
+    pthread_mutex_unlock(&knownLock);
+    return equal;
 }
 
-/*
- * Close the connection given in 'conn'
- */
-kern_return_t SMCClose(io_connect_t conn)
+// SMCReadWith() for smc: the key info cache of smccache.c, and SMCCall() on this thread's connection
+static kern_return_t readerKeyInfo(void *context, UInt32 key, SMCKeyData_keyInfo_t *keyInfop, int fresh)
+{
+    if (fresh)
+        SMCCacheForget(key);
+    return SMCGetKeyInfo(key, keyInfop);
+}
+
+static kern_return_t readerCall(void *context, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    return SMCCall(KERNEL_INDEX_SMC, inputStructurep, outputStructurep);
+}
+
+static void readerRefused(void *context, UInt32 key)
 {
-    return IOServiceClose(conn);
+    SMCCacheForget(key);
 }
 
+static const SMCReader_t reader = { readerKeyInfo, readerCall, readerRefused };
+
 /*
- * Exchange data with the kernel extension (SMC device in the AppleSMC extension)
- * All reading and writing of data in this program goes through this call
- * - 'index' is passed to the kernel extension as the command to execute
- * - 'inputStructure' contains data passed to the kernel extension
- * - 'outputStructure' will contain data returned from the kernel extension
- * - global variable 'conn' is used as the connection to use
+ * Read the value of 'key' into 'valp', using 'inputp' and 'outputp' for the calls
+ * 'inputp' must be cleared by the caller. Only its key, dataSize and command are
+ * set here, so one pair of structures can be used for any number of reads.
+ * 'valp' must be cleared by the caller, and have its key name filled in.
+ * The read itself is SMCReadWith() in libsmc.c, the same as for a handle.
  */
-kern_return_t SMCCall(int index, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+static kern_return_t readKey(UInt32 key, SMCVal_t *valp, SMCKeyData_t *inputp, SMCKeyData_t *outputp)
 {
-    kern_return_t	kernResult;
-    size_t  structureInputSize;
-    size_t  structureOutputSize;
-    
-    structureInputSize = sizeof(SMCKeyData_t);
-    structureOutputSize = sizeof(SMCKeyData_t);
-
-    // IOConnectMethodStructureIStructureO is depricated and no longer available
-    // See https://developer.apple.com/library/mac/samplecode/SimpleUserClient/Listings/SimpleUserClientInterface_c.html
-    // for an example of a replacement.
-    // This code is based on the SimpleUserClientInterface.c example mentioned above.
-    // It compiles differently for 32-bit and 64-bit targets
-    
-#if !defined(__LP64__)  // 32-bit mode?
-    // Check if Mac OS X 10.5 API is available...
-    if (IOConnectCallStructMethod != NULL) {
-        // ...and use it if it is.
-        kernResult =
-        IOConnectCallStructMethod(  conn,                   // an io_connect_t returned from IOServiceOpen().
-                                    index,                  // selector of the function to be called via the user client.
-                                    inputStructurep,         // pointer to the input struct parameter.
-                                    structureInputSize,     // the size of the input structure parameter.
-                                    outputStructurep,        // pointer to the output struct parameter.
-                                    &structureOutputSize	// pointer to the size of the output structure parameter.
-                                 );
-    }
-    else {
-        // Otherwise fall back to older API.
-        kernResult =
-        IOConnectMethodStructureIStructureO(    conn,					// an io_connect_t returned from IOServiceOpen().
-                                                index,                  // an index to the function to be called via the user client.
-                                                structureInputSize,     // the size of the input struct paramter.
-                                                &structureOutputSize,   // a pointer to the size of the output struct paramter.
-                                                inputStructurep,        // a pointer to the input struct parameter.
-                                                outputStructurep        // a pointer to the output struct parameter.
-                                           );
-    }
-#else // 64-bit mode
-    kernResult =
-    IOConnectCallStructMethod(  conn,                   // an io_connect_t returned from IOServiceOpen().
-                                index,                  // selector of the function to be called via the user client.
-                                inputStructurep,        // pointer to the input struct parameter.
-                                structureInputSize,     // the size of the input structure parameter.
-                                outputStructurep,       // pointer to the output struct parameter.
-                                &structureOutputSize	// pointer to the size of the output structure parameter.
-                                );
-#endif
+    kern_return_t result;
 
-    return kernResult;
+    result = SMCReadWith(&reader, NULL, key, valp, inputp, outputp);
+    if (result == kIOReturnSuccess)
+        knownStore(key, valp->bytes, valp->dataSize, 0);
+    return result;
 }
 
-
 /*
  * Read the specific SMC value for a given key
  * - Key is held in 'key' as a 4 character string, zero terminated
  * - The value is returned through 'valp'
  * Uses SMCCall() twice: first to get information about the value,
- * then to get the bytes of the value.
+ * then to get the bytes of the value. The first call is skipped if
+ * the information is in the key info cache.
  * If a call fails, returns the error code
  * If successful returns kIOReturnSuccess
  */
 kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t *valp)
 {
-    kern_return_t result;
     SMCKeyData_t  inputStructure;
     SMCKeyData_t  outputStructure;
 
@@ -381,49 +253,143 @@ kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t *valp)
     memset(&outputStructure, 0, sizeof(SMCKeyData_t));
     memset(valp, 0, sizeof(SMCVal_t));
 
-    // Convert 4 bytes in 'key' to an Int32, with key[0] as MSB
-    inputStructure.key = bytes2uint32(key, 4);
-
     // Also: print the Int32 as a string of characters into val->key ??
     // Is this intended as a simple string copy?
     strcpy(valp->key, key);
 
-    // Put the command to read info about the key in the inputStructure
-    inputStructure.data8 = SMC_CMD_READ_KEYINFO;
- 
-    // SMCCall with only the key filled in will fill outputStructure with:
-    // - dataSize
-    // - dataType
-    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
-    if (result != kIOReturnSuccess)
-        return result;  // Quit if call fails
-    
-    /**** Try this: read the 'result' entry in outputStructure to see if call was valid */
-    result = ((unsigned int)outputStructure.result) & 0xff; // Prevent unwanted sign extension
+    // Convert 4 bytes in 'key' to an Int32, with key[0] as MSB
+    return readKey(bytes2uint32(key, 4), valp, &inputStructure, &outputStructure);
+}
+
+/*
+ * Read the SMC values of several keys
+ * - The 'count' keys are held in 'keys', each a 4 character string, zero terminated
+ * - The values are returned through 'vals', the result of each read through 'results'
+ *   (both arrays of 'count' elements)
+ * Every key may only be given once. If a key appears more than once, nothing is read,
+ * the duplicates get kIOReturnBadArgument in 'results' and that is returned.
+ * The key info of each key is asked only once per run (see smccache.c), so reading
+ * a set of keys again costs one SMCCall() per key.
+ * Returns kIOReturnSuccess if all keys were read, otherwise the first error code
+ */
+kern_return_t SMCReadKeys(UInt32Char_t *keys, int count, SMCVal_t *vals, kern_return_t *results)
+{
+    kern_return_t result = kIOReturnSuccess;
+    SMCKeyData_t  inputStructure;
+    SMCKeyData_t  outputStructure;
+    int           i, j;
+
+    // Check for duplicates. The lists are short, so simply compare all pairs.
+    for (i = 0; i < count; i++)
+    {
+        results[i] = kIOReturnSuccess;
+        for (j = 0; j < i; j++)
+        {
+            if (strncmp(keys[i], keys[j], 4) == 0)
+            {
+                results[i] = kIOReturnBadArgument;
+                result = kIOReturnBadArgument;
+                break;
+            }
+        }
+    }
     if (result != kIOReturnSuccess)
-        return result;  // Quit if call fails
-    
-    // Remember the dataSize
-    valp->dataSize = outputStructure.keyInfo.dataSize;
-    
-    // Convert the UInt32 dataType to string of bytes in '* valp'
-    uint32tostr(valp->dataType, outputStructure.keyInfo.dataType);
+        return result;
 
-    // Set up inputStructure to read the actual value
-    inputStructure.keyInfo.dataSize = valp->dataSize;      /** WARNING: accepts any data size. Danger of array overflow **/
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
 
-    // Put the command to read value of the key in the inputStructure
-    inputStructure.data8 = SMC_CMD_READ_BYTES;
-    
-    // Read the value of the key
-    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+    for (i = 0; i < count; i++)
+    {
+        memset(&vals[i], 0, sizeof(SMCVal_t));
+        strncpy(vals[i].key, keys[i], 4);
+        results[i] = readKey(bytes2uint32(keys[i], 4), &vals[i], &inputStructure, &outputStructure);
+        if (results[i] != kIOReturnSuccess && result == kIOReturnSuccess)
+            result = results[i];
+    }
+    return result;
+}
+
+/*
+ * Write the values of several keys, in the order given
+ * - 'vals' holds 'count' values, each with the key, the size and the bytes
+ * - The result of each write is returned through 'results', and if 'written' is not
+ *   NULL, whether an SMC call was made for it (1) or not (0) through 'written'
+ * The batch is checked before anything is written: every key may only be given once
+ * (kIOReturnBadArgument otherwise), must exist, and the size must match its key info
+ * (kIOReturnError otherwise). If a key fails the check, nothing is written.
+ * A value that is the same as the last known value of the key, which is the last value
+ * written or read by this process, is not written again. Keys the SMC changes by itself
+ * (like the target speed of a fan in automatic mode) are only known again once read.
+ * If a write fails, the keys after it get kIOReturnAborted and are not written.
+ * The key info comes from the key info cache, so a write costs at most one SMCCall().
+ * Returns kIOReturnSuccess if all values were written (or did not need to be),
+ * otherwise the first error code
+ */
+kern_return_t SMCWriteKeys(SMCVal_t *vals, int count, kern_return_t *results, int *written)
+{
+    kern_return_t        result = kIOReturnSuccess;
+    SMCKeyData_t         inputStructure;
+    SMCKeyData_t         outputStructure;
+    SMCKeyData_keyInfo_t keyInfo;
+    UInt32               key;
+    int                  i, j;
+
+    // Check the whole batch first
+    for (i = 0; i < count; i++)
+    {
+        if (written != NULL)
+            written[i] = 0;
+        results[i] = SMCGetKeyInfo(bytes2uint32(vals[i].key, 4), &keyInfo);
+        if (results[i] == kIOReturnSuccess && keyInfo.dataSize != vals[i].dataSize)
+            results[i] = kIOReturnError;
+        for (j = 0; j < i && results[i] == kIOReturnSuccess; j++)
+        {
+            if (strncmp(vals[i].key, vals[j].key, 4) == 0)
+                results[i] = kIOReturnBadArgument;
+        }
+        if (results[i] != kIOReturnSuccess && result == kIOReturnSuccess)
+            result = results[i];
+    }
     if (result != kIOReturnSuccess)
-        return result;  // Quit if call fails
-    
-    // Bluntly copy bytes from outputStructure to 'val'
-    memcpy(valp->bytes, outputStructure.bytes, sizeof(outputStructure.bytes));
-    
-    return kIOReturnSuccess;
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (results[i] == kIOReturnSuccess)
+                results[i] = kIOReturnAborted;
+        }
+        return result;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        key = bytes2uint32(vals[i].key, 4);
+        if (result != kIOReturnSuccess)
+        {
+            results[i] = kIOReturnAborted;
+            continue;
+        }
+        if (knownEqual(key, vals[i].bytes, vals[i].dataSize))
+            continue;   // Nothing to do
+
+        memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+        memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+        inputStructure.key = key;
+        inputStructure.data8 = SMC_CMD_WRITE_BYTES;
+        inputStructure.keyInfo.dataSize = vals[i].dataSize;
+        memcpy(inputStructure.bytes, vals[i].bytes, sizeof(vals[i].bytes));
+
+        results[i] = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+        if (results[i] == kIOReturnSuccess)
+            results[i] = ((unsigned int)outputStructure.result) & 0xff;    // An SMC result code, like SMC_RESULT_KEY_NOT_WRITABLE
+        if (written != NULL)
+            written[i] = 1;
+        if (results[i] == kIOReturnSuccess)
+            knownStore(key, vals[i].bytes, vals[i].dataSize, 1);
+        else
+            result = results[i];
+    }
+    return result;
 }
 
 /*
@@ -431,134 +397,410 @@ kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t *valp)
  * - Key is held in writeVal.key as a 4 character string, zero terminated
  * - The value is held in writeVal.bytes
  * To be succesful:
- * - They key must already exist and have a value
- * - The dataSize of the value to write must be equal to the existing value
+ * - They key must already exist
+ * - The dataSize of the value to write must be equal to the size of the key
  * Returns an error code if either of these conditions is not met
  * If a call fails, returns the error code
  * If successful returns kIOReturnSuccess
+ * See SMCWriteKeys(), which this uses.
  */
 kern_return_t SMCWriteKey(SMCVal_t writeVal)
 {
     kern_return_t result;
-    SMCKeyData_t  inputStructure;
-    SMCKeyData_t  outputStructure;
-    
-    SMCVal_t      readVal;
-    
-    result = SMCReadKey(writeVal.key, &readVal);
-    if (result != kIOReturnSuccess) 
-        return result;
-    
-    if (readVal.dataSize != writeVal.dataSize)
-        return kIOReturnError;
-    
-    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
-    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
-    
-    inputStructure.key = bytes2uint32(writeVal.key, 4);
-    inputStructure.data8 = SMC_CMD_WRITE_BYTES;    
-    inputStructure.keyInfo.dataSize = writeVal.dataSize;
-    memcpy(inputStructure.bytes, writeVal.bytes, sizeof(writeVal.bytes));
-    
-    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
-    if (result != kIOReturnSuccess)
-        return result;
-    
-    return kIOReturnSuccess;
+
+    SMCWriteKeys(&writeVal, 1, &result, NULL);
+    return result;
 }
 
 
 /*
  * Find the total number of keys in SMC
  * - Use the special key "#KEY" to get the number
+ *   (unless the key info cache already read it)
  * - Convert to an int
  */
 UInt32 SMCReadIndexCount(void)
 {
     SMCVal_t val;
     
+    if (SMCCacheKeyCount() > 0)
+        return SMCCacheKeyCount();
     SMCReadKey("#KEY", &val);
     return bytes2uint32(val.bytes, val.dataSize);
 }
 
 /*
- * Print all SMC values
+ * Get the name of the key with index 'index' into 'keyp'
+ * Takes it from the key info cache if the SMC was asked for it before, otherwise asks the SMC.
+ * If the call fails, returns the error code
+ */
+kern_return_t SMCGetKeyAtIndex(int index, UInt32 *keyp)
+{
+    kern_return_t result;
+    SMCKeyData_t  inputStructure;
+    SMCKeyData_t  outputStructure;
+
+    if (!SMCCacheKeyAt(index, keyp))
+    {
+        memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+        memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+
+        inputStructure.data8 = SMC_CMD_READ_INDEX;  // Set command to read
+        inputStructure.data32 = index;              // Set key index number
+
+        result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+        if (result != kIOReturnSuccess)
+            return result;
+        *keyp = outputStructure.key;
+        if (outputStructure.result == SMC_RESULT_SUCCESS)
+            SMCCacheStoreIndex(index, *keyp);
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Find the indexes of the keys from 'low' up to and including 'high' among the 'totalKeys' keys:
+ * they are the indexes from '*firstp' up to (not including) '*lastp'
+ * The SMC numbers its keys in sorted order, so two binary searches over the index find them,
+ * reading about 2 * log2('totalKeys') key names instead of all of them.
+ * If a key name can not be read, returns the error code.
+ */
+kern_return_t SMCFindKeyRange(UInt32 low, UInt32 high, int totalKeys, int *firstp, int *lastp)
+{
+    kern_return_t result;
+    UInt32        keyValue;
+    int           lo, hi, mid;
+
+    // The first key not below 'low'
+    for (lo = 0, hi = totalKeys; low > 0 && lo < hi; )
+    {
+        mid = lo + (hi - lo) / 2;
+        result = SMCGetKeyAtIndex(mid, &keyValue);
+        if (result != kIOReturnSuccess)
+            return result;
+        if (keyValue < low)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *firstp = lo;
+
+    // The first key above 'high'
+    for (hi = totalKeys; high < 0xffffffff && lo < hi; )
+    {
+        mid = lo + (hi - lo) / 2;
+        result = SMCGetKeyAtIndex(mid, &keyValue);
+        if (result != kIOReturnSuccess)
+            return result;
+        if (keyValue <= high)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *lastp = high < 0xffffffff ? lo : totalKeys;
+    return kIOReturnSuccess;
+}
+
+/*
+ * Turn 'spec' into the lowest and highest key it stands for, in '*lowp' and '*highp'
+ * - a prefix of up to 4 characters, like "T" or "F1": all keys starting with it
+ * - a range "<from>-<to>" of two prefixes, like "F0-F2" or "TC0H-TG": the keys from
+ *   'from' up to and including those starting with 'to'
+ * - "" stands for all keys
+ * Returns 0 if 'spec' is neither.
+ */
+int SMCParseKeyRange(const char *spec, UInt32 *lowp, UInt32 *highp)
+{
+    const char *dash = strchr(spec, '-');
+    size_t      lenLow, lenHigh;
+    int         i;
+
+    // A dash at the start or end is part of a prefix
+    if (dash != NULL && dash != spec && dash[1] != '\0')
+    {
+        lenLow = dash - spec;
+        lenHigh = strlen(dash + 1);
+    }
+    else
+    {
+        dash = NULL;
+        lenLow = lenHigh = strlen(spec);
+    }
+    if (lenLow > 4 || lenHigh > 4)
+        return 0;
+
+    *lowp = 0;
+    *highp = 0;
+    for (i = 0; i < 4; i++)
+    {
+        *lowp = (*lowp << 8) | (i < lenLow ? (unsigned char)spec[i] : 0x00);
+        *highp = (*highp << 8) | (i < lenHigh ? (unsigned char)(dash != NULL ? dash + 1 : spec)[i] : 0xff);
+    }
+    return *lowp <= *highp;
+}
+
+/*
+ * Tell whether the key in 'valp' matches the glob 'pattern' (see fnmatch(3))
+ * A pattern without a space is matched against the name of the key, like "T?0H";
+ * one with a space against the name, a space and the type without trailing spaces,
+ * like "* sp78" or "F?Ac fpe2".
+ */
+static int listMatch(const char *pattern, const SMCVal_t *valp)
+{
+    char subject[sizeof(UInt32Char_t) * 2];
+    int  len;
+
+    if (strchr(pattern, ' ') == NULL)
+        return fnmatch(pattern, valp->key, 0) == 0;
+    len = snprintf(subject, sizeof(subject), "%s %s", valp->key, valp->dataType);
+    while (len > 0 && subject[len - 1] == ' ')
+        subject[--len] = '\0';
+    return fnmatch(pattern, subject, 0) == 0;
+}
+
+/*
+ * Read the name of the key with index 'index' into 'valp', and as much more as 'detail' asks for
+ * - SMC_LIST_VALUES: its type and value, SMC_LIST_TYPES: its type and size,
+ *   SMC_LIST_NAMES: nothing more
+ * - 'pattern', unless NULL, is a filter (see listMatch()). The type is only read if the
+ *   pattern or 'detail' needs it, and the value only if the key matches.
+ * Returns the error code if the name can not be read, and kIOReturnNotFound if the key
+ * does not match or its type can not be read for the pattern.
+ * Otherwise kIOReturnSuccess is returned, and the result of reading the type or value goes
+ * into '*resultp'; if that is an error 'valp' holds only the name.
+ */
+static kern_return_t listKeyAtIndex(int index, int detail, const char *pattern,
+                                    SMCVal_t *valp, kern_return_t *resultp)
+{
+    kern_return_t         result;
+    UInt32Char_t          key;
+    UInt32                keyValue;
+    SMCKeyData_keyInfo_t  keyInfo;
+    int                   needType;
+
+    // Clear all the data
+    memset(valp, 0, sizeof(SMCVal_t));
+
+    // Get the key name
+    result = SMCGetKeyAtIndex(index, &keyValue);
+    if (result != kIOReturnSuccess)
+        return result;
+
+    // Convert the key name into a string of 4 bytes
+    uint32tostr(key, keyValue);
+
+    // Read the value associated with the key
+    if (detail == SMC_LIST_VALUES && pattern == NULL)
+    {
+        *resultp = SMCReadKey(key, valp);
+        return kIOReturnSuccess;
+    }
+
+    // The name, and the type if the pattern or 'detail' asks for it, then the value
+    strcpy(valp->key, key);
+    needType = pattern != NULL && strchr(pattern, ' ') != NULL;
+    if (pattern != NULL && !needType && !listMatch(pattern, valp))
+        return kIOReturnNotFound;
+    *resultp = kIOReturnSuccess;
+    if (needType || detail == SMC_LIST_TYPES)
+    {
+        *resultp = SMCGetKeyInfo(keyValue, &keyInfo);
+        if (*resultp == kIOReturnSuccess)
+        {
+            uint32tostr(valp->dataType, keyInfo.dataType);
+            valp->dataSize = keyInfo.dataSize;
+        }
+        else if (needType)
+            return kIOReturnNotFound;
+        if (needType && !listMatch(pattern, valp))
+            return kIOReturnNotFound;
+    }
+    if (detail == SMC_LIST_VALUES)
+        *resultp = SMCReadKey(key, valp);
+    return kIOReturnSuccess;
+}
+
+// A share of the keys for one connection in SMCReadAll()
+typedef struct {
+    int           first;        // First key index
+    int           last;         // One past the last key index
+    int           base;         // Key index of the first element of the arrays
+    int           detail;       // What to read of every key, see listKeyAtIndex()
+    const char   *pattern;
+    SMCVal_t     *vals;         // Values of all keys, by index - 'base'
+    char         *found;        // found[i] is set if the name of key 'base' + i could be read
+    kern_return_t *results;     // Results of reading the values, by index - 'base'
+    int           opened;       // Set if the worker had its own connection
+} SMCListShare_t;
+
+/*
+ * Read the keys of one share, on a connection of its own
+ * If no connection can be opened, 'opened' stays 0 and the share is left undone.
+ */
+static void *listWorker(void *arg)
+{
+    SMCListShare_t *share = arg;
+    int             i;
+
+    if (SMCOpen(&conn) != kIOReturnSuccess)
+        return NULL;
+    share->opened = 1;
+    for (i = share->first; i < share->last; i++)
+        share->found[i - share->base] = (listKeyAtIndex(i, share->detail, share->pattern, &share->vals[i - share->base],
+                                                        &share->results[i - share->base]) == kIOReturnSuccess);
+    SMCClose(conn);
+    return NULL;
+}
+
+/*
+ * Read the names and values of the keys with index 'first' to 'last' - 1
+ * - 'detail' and 'pattern' tell what to read of every key (see listKeyAtIndex());
+ *   SMC_LIST_VALUES and NULL read all values
+ * - found[i] is set if the name of key 'first' + i could be read (and it matches);
+ *   then vals[i] holds its value, and results[i] the result of reading that
+ * - 'connections' is the number of SMC connections to read the keys over.
+ *   With more than one, the key indexes are split in equal ranges, each read by
+ *   its own thread on its own connection.
+ *   The first range is read on the existing connection.
+ */
+void SMCReadAll(int connections, int first, int last, int detail, const char *pattern,
+                SMCVal_t *vals, char *found, kern_return_t *results)
+{
+    int             i, n, totalKeys = last - first;
+    SMCListShare_t  shares[MAXCONNECTIONS];
+    pthread_t       threads[MAXCONNECTIONS];
+    int             started[MAXCONNECTIONS];
+
+    if (connections > MAXCONNECTIONS)
+        connections = MAXCONNECTIONS;
+    if (connections > totalKeys)
+        connections = totalKeys;
+    if (connections < 1)
+        connections = 1;
+
+    // Split up the work and start a thread for every share but the first
+    for (n = 0; n < connections; n++)
+    {
+        shares[n].first = first + (int)((long)totalKeys * n / connections);
+        shares[n].last = first + (int)((long)totalKeys * (n + 1) / connections);
+        shares[n].base = first;
+        shares[n].detail = detail;
+        shares[n].pattern = pattern;
+        shares[n].vals = vals;
+        shares[n].found = found;
+        shares[n].results = results;
+        shares[n].opened = 0;
+        started[n] = n > 0 && pthread_create(&threads[n], NULL, listWorker, &shares[n]) == 0;
+    }
+
+    // The first share, and any share whose thread or connection failed, is done here
+    for (n = 0; n < connections; n++)
+    {
+        if (started[n])
+            pthread_join(threads[n], NULL);
+        if (!shares[n].opened)
+        {
+            for (i = shares[n].first; i < shares[n].last; i++)
+                found[i - first] = (listKeyAtIndex(i, detail, pattern, &vals[i - first],
+                                                   &results[i - first]) == kIOReturnSuccess);
+        }
+    }
+}
+
+/*
+ * Print all SMC values
+ * - 'connections' is the number of SMC connections to read the keys over (see SMCReadAll()).
+ *   With more than one, the values are collected and printed in index order afterwards,
+ *   so the output is the same as with one connection.
+ */
+kern_return_t SMCPrintAll(int connections)
+{
+    return SMCPrintRange(connections, 0, 0xffffffff, SMC_LIST_VALUES, NULL);
+}
+
+/*
+ * Print the SMC values of the keys from 'low' up to and including 'high' (see SMCParseKeyRange())
+ * - 'connections' as for SMCPrintAll()
+ * - 'detail' is SMC_LIST_VALUES to print the values, SMC_LIST_TYPES to print only the names
+ *   and types, and SMC_LIST_NAMES to print only the names; the latter two read no values
+ * - 'pattern', unless NULL, selects the keys to print (see listMatch()); only their values are read
+ * Only the keys in the range are read; SMCFindKeyRange() finds their indexes.
  */
-kern_return_t SMCPrintAll(void)
+kern_return_t SMCPrintRange(int connections, UInt32 low, UInt32 high, int detail, const char *pattern)
 {
-    kern_return_t result;
-    SMCKeyData_t  inputStructure;
-    SMCKeyData_t  outputStructure;
+    int             totalKeys, first, last, i;
+    SMCVal_t        val;
+    SMCVal_t       *vals;
+    char           *found;
+    kern_return_t   result, *results;
     
-    int           totalKeys, i;
-    UInt32Char_t  key;
-    SMCVal_t      val;
-    
-    // Find the total number of keys in SMC
+    // Find the total number of keys in SMC, and those in the range
     totalKeys = SMCReadIndexCount();
-    
-    // Iterate through all of the keys
-    for (i = 0; i < totalKeys; i++)
+    result = SMCFindKeyRange(low, high, totalKeys, &first, &last);
+    if (result != kIOReturnSuccess)
+        return result;
+
+    if (connections <= 1 || last - first <= 1)
     {
-        // Clear all the data
-        memset(&inputStructure, 0, sizeof(SMCKeyData_t));
-        memset(&outputStructure, 0, sizeof(SMCKeyData_t));
-        memset(&val, 0, sizeof(SMCVal_t));
-        
-        inputStructure.data8 = SMC_CMD_READ_INDEX;  // Set command to read
-        inputStructure.data32 = i;                  // Set key index number
+        // Iterate through the keys
+        for (i = first; i < last; i++)
+        {
+            if (listKeyAtIndex(i, detail, pattern, &val, &result) != kIOReturnSuccess)
+                /*
+                 * == Improvement: print an error "Failed to read key name with index %d; Error code%d\n"
+                 */
+                continue; // on error skip the rest of the loop and go back to 'for'
 
-        // Get the key name
-        result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
-        if (result != kIOReturnSuccess)
-            /*
-             * == Improvement: print an error "Failed to read key name with index %d; Error code%d\n"
-             */
-            continue; // on error skip the rest of the loop and go back to 'for'
-
-        // Convert the key name into a string of 4 bytes
-        uint32tostr(key, outputStructure.key);
-
-        // Read the value associated with the key
-        result = SMCReadKey(key, &val); // (ignore the result code)
-        /*
-         * == Improvement: print an error "Failed to read value of key %s; Error code %d\n"
+            // Print the value
+            if (detail == SMC_LIST_VALUES)
+                SMCOutValue(&val, result);
+            else
+                SMCOutKey(&val, result, detail == SMC_LIST_TYPES);
+        }
+        /* == Improvement: count the nr of errors, both from SMCCall and SMCReadKey
+         *                 and print them out.
          */
-        
-        // Print the value
-        printVal(val);
+        return kIOReturnSuccess; // Always return succes :-(
     }
-    
-    /* == Improvement: count the nr of errors, both from SMCCall and SMCReadKey
-     *                 and print them out.
-     */
-    return kIOReturnSuccess; // Always return succes :-(
+
+    vals = malloc((last - first) * sizeof(SMCVal_t));
+    found = calloc(last - first, 1);
+    results = malloc((last - first) * sizeof(kern_return_t));
+    if (vals == NULL || found == NULL || results == NULL)
+    {
+        free(vals);
+        free(found);
+        free(results);
+        return kIOReturnNoMemory;
+    }
+
+    SMCReadAll(connections, first, last, detail, pattern, vals, found, results);
+    for (i = 0; i < last - first; i++)
+    {
+        if (found[i] && detail == SMC_LIST_VALUES)
+            SMCOutValue(&vals[i], results[i]);
+        else if (found[i])
+            SMCOutKey(&vals[i], results[i], detail == SMC_LIST_TYPES);
+    }
+    free(vals);
+    free(found);
+    free(results);
+    return kIOReturnSuccess;
 }
 
 /*
- *
+ * Print one line of fan information
+ * - 'val' is the value of the key, and 'result' the result of reading it
+ * - 'description' tells what the value is
  */
-kern_return_t printFan(int fan, char * keyformat, char * description)
+void printFan(SMCVal_t val, kern_return_t result, char * description)
 {
-    kern_return_t result;
-    SMCVal_t      val;
-    UInt32Char_t  key;
-
-    // Construct the key name from the fan number
-    sprintf(key, keyformat, fan);
-
-    // Get the key value
-    result = SMCReadKey(key, &val);
-    
     // Print the description, nicely alligned
-    printf("    %-13s: ", description);
     if (result == kIOReturnSuccess) {
-        printf("%.2f\n", val2float(val) );
+        SMCOutPrintf("    %-13s: %.2f\n", description, val2float(&val));
     } else {
-        printf("Not available\n");
+        SMCOutPrintf("    %-13s: Not available\n", description);
     }
-    
-    return result;
 }
 
 /*
@@ -567,11 +809,19 @@ kern_return_t printFan(int fan, char * keyformat, char * description)
  */
 kern_return_t SMCPrintFans(void)
 {
+    // The keys read for every fan, and their descriptions
+    static char *fanKeys[] = { "F%dID", "F%dMn", "F%dMx", "F%dSf", "F%dTg", "F%dAc" };
+    static char *fanDescriptions[] = { NULL, "Minimum speed", "Maximum speed", "Safe speed", "Target speed", "Actual speed" };
+    #define FANKEYCOUNT (sizeof(fanKeys) / sizeof(fanKeys[0]))
+
     kern_return_t result;
     SMCVal_t      val;
     int           totalFans;
-    UInt32Char_t  key;
-    int           i;
+    UInt32Char_t  keys[FANKEYCOUNT];
+    SMCVal_t      vals[FANKEYCOUNT];
+    kern_return_t results[FANKEYCOUNT];
+    SMCVal_t      modeVal;
+    int           i, j;
     
     // Find the number of fans
     result = SMCReadKey("FNum", &val);
@@ -579,33 +829,95 @@ kern_return_t SMCPrintFans(void)
         return kIOReturnError;
     
     totalFans = bytes2uint32(val.bytes, val.dataSize);
-    printf("Total fans in system: %d\n", totalFans);
+    if (totalFans > MAXFANS)
+        totalFans = MAXFANS;    // The others have no key names
+
+    // Bits in the "FS! " value determine if a fan is in
+    // auto mode or forced mode. One value holds the bits for all fans.
+    result = SMCReadKey("FS! ", &modeVal);
+
+    // The machine readable formats get the values of all keys read
+    if (SMCOutFormat() != SMC_OUT_TEXT)
+    {
+        SMCOutValue(&val, kIOReturnSuccess);
+        SMCOutValue(&modeVal, result);
+        for (i = 0; i < totalFans; i++)
+        {
+            for (j = 0; j < FANKEYCOUNT; j++)
+                snprintf(keys[j], sizeof(keys[j]), fanKeys[j], i);
+            SMCReadKeys(keys, FANKEYCOUNT, vals, results);
+            for (j = 0; j < FANKEYCOUNT; j++)
+                SMCOutValue(&vals[j], results[j]);
+        }
+        return kIOReturnSuccess;
+    }
+
+    SMCOutPrintf("Total fans in system: %d\n", totalFans);
     
     // Print information of each fan
     for (i = 0; i < totalFans; i++)
     {
-        printf("\nFan #%d:", i);
-        sprintf(key, "F%dID", i);
-        result = SMCReadKey(key, &val);
-        printf(" %s\n", &val.bytes[4]);
-        printFan(i, "F%dMn", "Minimum speed");
-        printFan(i, "F%dMx", "Maximum speed");
-        printFan(i, "F%dSf", "Safe speed");
-        printFan(i, "F%dTg", "Target speed");
-        printFan(i, "F%dAc", "Actual speed");
+        for (j = 0; j < FANKEYCOUNT; j++)
+            snprintf(keys[j], sizeof(keys[j]), fanKeys[j], i);
+        SMCReadKeys(keys, FANKEYCOUNT, vals, results);
+
+        SMCOutPrintf("\nFan #%d: %s\n", i, &vals[0].bytes[4]);
+        for (j = 1; j < FANKEYCOUNT; j++)
+            printFan(vals[j], results[j], fanDescriptions[j]);
         
-        // Bits in the "FS! " value determine if a fan is in
-        // auto mode or forced mode.
-        SMCReadKey("FS! ", &val);
-        if ((bytes2uint32(val.bytes, 2) & (1 << i)) == 0)
-            printf("    Mode         : auto\n"); 
+        if ((bytes2uint32(modeVal.bytes, 2) & (1 << i)) == 0)
+            SMCOutPrintf("    Mode         : auto\n");
         else
-            printf("    Mode         : forced\n");
+            SMCOutPrintf("    Mode         : forced\n");
     }
     
     return kIOReturnSuccess;
 }
 
+/*
+ * Write the 'count' values in 'vals' with SMCWriteKeys(), and print what became of each
+ * Returns the result of SMCWriteKeys().
+ */
+kern_return_t SMCPrintWrites(SMCVal_t *vals, int count)
+{
+    SMCKeyData_keyInfo_t keyInfo;
+    kern_return_t        result, *results;
+    int                  i, *written;
+
+    results = malloc(count * sizeof(kern_return_t));
+    written = malloc(count * sizeof(int));
+    if (results == NULL || written == NULL)
+    {
+        free(results);
+        free(written);
+        return kIOReturnNoMemory;
+    }
+
+    // In the order given; nothing is written if a key or size is wrong
+    result = SMCWriteKeys(vals, count, results, written);
+    for (i = 0; i < count; i++)
+    {
+        if (SMCOutFormat() != SMC_OUT_TEXT)
+        {
+            // The value written, with the result of writing it
+            if (SMCGetKeyInfo(bytes2uint32(vals[i].key, 4), &keyInfo) == kIOReturnSuccess)
+                uint32tostr(vals[i].dataType, keyInfo.dataType);
+            SMCOutValue(&vals[i], results[i]);
+        }
+        else if (results[i] == kIOReturnSuccess)
+            SMCOutPrintf("  %s  %s\n", vals[i].key, written[i] ? "written" : "unchanged");
+        else if (results[i] == kIOReturnAborted)
+            SMCOutPrintf("  %s  not written\n", vals[i].key);
+        else if (results[i] == kIOReturnBadArgument)
+            SMCOutPrintf("Error: key '%s' given more than once\n", vals[i].key);
+        else
+            SMCOutPrintf("Error: SMCWriteKey() = %08x for key '%s'\n", results[i], vals[i].key);
+    }
+    free(results);
+    free(written);
+    return result;
+}
+
 
 /*
  * Print better help info
@@ -620,20 +932,110 @@ void usage(char* prog)
     printf("Apple System Management Control (SMC) tool, version %s\n", VERSION);
     printf("Usage:\n");
     printf("%s [options]\n", prog);
+    printf("    -b <rpm>   : with -C, only change a fan target by at least <rpm> (default 50)\n");
+    printf("    -B <calls> : with -W, make at most <calls> SMC calls per second; keys with a lower\n");
+    printf("                 priority are read less often when the budget is short\n");
+    printf("    -c <file>  : cache key information in <file>\n");
+    printf("    -C <temp>  : control the fans to keep the hottest -k key at <temp> degrees Celsius\n");
+    printf("    -d <socket>: run as a daemon, serving other smc processes on <socket>\n");
+    printf("    -D [<key>=]<change>: with -W, only print values that changed by more than <change>,\n");
+    printf("                 like 0.5 or 2%%, for <key> or for all keys; -D 0 prints every change\n");
     printf("    -f         : show decoded fan information\n");
+    printf("    -g <p,i,d> : with -C, the PID gains (default 0.05,0.005,0)\n");
     printf("    -h         : help\n");
-    printf("    -k <key>   : key to manipulate\n");
-    printf("    -l         : list all keys and values\n");
+    printf("    -H <n>     : with -W, only print changes, and all values every <n> samples\n");
+    printf("    -i <ms>    : with -P, write the file every <ms> milliseconds (default 15000);\n");
+    printf("                 with -C, run the control loop every <ms> milliseconds (default 1000)\n");
+    printf("    -j <n>     : use <n> SMC connections in parallel for -l\n");
+    printf("    -k <key>   : key to manipulate; give -k more than once to read several keys\n");
+    printf("    -k <key>@<ms>[:<prio>] : with -W, sample <key> every <ms> milliseconds (0: only once),\n");
+    printf("                 with priority <prio> for -B (default 0; lower is more important)\n");
+    printf("    -l [<keys>]: list all keys and values, or only the keys starting with the prefix <keys>,\n");
+    printf("                 like T, or in the range <keys>, like F0-F2 or TC0H-TG\n");
+    printf("    -n <count> : with -W, -P or -C, stop after <count> samples\n");
+    printf("    -o <file>  : with -W, write the samples to the binary log <file>;\n");
+    printf("                 with -l, write a snapshot of all keys to <file>\n");
+    printf("    -P <file>  : export fans, temperatures and power (and -k keys) for Prometheus to <file>\n");
     printf("    -r         : read the value of a key\n");
+    printf("    -R <file>  : print the samples in the binary log <file>\n");
+    printf("    -s <file>  : use a simulated SMC with the keys listed in <file>\n");
+    printf("    -S         : print statistics of the SMC calls on stderr when done (JSON with --json)\n");
+    printf("    -t <ms>    : with -d, reuse values read less than <ms> milliseconds ago (default 100)\n");
+    printf("    -u <socket>: use the smc daemon on <socket> instead of opening the SMC\n");
     printf("    -w <value> : write the specified value to a key\n");
+    printf("    -w <key>=<value> : write <value> to <key>; give it more than once to write several keys\n");
+    printf("    -W <ms>    : watch the -k keys, sampling them every <ms> milliseconds\n");
     printf("    -v         : print version\n");
-    printf("Use only one of -f -h -l -r -w at the same time\n");
-    printf("The -r and -w options require a -k option.\n");
+    printf("    --json     : print the values of -l, -r, -w and -f as a JSON array\n");
+    printf("    --ndjson   : print the values of -l, -r, -w and -f as JSON, one object per line\n");
+    printf("    --csv      : print the values of -l, -r, -w and -f as CSV\n");
+    printf("    --batch[=<file>] : run the commands in <file>, or read from stdin, on one connection\n");
+    printf("    --record=<file> : record all SMC calls to the trace <file>\n");
+    printf("    --replay=<file> : answer all SMC calls from the trace <file> instead of an SMC\n");
+    printf("    --replay-speed=<x> : with --replay, make the calls take the recorded time divided by <x>\n");
+    printf("                 (default 0: as fast as possible)\n");
+    printf("    --names    : with -l, list only the names of the keys; reads no values\n");
+    printf("    --types    : with -l, list only the names, types and sizes of the keys; reads no values\n");
+    printf("    --match=<pattern> : with -l, list only the keys matching the glob <pattern>, like 'F?Ac',\n");
+    printf("                 or with a space, the key and type, like '* sp78'; reads only their values\n");
+    printf("    --diff <snapshot> <snapshot>... : print the keys that differ between the first snapshot\n");
+    printf("                 and each of the others; exits with 1 if any differ\n");
+    printf("    --bench[=<ms>] : time the helpers and SMC operations, <ms> milliseconds each (default 500);\n");
+    printf("                 use -s with SMCSIM_LATENCY for a simulated SMC of a given latency\n");
+    printf("    --selftest : check the value decoders against the original val2float(), for all values\n");
+    printf("                 of all 16 bit fixed point types; with -s also run fan control against the\n");
+    printf("                 simulated SMC, with and without faults; exits with 1 if any check fails\n");
+    printf("Use only one of -C -d -f -h -l -P -r -R -w -W --batch --bench --diff --selftest at the same time\n");
+    printf("The -C, -r, -w <value> and -W options require a -k option. -C, -r and -W accept up to %d of them.\n", MAXKEYS);
     printf("<key> must be an existing key.\n");
     printf("<value> must be a string of an even number of hexadecimal digits.\n");
     printf("\n");
 }
 
+/*
+ * Convert the value of -w, a string of an even number of hexadecimal digits,
+ * into the bytes and size of '*valp'
+ * Returns 1 if successful, otherwise prints an error and returns 0.
+ */
+int parseValue(const char *hex, SMCVal_t *valp)
+{
+    int          i;
+    unsigned int l;  // length of the value string
+
+    l = (unsigned int)strlen(hex);
+
+    // check if value is all hex digits
+    for (i = 0; i < l; i++) {
+        int d;
+        d = hex2int(hex[i]);
+        if (d < 0) {
+            break;  // Get out of loop if not a hex character
+        }
+    }
+    if (i < l) {    // We did not make it to the end of the string
+        fprintf(stderr, "Error: Non hex digit found in value for -w. Found: '%s'\n", hex);
+        return 0;
+    }
+    if (l != (2 * (l/2))) { // Not an even number of digits
+        fprintf(stderr, "Error: value for -w must be an even number of hex digits. Found: '%s'\n", hex);
+        return 0;
+    }
+    if (l/2 > BYTECOUNT) { // Too many digits to fit into val.bytes[]
+        fprintf(stderr, "Error: value for -w too long; Only room for %d bytes (%d hex digits)\n", BYTECOUNT, 2*BYTECOUNT);
+        return 0;
+    }
+
+    // Convert hex digits into bytes
+    // go through the characters of <value> two by two
+    // i denotes the pair of digits and the byte
+    for (i = 0; i < l/2; i++)
+    {
+        valp->bytes[i] = 16 * hex2int(hex[2*i]) + hex2int(hex[2*i + 1]);
+    }
+    valp->dataSize = l / 2;   // Size in bytes: two hex characters form one byte
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
@@ -643,22 +1045,252 @@ int main(int argc, char *argv[])
     kern_return_t result;
     int           op = OP_NONE; // The operarion to execute
     UInt32Char_t  key = "\0";  // Can hold 4 bytes and a terminating \0
+    UInt32Char_t  keys[MAXKEYS];   // All keys given with -k
+    int           nkeys = 0;
     SMCVal_t      val;         // Struct to hold key, size, data type and 32 bytes
+    SMCVal_t      vals[MAXKEYS];
+    SMCVal_t      writeVals[MAXKEYS]; // Values given with -w <key>=<value>
+    int           nwrites = 0;
+    kern_return_t results[MAXKEYS];
+    int           i;
+    char          *simfile = NULL; // Key list for the simulated SMC (-s)
+    char          *cachefile = NULL; // Key info cache (-c)
+    int           connections = 1; // Number of SMC connections for -l (-j)
+    char          *daemonsocket = NULL; // Socket to serve on (-d)
+    char          *clientsocket = NULL; // Socket of the daemon to use (-u)
+    int           ttl = 100;       // Time-to-live of values cached by the daemon (-t)
+    double        interval = 0;    // Sample interval in milliseconds (-W)
+    unsigned long samples = 0;     // Number of samples to take, 0 for no limit (-n)
+    char          *logfile = NULL; // Binary log to write (-W -o) or read (-R), or snapshot (-l -o)
+    char          *exportfile = NULL; // Prometheus textfile (-P)
+    char          *batchfile = NULL; // File with commands (--batch), NULL for stdin
+    int           benchtime = 500; // Milliseconds per benchmark (--bench)
+    char          *recordfile = NULL; // Trace to record the SMC calls to (--record)
+    UInt32        low = 0, high = 0xffffffff; // Keys to list (-l <prefix or range>)
+    int           detail = SMC_LIST_VALUES; // What -l reads of every key (--names, --types)
+    char          *pattern = NULL; // Keys -l reads the values of (--match)
+    char          *snapfile = NULL; // Snapshot to compare the others with (--diff)
+    char          *replayfile = NULL; // Trace to answer the SMC calls from (--replay)
+    double        speed = 0;       // Replay speed, 0 for as fast as possible (--replay-speed)
+    SMCDeadband_t bands[MAXKEYS + 1]; // Deadbands given with -D; -1 for a part not given
+    UInt32Char_t  bandKeys[MAXKEYS + 1]; // Their keys, empty for all keys
+    int           nbands = 0;
+    SMCDeadband_t deadbands[MAXKEYS]; // Deadband of each -k key for -W
+    double        periods[MAXKEYS]; // Period in milliseconds of each -k key (-k <key>@<ms>), -1 if not given
+    int           priorities[MAXKEYS]; // Priority of each -k key (-k <key>@<ms>:<prio>)
+    int           scheduled = 0;   // A period given with -k
+    SMCSchedule_t schedule[MAXKEYS]; // Period and priority of each -k key for -W
+    double        budget = 0;      // Largest number of SMC calls per second for -W (-B), 0 for no limit
+    unsigned long heartbeat = 0;   // Print all values every this many samples (-H), 0 for never
+    double        repeatInterval = 0; // Interval in milliseconds for -P and -C (-i), 0 for the default
+    double        setpoint = 0;    // Temperature to keep (-C)
+    double        gains[3] = { 0.05, 0.005, 0 }; // PID gains for -C (-g)
+    double        deadband = 50;   // Smallest fan target change written by -C (-b)
+    char          *end;
+    char          *value;
+    double        change;
+    char          trailing;        // Anything after the value of -g
+    int           format = SMC_OUT_TEXT; // Output format (--json, --ndjson, --csv)
+    static struct option longOptions[] = {
+        { "json",   no_argument, NULL, SMC_OUT_JSON   + 256 },
+        { "ndjson", no_argument, NULL, SMC_OUT_NDJSON + 256 },
+        { "csv",    no_argument, NULL, SMC_OUT_CSV    + 256 },
+        { "batch",  optional_argument, NULL, OPT_BATCH },
+        { "bench",  optional_argument, NULL, OPT_BENCH },
+        { "record", required_argument, NULL, OPT_RECORD },
+        { "replay", required_argument, NULL, OPT_REPLAY },
+        { "replay-speed", required_argument, NULL, OPT_SPEED },
+        { "diff",   required_argument, NULL, OPT_DIFF },
+        { "names",  no_argument, NULL, OPT_NAMES },
+        { "types",  no_argument, NULL, OPT_TYPES },
+        { "match",  required_argument, NULL, OPT_MATCH },
+        { "selftest", no_argument, NULL, OPT_SELFTEST },
+        { NULL,     0,           NULL, 0 }
+    };
 
     // Process the options. Reminder: the ':' denotes a required argument
-    while ((c = getopt(argc, argv, "fhk:lrw:v")) != -1)
+    while ((c = getopt_long(argc, argv, "b:B:c:C:d:D:fg:hH:i:j:k:ln:o:P:rR:s:St:u:w:W:v", longOptions, NULL)) != -1)
     {
         switch(c)
         {
+            case SMC_OUT_JSON + 256:
+            case SMC_OUT_NDJSON + 256:
+            case SMC_OUT_CSV + 256:
+                format = c - 256;
+                break;
+            case 'b':
+                deadband = strtod(optarg, &end);
+                if (*end != '\0' || deadband < 0) {
+                    fprintf(stderr, "Error: value for -b must be a number of RPM. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_BATCH:
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_BATCH;
+                batchfile = optarg;
+                break;
+            case OPT_BENCH:
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_BENCH;
+                if (optarg != NULL) {
+                    benchtime = (int)strtol(optarg, &end, 10);
+                    if (*end != '\0' || benchtime < 1) {
+                        fprintf(stderr, "Error: value for --bench must be a number of milliseconds. Found: '%s'\n", optarg);
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_DIFF:
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_DIFF;
+                snapfile = optarg;
+                break;
+            case OPT_SELFTEST:
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_SELFTEST;
+                break;
+            case OPT_NAMES:
+                detail = SMC_LIST_NAMES;
+                break;
+            case OPT_TYPES:
+                detail = SMC_LIST_TYPES;
+                break;
+            case OPT_MATCH:
+                pattern = optarg;
+                break;
+            case OPT_RECORD:
+                recordfile = optarg;
+                break;
+            case OPT_REPLAY:
+                replayfile = optarg;
+                break;
+            case OPT_SPEED:
+                speed = strtod(optarg, &end);
+                if (*end != '\0' || speed < 0) {
+                    fprintf(stderr, "Error: value for --replay-speed must be 0 or a factor like 1 or 10. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                budget = strtod(optarg, &end);
+                if (*end != '\0' || budget <= 0) {
+                    fprintf(stderr, "Error: value for -B must be a number of calls per second. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                cachefile = optarg;
+                break;
+            case 'C':
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_FAN_CONTROL;
+                setpoint = strtod(optarg, &end);
+                if (*end != '\0') {
+                    fprintf(stderr, "Error: value for -C must be a temperature. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (nbands == MAXKEYS + 1) {
+                    fprintf(stderr, "Error: too many -D options; at most %d\n", MAXKEYS + 1);
+                    return 1;
+                }
+                // [<key>=]<change>[%]
+                end = strchr(optarg, '=');
+                bandKeys[nbands][0] = '\0';
+                if (end != NULL) {
+                    if (end == optarg || end - optarg > 4) {
+                        fprintf(stderr, "Error: -D <key>=<change> needs a key of 1 to 4 characters. Found: '%s'\n", optarg);
+                        return 1;
+                    }
+                    memset(bandKeys[nbands], ' ', 4);
+                    memcpy(bandKeys[nbands], optarg, end - optarg);
+                    bandKeys[nbands][4] = '\0';
+                }
+                value = end != NULL ? end + 1 : optarg;
+                change = strtod(value, &end);
+                bands[nbands].absolute = bands[nbands].relative = -1;   // Not given
+                if (end != value && *end == '%') {
+                    bands[nbands].relative = change / 100;
+                    end++;
+                } else
+                    bands[nbands].absolute = change;
+                if (end == value || *end != '\0' || change < 0) {
+                    fprintf(stderr, "Error: value for -D must be a change like 0.5 or 2%%, optionally after <key>=. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                nbands++;
+                break;
+            case 'd':
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_SERVE;
+                daemonsocket = optarg;
+                break;
             case 'f':
                 if (op != OP_NONE) {    // Not the only option given
                     op = OP_MANY;
                 } else
                     op = OP_READ_FAN;
                 break;
+            case 'g':
+                if (sscanf(optarg, "%lf,%lf,%lf%c", &gains[0], &gains[1], &gains[2], &trailing) != 3 ||
+                    gains[0] < 0 || gains[1] < 0 || gains[2] < 0) {
+                    fprintf(stderr, "Error: value for -g must be three gains, like 0.05,0.005,0. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                repeatInterval = strtod(optarg, &end);
+                if (*end != '\0' || repeatInterval < 1) {
+                    fprintf(stderr, "Error: value for -i must be an interval of at least 1 millisecond. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                connections = atoi(optarg);
+                if (connections < 1 || connections > MAXCONNECTIONS) {
+                    fprintf(stderr, "Error: value for -j must be 1 to %d. Found: '%s'\n", MAXCONNECTIONS, optarg);
+                    return 1;
+                }
+                break;
             case 'k':
-                strncpy(key, optarg, sizeof(key)-1);   //fix for buffer overflow; limit to 4 characters (plus terminator)
-                key[sizeof(key)-1] = '\0'; // Ensure propper termination if arg is more than 4 characters long
+                if (nkeys == MAXKEYS) {
+                    fprintf(stderr, "Error: too many -k options; at most %d keys\n", MAXKEYS);
+                    return 1;
+                }
+                // <key>[@<ms>[:<prio>]]
+                value = strchr(optarg, '@');
+                memset(keys[nkeys], 0, sizeof(key));
+                strncpy(keys[nkeys], optarg, value == NULL || value - optarg > sizeof(key)-1 ? sizeof(key)-1 : value - optarg);   //fix for buffer overflow; limit to 4 characters (plus terminator)
+                periods[nkeys] = -1;
+                priorities[nkeys] = 0;
+                if (value != NULL) {
+                    value++;
+                    periods[nkeys] = strtod(value, &end);
+                    if (end != value && *end == ':') {
+                        value = end + 1;
+                        priorities[nkeys] = (int)strtol(value, &end, 10);
+                    }
+                    if (end == value || *end != '\0' || periods[nkeys] < 0 || (periods[nkeys] > 0 && periods[nkeys] < 0.001)) {
+                        fprintf(stderr, "Error: -k <key>@<ms>[:<prio>] needs a period of 0 or at least 0.001 milliseconds, and a whole priority. Found: '%s'\n", optarg);
+                        return 1;
+                    }
+                    scheduled = 1;
+                }
+                nkeys++;
                 break;
             case 'l':
                 if (op != OP_NONE) {    // Not the only option given
@@ -666,59 +1298,101 @@ int main(int argc, char *argv[])
                 } else
                     op = OP_LIST;
                 break;
+            case 'n':
+                samples = strtoul(optarg, &end, 10);
+                if (*end != '\0' || *optarg == '-') {
+                    fprintf(stderr, "Error: value for -n must be a number of samples. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                logfile = optarg;
+                break;
+            case 'P':
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_EXPORT;
+                exportfile = optarg;
+                break;
             case 'r':
                 if (op != OP_NONE) {    // Not the only option given
                     op = OP_MANY;
                 } else
                     op = OP_READ;
                 break;
+            case 'R':
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_READ_LOG;
+                logfile = optarg;
+                break;
+            case 's':
+                simfile = optarg;
+                break;
+            case 'S':
+                SMCStatsEnable();
+                break;
+            case 't':
+                ttl = atoi(optarg);
+                if (ttl < 0) {
+                    fprintf(stderr, "Error: value for -t must be 0 or more milliseconds. Found: '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                clientsocket = optarg;
+                break;
             case 'v':
                 printf("%s\n", VERSION);    // Simply print the version number
                 // Don't quit yet. Other options can still be executed
                 break;
             case 'w':
-                if (op != OP_NONE) {    // Not the only option given
+                // Only -w <key>=<value> may be given more than once
+                if ((op != OP_NONE && op != OP_WRITE) ||
+                    (op == OP_WRITE && (nwrites == 0 || strchr(optarg, '=') == NULL))) {
                     op = OP_MANY;
-                } else
-            {
-                int i;
-                unsigned int l;  // length of the value string
-
+                    break;
+                }
                 op = OP_WRITE;
-
-                l = (unsigned int)strlen(optarg);
-
-                // check if value is all hex digits
-                for (i = 0; i < l; i++) {
-                    int d;
-                    d = hex2int(optarg[i]);
-                    if (d < 0) {
-                        break;  // Get out of loop if not a hex character
+                if ((end = strchr(optarg, '=')) != NULL) {
+                    if (nwrites == MAXKEYS) {
+                        fprintf(stderr, "Error: too many -w options; at most %d keys\n", MAXKEYS);
+                        return 1;
                     }
-                }
-                if (i < l) {    // We did not make it to the end of the string
-                    fprintf(stderr, "Error: Non hex digit found in value for -w. Found: '%s'\n", optarg);
+                    if (end == optarg || end - optarg > 4) {
+                        fprintf(stderr, "Error: -w <key>=<value> needs a key of 1 to 4 characters. Found: '%s'\n", optarg);
+                        return 1;
+                    }
+                    // Keys are 4 characters; "FS!=0001" means "FS! "
+                    memset(&writeVals[nwrites], 0, sizeof(SMCVal_t));
+                    memset(writeVals[nwrites].key, ' ', 4);
+                    memcpy(writeVals[nwrites].key, optarg, end - optarg);
+                    if (!parseValue(end + 1, &writeVals[nwrites]))
+                        return 1;
+                    nwrites++;
+                } else if (!parseValue(optarg, &val)) {
                     return 1;
-
                 }
-                if (l != (2 * (l/2))) { // Not an even number of digits
-                    fprintf(stderr, "Error: value for -w must be an even number of hex digits. Found: '%s'\n", optarg);
+                break;
+            case 'W':
+                if (op != OP_NONE) {    // Not the only option given
+                    op = OP_MANY;
+                } else
+                    op = OP_WATCH;
+                interval = strtod(optarg, &end);
+                if (*end != '\0' || interval < 0.001) {
+                    fprintf(stderr, "Error: value for -W must be an interval of at least 0.001 milliseconds. Found: '%s'\n", optarg);
                     return 1;
                 }
-                if (l/2 > BYTECOUNT) { // Too many digits to fit into val.bytes[]
-                    fprintf(stderr, "Error: value for -w too long; Only room for %d bytes (%d hex digits)\n", BYTECOUNT, 2*BYTECOUNT);
+                break;
+            case 'H':
+                heartbeat = strtoul(optarg, &end, 10);
+                if (*end != '\0' || heartbeat == 0) {
+                    fprintf(stderr, "Error: value for -H must be a number of samples. Found: '%s'\n", optarg);
                     return 1;
                 }
-
-                // Convert hex digits into bytes
-                // go through the characters of <value> two by two
-                // i denotes the pair of digits and the byte
-                for (i = 0; i < l/2; i++)
-                {
-                    val.bytes[i] = 16 * hex2int(optarg[2*i]) + hex2int(optarg[2*i + 1]);
-                }
-                val.dataSize = l / 2;   // Size in bytes: two hex characters form one byte
-            }
                 break;
             case 'h':   // Help option
                 if (op != OP_NONE) {    // Not the only option given
@@ -742,49 +1416,243 @@ int main(int argc, char *argv[])
     // Too many options given?
     if (op == OP_MANY) {
         fprintf(stderr, "Too many options\n");
-        fprintf(stderr, "Use only one of -f -h -l -r -w\n");
+        fprintf(stderr, "Use only one of -C -d -f -h -l -P -r -R -w -W --batch --bench --diff --selftest\n");
+        return 1;
+    }
+
+    // Reading a log needs no SMC
+    if (op == OP_READ_LOG)
+        return SMCLogPrint(logfile) == kIOReturnSuccess ? 0 : 1;
+    if (op == OP_SELFTEST)
+        return SMCSelfTest(simfile) == 0 ? 0 : 1;
+
+    // Neither does comparing snapshots; the snapshots are the arguments after the options
+    if (op == OP_DIFF) {
+        if (optind >= argc) {
+            fprintf(stderr, "The --diff option needs at least two snapshots\n");
+            return 1;
+        }
+        SMCOutSetFormat(format);
+        return SMCSnapshotDiff(snapfile, argv + optind, argc - optind) == 0 ? 0 : 1;
+    }
+
+    // -l takes a prefix or range of keys after the options
+    if (op == OP_LIST && optind < argc) {
+        if (optind + 1 < argc || !SMCParseKeyRange(argv[optind], &low, &high)) {
+            fprintf(stderr, "Error: -l takes one key prefix like 'T' or range like 'F0-F2'. Found: '%s'\n",
+                    argv[optind + 1 < argc ? optind + 1 : optind]);
+            return 1;
+        }
+        if (logfile != NULL) {
+            fprintf(stderr, "A snapshot (-l -o) holds all keys, and takes no prefix or range\n");
+            return 1;
+        }
+    }
+    if ((detail != SMC_LIST_VALUES || pattern != NULL) && (op != OP_LIST || logfile != NULL)) {
+        fprintf(stderr, "The --names, --types and --match options can only be used with -l, without -o\n");
+        return 1;
+    }
+
+    if (repeatInterval == 0)
+        repeatInterval = op == OP_FAN_CONTROL ? 1000 : 15000;
+
+    if (logfile != NULL && op != OP_WATCH && op != OP_LIST) {
+        fprintf(stderr, "The -o option can only be used with -W or -l\n");
+        return 1;
+    }
+    if ((nbands > 0 || heartbeat > 0) && (op != OP_WATCH || logfile != NULL)) {
+        fprintf(stderr, "The -D and -H options can only be used with -W, without -o\n");
+        return 1;
+    }
+    if ((scheduled || budget > 0) && op != OP_WATCH) {
+        fprintf(stderr, "The -B option and -k <key>@<ms> can only be used with -W\n");
         return 1;
     }
 
-    // OP_READ and OP_WRITE must have a 'key' value
-    if (op == OP_READ || op == OP_WRITE) {
-        if (strlen(key) == 0) {
-            fprintf(stderr, "No -k <key> supplied for %s action\n", op == OP_READ ? "-r" : "-w");
+    // OP_READ, OP_WRITE, OP_WATCH and OP_FAN_CONTROL must have a 'key' value
+    if (op == OP_READ || (op == OP_WRITE && nwrites == 0) || op == OP_WATCH || op == OP_FAN_CONTROL) {
+        if (nkeys == 0 || strlen(keys[0]) == 0) {
+            fprintf(stderr, "No -k <key> supplied for %s action\n",
+                    op == OP_READ ? "-r" : (op == OP_WRITE ? "-w" : (op == OP_WATCH ? "-W" : "-C")));
             return 1;
         }
+        strcpy(key, keys[0]);
+    }
+
+    // OP_WRITE writes a single key, or the keys given with -w <key>=<value>
+    if (op == OP_WRITE && nkeys > 1) {
+        fprintf(stderr, "Only one -k <key> can be given for the -w action\n");
+        return 1;
+    }
+    if (op == OP_WRITE && nwrites > 0 && nkeys > 0) {
+        fprintf(stderr, "The -k option cannot be used with -w <key>=<value>\n");
+        return 1;
+    }
+
+    if (replayfile != NULL && (simfile != NULL || clientsocket != NULL)) {
+        fprintf(stderr, "The --replay option cannot be used with -s or -u\n");
+        return 1;
+    }
+
+    SMCOutSetFormat(format);
+
+    // Switch to the simulated SMC if requested
+    if (simfile != NULL) {
+        if (SMCSimLoad(simfile) != kIOReturnSuccess)
+            return 1;
+        transport = &SMCSimTransport;
+    }
+
+    // Let a daemon do the work if requested
+    if (clientsocket != NULL) {
+        SMCClientSetSocket(clientsocket);
+        transport = &SMCClientTransport;
     }
 
+    // Replay a trace instead, or record the calls to one
+    if (replayfile != NULL && SMCTraceReplay(replayfile, speed) != kIOReturnSuccess)
+        return 1;
+    if (recordfile != NULL && SMCTraceRecord(recordfile) != kIOReturnSuccess)
+        return 1;
+
     // Open a connection to the SMC system; store the connection info in the 'conn' global variable
-    SMCOpen(&conn);
+    if (SMCOpen(&conn) != kIOReturnSuccess)
+        return 1;
+
+    // Use the key info cache; carry on without it if the SMC cannot be identified
+    if (cachefile != NULL) {
+        result = SMCCacheOpen(cachefile);
+        if (result != kIOReturnSuccess)
+            fprintf(stderr, "Warning: key info cache not used; SMCCacheOpen() = %08x\n", result);
+    }
 
     switch(op)
     {
         case OP_LIST:
-            result = SMCPrintAll();
+            if (logfile != NULL)
+            {
+                result = SMCSnapshotWrite(logfile, connections);
+                if (result != kIOReturnSuccess)
+                    printf("Error: SMCSnapshotWrite() = %08x\n", result);
+                break;
+            }
+            SMCOutBegin();
+            result = SMCPrintRange(connections, low, high, detail, pattern);
+            SMCOutEnd();
             if (result != kIOReturnSuccess)
-                printf("Error: SMCPrintAll() = %08x\n", result);
+                printf("Error: SMCPrintRange() = %08x\n", result);
             break;
         case OP_READ:
             if (strlen(key) > 0) /* This test should go before opening the connection */
             {
-                result = SMCReadKey(key, &val);
-                if (result != kIOReturnSuccess)
-                    printf("Error: SMCReadKey() = %08x\n", result);
-                else
-                    printVal(val);
+                result = SMCReadKeys(keys, nkeys, vals, results);
+                if (result == kIOReturnBadArgument)
+                {
+                    // Nothing was read; only report the duplicates
+                    for (i = 0; i < nkeys; i++)
+                    {
+                        if (results[i] == kIOReturnBadArgument)
+                            fprintf(format == SMC_OUT_TEXT ? stdout : stderr,
+                                    "Error: key '%s' given more than once\n", keys[i]);
+                    }
+                    break;
+                }
+                SMCOutBegin();
+                for (i = 0; i < nkeys; i++)
+                {
+                    if (results[i] == kIOReturnSuccess || format != SMC_OUT_TEXT)
+                        SMCOutValue(&vals[i], results[i]);
+                    else if (nkeys == 1)
+                        SMCOutPrintf("Error: SMCReadKey() = %08x\n", results[i]);
+                    else
+                        SMCOutPrintf("Error: SMCReadKey() = %08x for key '%s'\n", results[i], keys[i]);
+                }
+                SMCOutEnd();
             }
             else
             {
                 printf("Error: specify a key to read\n");
             }
             break;
+        case OP_SERVE:
+            result = SMCServe(daemonsocket, ttl);
+            if (result != kIOReturnSuccess)
+                printf("Error: SMCServe() = %08x\n", result);
+            break;
+        case OP_EXPORT:
+            result = SMCExport(exportfile, keys, nkeys, (UInt64)(repeatInterval * 1e6), samples);
+            if (result != kIOReturnSuccess)
+                printf("Error: SMCExport() = %08x\n", result);
+            break;
+        case OP_BATCH:
+            result = SMCBatch(batchfile);
+            if (result != kIOReturnSuccess)
+                printf("Error: SMCBatch() = %08x\n", result);
+            break;
+        case OP_BENCH:
+            result = SMCBench(benchtime);
+            if (result != kIOReturnSuccess)
+                printf("Error: SMCBench() = %08x\n", result);
+            break;
+        case OP_FAN_CONTROL:
+            result = SMCFanControl(keys, nkeys, setpoint, gains, deadband, (UInt64)(repeatInterval * 1e6), samples, NULL);
+            if (result != kIOReturnSuccess)
+                printf("Error: SMCFanControl() = %08x\n", result);
+            break;
+        case OP_WATCH:
+            if (nbands > 0 || heartbeat > 0)
+            {
+                // The deadbands of each key: those given for the key, else those given for all
+                for (i = 0; i < nkeys; i++)
+                {
+                    int j;
+
+                    deadbands[i].absolute = deadbands[i].relative = 0;
+                    for (j = 0; j < nbands; j++)
+                    {
+                        if (bandKeys[j][0] == '\0' && bands[j].absolute >= 0)
+                            deadbands[i].absolute = bands[j].absolute;
+                        if (bandKeys[j][0] == '\0' && bands[j].relative >= 0)
+                            deadbands[i].relative = bands[j].relative;
+                    }
+                    for (j = 0; j < nbands; j++)
+                    {
+                        if (strncmp(bandKeys[j], keys[i], 4) != 0)
+                            continue;
+                        if (bands[j].absolute >= 0)
+                            deadbands[i].absolute = bands[j].absolute;
+                        if (bands[j].relative >= 0)
+                            deadbands[i].relative = bands[j].relative;
+                    }
+                }
+            }
+            // The period of each key: the one given with -k, else the -W interval
+            for (i = 0; i < nkeys; i++)
+            {
+                schedule[i].period = (UInt64)((periods[i] >= 0 ? periods[i] : interval) * 1e6);
+                schedule[i].priority = priorities[i];
+            }
+            result = SMCWatch(keys, nkeys, (UInt64)(interval * 1e6), samples, logfile,
+                              nbands > 0 || heartbeat > 0 ? deadbands : NULL, heartbeat,
+                              scheduled || budget > 0 ? schedule : NULL, budget);
+            if (result != kIOReturnSuccess)
+                printf("Error: SMCWatch() = %08x\n", result);
+            break;
         case OP_READ_FAN:
+            SMCOutBegin();
             result = SMCPrintFans();
+            SMCOutEnd();
             if (result != kIOReturnSuccess)
                 printf("Error: SMCPrintFans() = %08x\n", result);
             break;
         case OP_WRITE:
-            if (strlen(key) > 0) /* This test should go before opening the connection */
+            if (nwrites > 0)
+            {
+                SMCOutBegin();
+                SMCPrintWrites(writeVals, nwrites);
+                SMCOutEnd();
+            }
+            else if (strlen(key) > 0) /* This test should go before opening the connection */
             {
                 /* What is attempted here?? */
                 // val.key is a 4-character string (plus terminator)
@@ -802,6 +1670,9 @@ int main(int argc, char *argv[])
             break;
     }
     
+    SMCCacheClose();
     SMCClose(conn);
+    if (SMCStatsEnabled)
+        SMCStatsPrint();
     return 0;;
 }
@@ -24,7 +24,8 @@
 
 #ifndef __SMC_H__
 #define __SMC_H__
-#endif
+
+#include "smctypes.h"
 
 #define VERSION               "0.03-pre"
 
@@ -35,68 +36,175 @@ enum {
     OP_READ_FAN,    // -f
     OP_WRITE,       // -w
     OP_HELP,        // -h
+    OP_SERVE,       // -d
+    OP_WATCH,       // -W
+    OP_READ_LOG,    // -R
+    OP_EXPORT,      // -P
+    OP_FAN_CONTROL, // -C
+    OP_BATCH,       // --batch
+    OP_BENCH,       // --bench
+    OP_DIFF,        // --diff
+    OP_SELFTEST,    // --selftest
     OP_MANY         // Too many options entered
 };
 
-#define KERNEL_INDEX_SMC      2
+// What SMCPrintRange() reads of every key
+enum {
+    SMC_LIST_VALUES,    // Name, type and value (-l)
+    SMC_LIST_TYPES,     // Name and type (-l --types)
+    SMC_LIST_NAMES      // Name only (-l --names)
+};
+
+#define OPT_NAMES     518           // getopt_long() value of --names
+#define OPT_TYPES     519           // getopt_long() value of --types
+#define OPT_MATCH     520           // getopt_long() value of --match
 
-#define SMC_CMD_READ_BYTES    5
-#define SMC_CMD_WRITE_BYTES   6
-#define SMC_CMD_READ_INDEX    8
-#define SMC_CMD_READ_KEYINFO  9
-#define SMC_CMD_READ_PLIMIT   11
-#define SMC_CMD_READ_VERS     12
+// Maximum number of -k options
+#define MAXKEYS               64
 
-#define DATATYPE_FP           "fp"
-#define DATATYPE_SP           "sp"
-#define DATATYPE_UINT8        "ui8 "
-#define DATATYPE_UINT16       "ui16"
-#define DATATYPE_UINT32       "ui32"
+// Maximum number of keys whose last written value is remembered (see SMCWriteKeys())
+#define MAXKNOWN              64
 
-// Number of bytes in an SMCVal_t.bytes array
-#define BYTECOUNT             32
+// Maximum number of parallel SMC connections (-j)
+#define MAXCONNECTIONS        16
 
-typedef struct {
-    char                  major;
-    char                  minor;
-    char                  build;
-    char                  reserved[1]; 
-    UInt16                release;
-} SMCKeyData_vers_t;
+// Maximum number of fans: the fan keys have a single digit, F0Ac to F9Ac
+#define MAXFANS               10
 
-typedef struct {
-    UInt16                version;
-    UInt16                length;
-    UInt32                cpuPLimit;
-    UInt32                gpuPLimit;
-    UInt32                memPLimit;
-} SMCKeyData_pLimitData_t;
+// The transport of smc (-s, -c, --replay, ...)
+extern SMCTransport_t *transport;
 
+// smc.c
+int           parseValue(const char *hex, SMCVal_t *valp);
+kern_return_t SMCOpen(io_connect_t *connp);
+kern_return_t SMCClose(io_connect_t conn);
+kern_return_t SMCCall(int index, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep);
+kern_return_t SMCGetKeyInfo(UInt32 key, SMCKeyData_keyInfo_t *keyInfop);
+kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t *valp);
+kern_return_t SMCReadKeys(UInt32Char_t *keys, int count, SMCVal_t *vals, kern_return_t *results);
+kern_return_t SMCWriteKey(SMCVal_t writeVal);
+kern_return_t SMCWriteKeys(SMCVal_t *vals, int count, kern_return_t *results, int *written);
+UInt32        SMCReadIndexCount(void);
+kern_return_t SMCGetKeyAtIndex(int index, UInt32 *keyp);
+kern_return_t SMCFindKeyRange(UInt32 low, UInt32 high, int totalKeys, int *firstp, int *lastp);
+int           SMCParseKeyRange(const char *spec, UInt32 *lowp, UInt32 *highp);
+void          SMCReadAll(int connections, int first, int last, int detail, const char *pattern,
+                         SMCVal_t *vals, char *found, kern_return_t *results);
+kern_return_t SMCPrintAll(int connections);
+kern_return_t SMCPrintRange(int connections, UInt32 low, UInt32 high, int detail, const char *pattern);
+kern_return_t SMCPrintFans(void);
+kern_return_t SMCPrintWrites(SMCVal_t *vals, int count);
+
+// smccache.c
+kern_return_t SMCCacheOpen(const char *filename);
+void          SMCCacheClose(void);
+int           SMCCacheLookup(UInt32 key, SMCKeyData_keyInfo_t *keyInfop);
+void          SMCCacheStore(UInt32 key, SMCKeyData_keyInfo_t *keyInfop);
+void          SMCCacheForget(UInt32 key);
+UInt32        SMCCacheKeyCount(void);
+int           SMCCacheKeyAt(int index, UInt32 *keyp);
+void          SMCCacheStoreIndex(int index, UInt32 key);
+
+// smcd.c
+extern SMCTransport_t SMCClientTransport;
+kern_return_t SMCServe(const char *path, int ttlms);
+void          SMCClientSetSocket(const char *path);
+
+// smcout.c
+enum {
+    SMC_OUT_TEXT,   // Default
+    SMC_OUT_JSON,   // --json
+    SMC_OUT_NDJSON, // --ndjson
+    SMC_OUT_CSV     // --csv
+};
+void          SMCOutSetFormat(int format);
+int           SMCOutFormat(void);
+void          SMCOutBegin(void);
+void          SMCOutValue(const SMCVal_t *valp, kern_return_t result);
+void          SMCOutKey(const SMCVal_t *valp, kern_return_t result, int withType);
+void          SMCOutPrintf(const char *format, ...);
+void          SMCOutEnd(void);
+void          SMCOutFlush(void);
+
+// smcexport.c
+kern_return_t SMCExport(const char *filename, UInt32Char_t *extra, int nextra,
+                        UInt64 interval, unsigned long count);
+
+// smcbatch.c
+#define OPT_BATCH     512           // getopt_long() value of --batch
+kern_return_t SMCBatch(const char *filename);
+
+// smcstats.c
+extern int    SMCStatsEnabled;
+void          SMCStatsEnable(void);
+void          SMCStatsRecord(const SMCKeyData_t *inputStructurep, const SMCKeyData_t *outputStructurep,
+                             kern_return_t result, UInt64 ns);
+void          SMCStatsPrint(void);
+
+// smctrace.c
+#define OPT_RECORD    514           // getopt_long() value of --record
+#define OPT_REPLAY    515           // getopt_long() value of --replay
+#define OPT_SPEED     516           // getopt_long() value of --replay-speed
+kern_return_t SMCTraceRecord(const char *filename);
+kern_return_t SMCTraceReplay(const char *filename, double speed);
+
+// smcsnap.c
+#define OPT_DIFF      517           // getopt_long() value of --diff
+kern_return_t SMCSnapshotWrite(const char *filename, int connections);
+int           SMCSnapshotDiff(const char *base, char **others, int count);
+
+// smcbench.c
+#define OPT_BENCH     513           // getopt_long() value of --bench
+kern_return_t SMCBench(int duration);
+
+// smctest.c
+#define OPT_SELFTEST  521           // getopt_long() value of --selftest
+int           SMCSelfTest(const char *simfile);
+
+// smcfan.c
 typedef struct {
-    UInt32                dataSize;
-    UInt32                dataType;
-    char                  dataAttributes;
-} SMCKeyData_keyInfo_t;
+    unsigned long         cycles;
+    unsigned long         writes;       // Fan targets written
+    unsigned long         suppressed;   // Fan targets not written, within the deadband
+    unsigned long         readFailures; // Cycles in which no temperature could be read
+    unsigned long         writeFailures;
+    UInt64                maxLatency;   // Largest control latency, in nanoseconds
+} SMCFanStats_t;
 
-typedef char              SMCBytes_t[BYTECOUNT];
+kern_return_t SMCFanControl(UInt32Char_t *keys, int count, double setpoint, const double gains[3],
+                            double deadband, UInt64 interval, unsigned long cycles, SMCFanStats_t *statsp);
 
+// smcsched.c
 typedef struct {
-    UInt32                  key; 
-    SMCKeyData_vers_t       vers; 
-    SMCKeyData_pLimitData_t pLimitData;
-    SMCKeyData_keyInfo_t    keyInfo;
-    char                    result;
-    char                    status;
-    char                    data8;
-    UInt32                  data32;
-    SMCBytes_t              bytes;
-} SMCKeyData_t;
-
-typedef char              UInt32Char_t[5];
+    UInt64                period;       // Nanoseconds between reads; 0 to read once
+    int                   priority;     // Lower is more important
+} SMCSchedule_t;
+typedef struct SMCSched SMCSched_t;
+SMCSched_t   *SMCSchedCreate(const SMCSchedule_t *schedule, int count, UInt64 start, double budget);
+void          SMCSchedFree(SMCSched_t *s);
+UInt64        SMCSchedNext(SMCSched_t *s);
+int           SMCSchedTake(SMCSched_t *s, UInt64 now, char *due);
+void          SMCSchedReport(SMCSched_t *s, UInt32Char_t *keys, UInt64 elapsed);
 
+// smcwatch.c
+UInt64        SMCTimeNow(void);
+void          SMCSleepUntil(UInt64 deadline);
 typedef struct {
-    UInt32Char_t            key;
-    UInt32                  dataSize;
-    UInt32Char_t            dataType;
-    SMCBytes_t              bytes;
-} SMCVal_t;
+    double                absolute;     // Smallest change printed, in the unit of the value
+    double                relative;     // Smallest change printed, as a fraction of the value
+} SMCDeadband_t;
+void          SMCPrintSample(UInt64 time, SMCVal_t *vals, kern_return_t *results, int count, const char *print,
+                             const float *numbers);
+kern_return_t SMCWatch(UInt32Char_t *keys, int count, UInt64 interval, unsigned long samples,
+                       const char *logfile, const SMCDeadband_t *deadbands, unsigned long heartbeat,
+                       const SMCSchedule_t *schedule, double budget);
+
+// smclog.c
+typedef struct SMCLog SMCLog_t;
+SMCLog_t     *SMCLogCreate(const char *filename, SMCVal_t *vals, int count, UInt64 interval, int due);
+kern_return_t SMCLogAppend(SMCLog_t *log, UInt64 time, SMCVal_t *vals, kern_return_t *results);
+kern_return_t SMCLogFlush(SMCLog_t *log);
+kern_return_t SMCLogClose(SMCLog_t *log);
+kern_return_t SMCLogPrint(const char *filename);
+
+#endif /* __SMC_H__ */
@@ -0,0 +1,373 @@
+/*
+ *  smcbatch.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Batch mode: run a stream of commands on one SMC connection (--batch)
+ *
+ * The commands are read from stdin or a file, one per line:
+ *   read <key> ...               like -r -k <key> ...
+ *   write <key>=<value> ...      like -w <key>=<value> ...
+ *   list [<prefix>]              like -l, only the keys starting with <prefix>
+ *   fans                         like -f
+ * Empty lines and lines starting with '#' are skipped. Keys shorter than 4 characters
+ * are padded with spaces, so "FS!" is "FS! ". A command takes up to MAXKEYS keys.
+ *
+ * The output of the commands follows in the order of the commands, in the format
+ * chosen with --json, --ndjson or --csv.
+ *
+ * The input is taken in as large pieces as are available. All complete lines of a
+ * piece are run before the output is written, in one go, and the next piece is read.
+ * So a program that writes a lot of commands at once gets all the answers at once,
+ * and one that writes a command and waits for its answer gets it right away.
+ *
+ * Consecutive read commands are merged: a key is read once for all of them.
+ * A write or any other command ends the run of reads, so a read after a write
+ * sees the value written.
+ *
+ * When done, the number of commands, the time taken, and the number of reads
+ * saved by merging are printed on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "smc.h"
+
+#define BATCH_BUFFER    65536   // Input buffer; also the longest line
+#define BATCH_MAXOPS    4096    // Commands run together
+#define BATCH_MAXKEYS   4096    // Keys and values of those commands
+
+enum {
+    BATCH_READ,
+    BATCH_WRITE,
+    BATCH_LIST,
+    BATCH_FANS
+};
+
+// A command, with its keys or values in batchVals[first] to batchVals[first + count - 1]
+typedef struct {
+    int                   command;      // BATCH_...
+    int                   first;
+    int                   count;
+} SMCBatchOp_t;
+
+static SMCBatchOp_t   batchOps[BATCH_MAXOPS];
+static int            batchOpCount = 0;
+static SMCVal_t       batchVals[BATCH_MAXKEYS];
+static kern_return_t  batchResults[BATCH_MAXKEYS];
+static int            batchValCount = 0;
+
+static unsigned long  batchCommands = 0;
+static unsigned long  batchMerged = 0;     // Reads saved by merging
+
+/*
+ * Set 'key' to the 4 character key in 'token', of 'len' characters
+ * Returns 0 if it is not a key.
+ */
+static int batchKey(char *key, const char *token, size_t len)
+{
+    if (len == 0 || len > 4)
+        return 0;
+    memset(key, ' ', 4);
+    memcpy(key, token, len);
+    key[4] = '\0';
+    return 1;
+}
+
+/*
+ * Set the bytes and size of '*valp' to the 'len' hexadecimal digits in 'hex'
+ * Returns 0 if they do not form a value.
+ */
+static int batchValue(SMCVal_t *valp, const char *hex, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || len % 2 != 0 || len / 2 > BYTECOUNT)
+        return 0;
+    for (i = 0; i < len; i++)
+    {
+        if (hex2int(hex[i]) < 0)
+            return 0;
+    }
+    for (i = 0; i < len / 2; i++)
+        valp->bytes[i] = 16 * hex2int(hex[2 * i]) + hex2int(hex[2 * i + 1]);
+    valp->dataSize = (UInt32)(len / 2);
+    return 1;
+}
+
+/*
+ * Run the reads batchOps[first] to batchOps[last - 1], reading every key only once
+ */
+static void batchRunReads(int first, int last)
+{
+    int           i, j, k, from, to;
+    UInt32        key;
+
+    from = batchOps[first].first;
+    to = batchOps[last - 1].first + batchOps[last - 1].count;
+    for (i = from; i < to; i++)
+    {
+        // A key read before in this run? Then take that value.
+        key = bytes2uint32(batchVals[i].key, 4);
+        for (j = from; j < i && bytes2uint32(batchVals[j].key, 4) != key; j++)
+            ;
+        if (j < i)
+        {
+            batchVals[i] = batchVals[j];
+            batchResults[i] = batchResults[j];
+            batchMerged++;
+        }
+        else
+        {
+            char name[5];
+
+            memcpy(name, batchVals[i].key, 5);
+            batchResults[i] = SMCReadKey(name, &batchVals[i]);
+        }
+    }
+
+    for (k = first; k < last; k++)
+    {
+        for (i = batchOps[k].first; i < batchOps[k].first + batchOps[k].count; i++)
+        {
+            if (batchResults[i] == kIOReturnSuccess || SMCOutFormat() != SMC_OUT_TEXT)
+                SMCOutValue(&batchVals[i], batchResults[i]);
+            else
+                SMCOutPrintf("Error: SMCReadKey() = %08x for key '%s'\n", batchResults[i], batchVals[i].key);
+        }
+    }
+}
+
+/*
+ * List the keys that start with 'prefix'
+ * A prefix of "" lists all keys.
+ */
+static void batchList(const char *prefix)
+{
+    UInt32 low, high;
+
+    if (SMCParseKeyRange(prefix, &low, &high))
+        SMCPrintRange(1, low, high, SMC_LIST_VALUES, NULL);
+}
+
+/*
+ * Run all commands collected, in order, and forget them
+ */
+static void batchRun(void)
+{
+    int i, j;
+
+    for (i = 0; i < batchOpCount; i = j)
+    {
+        j = i + 1;
+        switch (batchOps[i].command)
+        {
+            case BATCH_READ:
+                while (j < batchOpCount && batchOps[j].command == BATCH_READ)
+                    j++;
+                batchRunReads(i, j);
+                break;
+            case BATCH_WRITE:
+                SMCPrintWrites(&batchVals[batchOps[i].first], batchOps[i].count);
+                break;
+            case BATCH_LIST:
+                batchList(batchVals[batchOps[i].first].key);
+                break;
+            case BATCH_FANS:
+                if (SMCPrintFans() != kIOReturnSuccess && SMCOutFormat() == SMC_OUT_TEXT)
+                    SMCOutPrintf("Error: no fans found\n");
+                break;
+        }
+    }
+    batchOpCount = 0;
+    batchValCount = 0;
+}
+
+/*
+ * Add the command in 'line' (without the newline) to the commands to run
+ * Returns 0, after printing an error on stderr, if it is not a valid command.
+ */
+static int batchParse(char *line, unsigned long lineNumber)
+{
+    static const char *separators = " \t\r";
+    SMCBatchOp_t *op;
+    char         *word, *token, *equals, *save;
+    size_t        len;
+
+    word = strtok_r(line, separators, &save);
+    if (word == NULL || word[0] == '#')
+        return 1;   // Nothing to do
+
+    // Make room for the command and its keys
+    if (batchOpCount == BATCH_MAXOPS || batchValCount + MAXKEYS > BATCH_MAXKEYS)
+        batchRun();
+    op = &batchOps[batchOpCount];
+    op->first = batchValCount;
+    op->count = 0;
+
+    if (strcmp(word, "read") == 0)
+    {
+        op->command = BATCH_READ;
+        while ((token = strtok_r(NULL, separators, &save)) != NULL)
+        {
+            memset(&batchVals[batchValCount], 0, sizeof(SMCVal_t));
+            if (batchValCount - op->first == MAXKEYS ||
+                !batchKey(batchVals[batchValCount].key, token, strlen(token)))
+                goto bad;
+            batchValCount++;
+        }
+    }
+    else if (strcmp(word, "write") == 0)
+    {
+        op->command = BATCH_WRITE;
+        while ((token = strtok_r(NULL, separators, &save)) != NULL)
+        {
+            memset(&batchVals[batchValCount], 0, sizeof(SMCVal_t));
+            equals = strchr(token, '=');
+            if (batchValCount - op->first == MAXKEYS || equals == NULL ||
+                !batchKey(batchVals[batchValCount].key, token, equals - token) ||
+                !batchValue(&batchVals[batchValCount], equals + 1, strlen(equals + 1)))
+                goto bad;
+            batchValCount++;
+        }
+    }
+    else if (strcmp(word, "list") == 0)
+    {
+        // The prefix, if any, goes in the key of one value
+        op->command = BATCH_LIST;
+        token = strtok_r(NULL, separators, &save);
+        memset(&batchVals[batchValCount], 0, sizeof(SMCVal_t));
+        if (token != NULL)
+        {
+            len = strlen(token);
+            if (len > 4 || strtok_r(NULL, separators, &save) != NULL)
+                goto bad;
+            memcpy(batchVals[batchValCount].key, token, len);
+        }
+        batchValCount++;
+    }
+    else if (strcmp(word, "fans") == 0)
+    {
+        op->command = BATCH_FANS;
+        if (strtok_r(NULL, separators, &save) != NULL)
+            goto bad;
+    }
+    else
+    {
+        fprintf(stderr, "Error: unknown command '%s' on line %lu\n", word, lineNumber);
+        return 0;
+    }
+
+    op->count = batchValCount - op->first;
+    if (op->count == 0 && op->command != BATCH_FANS)
+        goto bad;
+    batchOpCount++;
+    batchCommands++;
+    return 1;
+
+bad:
+    batchValCount = op->first;
+    fprintf(stderr, "Error: invalid '%s' command on line %lu\n", word, lineNumber);
+    return 0;
+}
+
+/*
+ * Run the commands in 'filename', or on stdin if NULL
+ * Lines with an error are reported on stderr and skipped.
+ * Returns kIOReturnSuccess, or kIOReturnError if the file cannot be read or
+ * a line has an error.
+ */
+kern_return_t SMCBatch(const char *filename)
+{
+    static char    buffer[BATCH_BUFFER];
+    size_t         used = 0, start, i;
+    ssize_t        n;
+    int            fd = STDIN_FILENO, errors = 0, eof = 0;
+    unsigned long  lineNumber = 0;
+    UInt64         begin = SMCTimeNow();
+    double         elapsed;
+
+    if (filename != NULL && (fd = open(filename, O_RDONLY)) < 0)
+    {
+        perror("Error: cannot open batch file");
+        return kIOReturnError;
+    }
+
+    SMCOutBegin();
+    while (!eof)
+    {
+        n = read(fd, buffer + used, sizeof(buffer) - used);
+        if (n < 0)
+        {
+            perror("Error: cannot read batch commands");
+            errors++;
+            break;
+        }
+        if (n == 0)
+        {
+            // The last line may have no newline
+            eof = 1;
+            if (used > 0 && used < sizeof(buffer))
+                buffer[used++] = '\n';
+        }
+        used += n;
+
+        // Take in all complete lines
+        for (start = 0, i = 0; i < used; i++)
+        {
+            if (buffer[i] != '\n')
+                continue;
+            buffer[i] = '\0';
+            lineNumber++;
+            if (!batchParse(buffer + start, lineNumber))
+                errors++;
+            start = i + 1;
+        }
+        if (start == 0 && used == sizeof(buffer))
+        {
+            fprintf(stderr, "Error: line %lu is too long\n", lineNumber + 1);
+            errors++;
+            break;
+        }
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+
+        // Run them, and write the output before waiting for more
+        batchRun();
+        SMCOutFlush();
+    }
+    batchRun();
+    SMCOutEnd();
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+
+    elapsed = (SMCTimeNow() - begin) / 1e9;
+    fprintf(stderr, "%lu commands in %.3f s: %.0f per second; %lu reads saved by merging\n",
+            batchCommands, elapsed, elapsed > 0 ? batchCommands / elapsed : 0.0, batchMerged);
+    return errors == 0 ? kIOReturnSuccess : kIOReturnError;
+}
@@ -0,0 +1,550 @@
+/*
+ *  smcbench.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Microbenchmarks of the hot paths (--bench)
+ *
+ * Times the helpers (bytes2uint32(), uint32tostr(), parsing a -w value with hex2int(),
+ * val2float(), SMCDecode() with the decoder looked up once, decoding recorded samples with
+ * each method of SMCDecodeColumn() that the processor has, printing a value with
+ * SMCOutValue()) and the SMC operations (SMCReadKey(),
+ * SMCPrintAll(), SMCPrintFans(), and reads through an SMCQueue_t that is kept at
+ * BENCH_QUEUEDEPTH reads in flight: with 1 and 4 workers by one submitter, and with 4 workers
+ * by BENCH_SUBMITTERS threads at once). The SMC operations go through the transport in use,
+ * so with -s they run against the simulator, whose latency is set with SMCSIM_LATENCY.
+ *
+ * Every benchmark runs for about the given time. Its operations are timed in batches,
+ * so a batch takes at least BENCH_MINBATCH nanoseconds and the clock does not dominate
+ * fast operations. The time per operation of each batch is a sample; the mean, median
+ * and 99th percentile of the samples are reported, the operations per second, and the SMCCall()
+ * exchanges per operation, counted by a transport that wraps the one in use.
+ * For the queues the median and 99th percentile completion latency of the requests, from
+ * submitting to reaping, are reported too.
+ * Output of the benchmarked functions goes to /dev/null.
+ *
+ * The results are printed as a table, or as JSON, NDJSON or CSV (--json, --ndjson, --csv)
+ * to compare releases. Every record carries the version and the transport.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "libsmc.h"
+#include "smc.h"
+
+#define BENCH_MINBATCH      2000        // Nanoseconds
+#define BENCH_MAXBATCH      (1 << 20)   // Operations
+#define BENCH_MAXSAMPLES    100000
+#define BENCH_QUEUEDEPTH    16
+#define BENCH_SUBMITTERS    4           // Threads submitting to the queue at once
+#define BENCH_COLUMN        4096        // Samples decoded per SMCDecodeColumn() call
+
+// A benchmark runs 'n' operations
+typedef struct {
+    const char           *name;
+    void                (*run)(int n);
+    int                   quiet;        // Send stdout to /dev/null while it runs
+    void                (*done)(void);  // Clean up after it; NULL if there is nothing to do
+    int                 (*available)(void); // Whether it can run here; NULL if always
+    int                   latency;      // Records completion latencies (benchLatencies)
+} SMCBench_t;
+
+static SMCTransport_t        *benchInner;   // The transport wrapped
+static unsigned long          benchCalls;   // SMCCall() exchanges so far
+static volatile UInt32        benchSink;    // Keeps results from being optimised away
+static volatile double        benchSinkFloat;
+static double                 benchSamples[BENCH_MAXSAMPLES];
+static SMCQueue_t            *benchQueue;   // Of the SMCQueue benchmark that runs
+static pthread_t              benchSubmitters[BENCH_SUBMITTERS];
+static int                    benchSubmitterCount;
+static volatile int           benchStopping; // Set to stop the submitters
+static unsigned long          benchCompleted; // Requests reaped by the submitters
+static unsigned long          benchCounted;   // Of those, the ones counted by the runs so far
+static double                 benchLatencies[BENCH_MAXSAMPLES];   // Nanoseconds
+static int                    benchLatencyCount;
+static pthread_mutex_t        benchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         benchProgress = PTHREAD_COND_INITIALIZER;
+static char                   benchColumn[2 * BENCH_COLUMN];    // "sp78" samples
+static float                  benchDecoded[BENCH_COLUMN];
+
+static kern_return_t benchOpen(io_connect_t *connp)
+{
+    return benchInner->open(connp);
+}
+
+static kern_return_t benchClose(io_connect_t conn)
+{
+    return benchInner->close(conn);
+}
+
+static kern_return_t benchCall(io_connect_t conn, int index,
+                               SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    __atomic_fetch_add(&benchCalls, 1, __ATOMIC_RELAXED);  // -l may use several threads
+    return benchInner->call(conn, index, inputStructurep, outputStructurep);
+}
+
+static SMCTransport_t benchTransport = {
+    "bench", benchOpen, benchClose, benchCall
+};
+
+static void benchBytes2uint32(int n)
+{
+    static char key[] = "TC0H";
+    int         i;
+
+    for (i = 0; i < n; i++)
+        benchSink += bytes2uint32(key, 4);
+}
+
+static void benchUint32tostr(int n)
+{
+    UInt32Char_t str;
+    int          i;
+
+    for (i = 0; i < n; i++)
+    {
+        uint32tostr(str, 0x54433048 + benchSink);   // "TC0H"
+        benchSink = str[3];
+    }
+}
+
+static void benchParseValue(int n)
+{
+    SMCVal_t val;
+    int      i;
+
+    for (i = 0; i < n; i++)
+    {
+        parseValue("0fa0", &val);
+        benchSink += val.bytes[1];
+    }
+}
+
+static void benchVal2float(int n)
+{
+    SMCVal_t val;
+    int      i;
+
+    memset(&val, 0, sizeof(val));
+    memcpy(val.key, "F0Ac", 5);
+    memcpy(val.dataType, "fpe2", 5);
+    val.dataSize = 2;
+    val.bytes[0] = 0x12;
+    val.bytes[1] = 0xc0;
+    for (i = 0; i < n; i++)
+        benchSinkFloat = val2float(&val);
+}
+
+/*
+ * Decode 'n' recorded "sp78" samples with SMCDecodeColumn() and 'method', in columns
+ * of BENCH_COLUMN; an operation is one sample
+ */
+static void benchDecodeColumn(int n, int method)
+{
+    const SMCDecoder_t *decoder = SMCDecoderFor(bytes2uint32("sp78", 4));
+    int                 i, size;
+
+    if (benchColumn[0] == 0)
+    {
+        for (i = 0; i < sizeof(benchColumn); i++)
+            benchColumn[i] = (char)(i * 37 + 11);
+    }
+    for (i = 0; i < n; i += size)
+    {
+        size = n - i < BENCH_COLUMN ? n - i : BENCH_COLUMN;
+        SMCDecodeColumn(decoder, benchColumn, size, benchDecoded, method);
+        benchSinkFloat = benchDecoded[size - 1];
+    }
+}
+
+static void benchColumnScalar(int n)
+{
+    benchDecodeColumn(n, SMC_COLUMN_SCALAR);
+}
+
+static void benchColumnSSE2(int n)
+{
+    benchDecodeColumn(n, SMC_COLUMN_SSE2);
+}
+
+static void benchColumnAVX2(int n)
+{
+    benchDecodeColumn(n, SMC_COLUMN_AVX2);
+}
+
+static int benchHasSSE2(void)
+{
+    return SMCDecodeColumn(SMCDecoderFor(bytes2uint32("sp78", 4)), benchColumn, 0, benchDecoded,
+                           SMC_COLUMN_SSE2) == kIOReturnSuccess;
+}
+
+static int benchHasAVX2(void)
+{
+    return SMCDecodeColumn(SMCDecoderFor(bytes2uint32("sp78", 4)), benchColumn, 0, benchDecoded,
+                           SMC_COLUMN_AVX2) == kIOReturnSuccess;
+}
+
+static void benchDecode(int n)
+{
+    const SMCDecoder_t *decoder = SMCDecoderFor(bytes2uint32("fpe2", 4));
+    char                bytes[2] = { 0x12, (char)0xc0 };
+    int                 i;
+
+    for (i = 0; i < n; i++)
+        benchSinkFloat = SMCDecode(decoder, bytes, 2);
+}
+
+static void benchOutValue(int n)
+{
+    SMCVal_t val;
+    int      i;
+
+    memset(&val, 0, sizeof(val));
+    memcpy(val.key, "TC0H", 5);
+    memcpy(val.dataType, "sp78", 5);
+    val.dataSize = 2;
+    val.bytes[0] = 0x2a;
+    val.bytes[1] = 0x40;
+    for (i = 0; i < n; i++)
+        SMCOutValue(&val, kIOReturnSuccess);
+    SMCOutFlush();
+}
+
+static void benchReadKey(int n)
+{
+    SMCVal_t val;
+    int      i;
+
+    for (i = 0; i < n; i++)
+        SMCReadKey("TC0H", &val);
+}
+
+static void benchPrintAll(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        SMCPrintAll(1);
+    SMCOutFlush();
+}
+
+static void benchPrintFans(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        SMCPrintFans();
+    SMCOutFlush();
+}
+
+/*
+ * Submit a read of TC0H to the queue, stamped with the time in 'userData'
+ * Returns 1 if it was taken, 0 if the queue is full.
+ */
+static int benchQueueSubmit(void)
+{
+    SMCRequest_t request;
+
+    memset(&request, 0, sizeof(request));
+    request.type = SMC_REQUEST_READ;
+    strcpy(request.val.key, "TC0H");
+    request.userData = (void *)(uintptr_t)SMCTimeNow();    // Differences stay right if it wraps
+    return SMCQueueSubmit(benchQueue, &request, 1);
+}
+
+/*
+ * Reap one completion from the queue, waiting for it, and record its latency
+ */
+static void benchQueueReap(void)
+{
+    SMCRequest_t done;
+
+    if (SMCQueueReap(benchQueue, &done, 1, 1) != 1)
+        return;
+    pthread_mutex_lock(&benchLock);
+    if (benchLatencyCount < BENCH_MAXSAMPLES)
+        benchLatencies[benchLatencyCount++] = (double)((uintptr_t)SMCTimeNow() - (uintptr_t)done.userData);
+    benchCompleted++;
+    pthread_cond_broadcast(&benchProgress);
+    pthread_mutex_unlock(&benchLock);
+}
+
+/*
+ * Reap 'n' reads of TC0H from a queue with 'workers' workers, which is kept full
+ * The queue lives on between runs, so a run of one read also measures the throughput.
+ */
+static void benchQueueReads(int n, int workers)
+{
+    int i;
+
+    if (benchQueue == NULL &&
+        SMCQueueCreate(&benchTransport, workers, BENCH_QUEUEDEPTH, &benchQueue) != kIOReturnSuccess)
+        return;
+    for (i = 0; i < n; i++)
+    {
+        while (benchQueueSubmit() == 1)
+            ;
+        benchQueueReap();
+    }
+}
+
+static void benchQueue1(int n)
+{
+    benchQueueReads(n, 1);
+}
+
+static void benchQueue4(int n)
+{
+    benchQueueReads(n, 4);
+}
+
+/*
+ * A submitter thread: keep its share of the queue in flight until told to stop
+ * Completions go to whichever submitter reaps first, but each one only reaps after
+ * submitting its share, so the queue stays full and never runs dry under a waiting reap.
+ */
+static void *benchSubmitter(void *arg)
+{
+    int inFlight = 0;
+
+    while (!benchStopping)
+    {
+        while (inFlight < BENCH_QUEUEDEPTH / BENCH_SUBMITTERS && benchQueueSubmit() == 1)
+            inFlight++;
+        benchQueueReap();
+        inFlight--;
+    }
+    return NULL;
+}
+
+/*
+ * Wait for 'n' reads reaped by BENCH_SUBMITTERS threads from a queue with 4 workers
+ * The threads start with the first run, and keep the queue full until benchQueueDone().
+ * Reads reaped between runs count for the next run, so none are lost from the throughput.
+ */
+static void benchQueueShared(int n)
+{
+    if (benchQueue == NULL)
+    {
+        if (SMCQueueCreate(&benchTransport, 4, BENCH_QUEUEDEPTH, &benchQueue) != kIOReturnSuccess)
+            return;
+        benchStopping = 0;
+        benchCounted = benchCompleted;
+        for (benchSubmitterCount = 0; benchSubmitterCount < BENCH_SUBMITTERS; benchSubmitterCount++)
+            if (pthread_create(&benchSubmitters[benchSubmitterCount], NULL, benchSubmitter, NULL) != 0)
+                break;
+    }
+    if (benchSubmitterCount == 0)
+        return;
+    pthread_mutex_lock(&benchLock);
+    benchCounted += n;
+    while (benchCompleted < benchCounted)
+        pthread_cond_wait(&benchProgress, &benchLock);
+    pthread_mutex_unlock(&benchLock);
+}
+
+static void benchQueueDone(void)
+{
+    int i;
+
+    benchStopping = 1;
+    for (i = 0; i < benchSubmitterCount; i++)
+        pthread_join(benchSubmitters[i], NULL);
+    benchSubmitterCount = 0;
+    SMCQueueDestroy(benchQueue);
+    benchQueue = NULL;
+}
+
+static const SMCBench_t benches[] = {
+    { "bytes2uint32", benchBytes2uint32, 0, NULL, NULL, 0 },
+    { "uint32tostr",  benchUint32tostr,  0, NULL, NULL, 0 },
+    { "parseValue",   benchParseValue,   0, NULL, NULL, 0 },
+    { "val2float",    benchVal2float,    0, NULL, NULL, 0 },
+    { "SMCDecode",    benchDecode,       0, NULL, NULL, 0 },
+    { "SMCDecodeColumn/scalar", benchColumnScalar, 0, NULL, NULL, 0 },
+    { "SMCDecodeColumn/SSE2", benchColumnSSE2, 0, NULL, benchHasSSE2, 0 },
+    { "SMCDecodeColumn/AVX2", benchColumnAVX2, 0, NULL, benchHasAVX2, 0 },
+    { "SMCOutValue",  benchOutValue,     1, NULL, NULL, 0 },
+    { "SMCReadKey",   benchReadKey,      0, NULL, NULL, 0 },
+    { "SMCPrintAll",  benchPrintAll,     1, NULL, NULL, 0 },
+    { "SMCPrintFans", benchPrintFans,    1, NULL, NULL, 0 },
+    { "SMCQueue/1",   benchQueue1,       0, benchQueueDone, NULL, 1 },
+    { "SMCQueue/4",   benchQueue4,       0, benchQueueDone, NULL, 1 },
+    { "SMCQueue/4x4", benchQueueShared,  0, benchQueueDone, NULL, 1 },
+};
+#define BENCHCOUNT (sizeof(benches) / sizeof(benches[0]))
+
+static int benchCompare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * Print the result of one benchmark in the output format
+ * Operations per second are worked out from the mean. 'latency50' and 'latency99' are
+ * the completion latencies of a queue, or NaN for the other benchmarks.
+ */
+static void benchPrint(const char *name, int batch, int samples, double mean,
+                       double p50, double p99, double calls, double latency50, double latency99, int first)
+{
+    switch (SMCOutFormat())
+    {
+        case SMC_OUT_TEXT:
+            if (first)
+                printf("Benchmark                batch  samples        ns/op          p50          p99        ops/s   calls/op"
+                       "  latency p50  latency p99\n");
+            printf("%-22s %7d %8d %12.1f %12.1f %12.1f %12.4g %10.3f",
+                   name, batch, samples, mean, p50, p99, 1e9 / mean, calls);
+            if (!isnan(latency50))
+                printf(" %12.0f %12.0f", latency50, latency99);
+            printf("\n");
+            break;
+        case SMC_OUT_JSON:
+        case SMC_OUT_NDJSON:
+            printf("%s{\"benchmark\":\"%s\",\"version\":\"%s\",\"transport\":\"%s\",\"batch\":%d,\"samples\":%d,"
+                   "\"ns_per_op\":%.1f,\"p50_ns\":%.1f,\"p99_ns\":%.1f,\"ops_per_s\":%.0f,\"calls_per_op\":%.3f",
+                   SMCOutFormat() == SMC_OUT_NDJSON ? "" : (first ? "[\n  " : ",\n  "),
+                   name, VERSION, benchInner->name, batch, samples, mean, p50, p99, 1e9 / mean, calls);
+            if (!isnan(latency50))
+                printf(",\"latency_p50_ns\":%.0f,\"latency_p99_ns\":%.0f", latency50, latency99);
+            printf("}");
+            if (SMCOutFormat() == SMC_OUT_NDJSON)
+                printf("\n");
+            break;
+        case SMC_OUT_CSV:
+            if (first)
+                printf("benchmark,version,transport,batch,samples,ns_per_op,p50_ns,p99_ns,ops_per_s,calls_per_op,"
+                       "latency_p50_ns,latency_p99_ns\n");
+            printf("%s,%s,%s,%d,%d,%.1f,%.1f,%.1f,%.0f,%.3f,",
+                   name, VERSION, benchInner->name, batch, samples, mean, p50, p99, 1e9 / mean, calls);
+            if (!isnan(latency50))
+                printf("%.0f,%.0f", latency50, latency99);
+            else
+                printf(",");
+            printf("\n");
+            break;
+    }
+}
+
+/*
+ * Run all benchmarks, each for about 'duration' milliseconds, and print the results
+ * Returns kIOReturnSuccess, or kIOReturnError if /dev/null cannot be opened.
+ */
+kern_return_t SMCBench(int duration)
+{
+    const SMCBench_t *b;
+    UInt64            start, end, stop, elapsed, total;
+    unsigned long     calls;
+    double            latency50, latency99;
+    int               format = SMCOutFormat(), devnull, saved, batch, samples, k, printed = 0;
+
+    devnull = open("/dev/null", O_WRONLY);
+    saved = dup(STDOUT_FILENO);
+    if (devnull < 0 || saved < 0)
+    {
+        perror("Error: cannot redirect output for the benchmarks");
+        return kIOReturnError;
+    }
+
+    benchInner = transport;
+    transport = &benchTransport;
+
+    if (format == SMC_OUT_TEXT)
+        printf("smc %s, transport %s, %d ms per benchmark\n", VERSION, benchInner->name, duration);
+
+    for (k = 0; k < BENCHCOUNT; k++)
+    {
+        b = &benches[k];
+        if (b->available != NULL && !b->available())
+            continue;   // Not on this processor
+
+        // Values are printed in the classic form
+        fflush(stdout);
+        SMCOutSetFormat(SMC_OUT_TEXT);
+        if (b->quiet)
+            dup2(devnull, STDOUT_FILENO);
+
+        // Warm up (and fill the key info cache), then find a batch that takes long enough
+        b->run(1);
+        for (batch = 1; batch < BENCH_MAXBATCH; batch *= 2)
+        {
+            start = SMCTimeNow();
+            b->run(batch);
+            if (SMCTimeNow() - start >= BENCH_MINBATCH)
+                break;
+        }
+
+        calls = __atomic_load_n(&benchCalls, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&benchLock);
+        benchLatencyCount = 0;      // Only the requests of the timed runs
+        pthread_mutex_unlock(&benchLock);
+        total = 0;
+        stop = SMCTimeNow() + (UInt64)duration * 1000000;
+        for (samples = 0; samples < BENCH_MAXSAMPLES && (samples < 3 || SMCTimeNow() < stop); samples++)
+        {
+            start = SMCTimeNow();
+            b->run(batch);
+            end = SMCTimeNow();
+            elapsed = end - start;
+            total += elapsed;
+            benchSamples[samples] = (double)elapsed / batch;
+        }
+        calls = __atomic_load_n(&benchCalls, __ATOMIC_RELAXED) - calls;
+        if (b->done != NULL)
+            b->done();
+
+        fflush(stdout);
+        if (b->quiet)
+            dup2(saved, STDOUT_FILENO);
+        SMCOutSetFormat(format);
+
+        latency50 = latency99 = NAN;
+        if (b->latency && benchLatencyCount > 0)
+        {
+            qsort(benchLatencies, benchLatencyCount, sizeof(double), benchCompare);
+            latency50 = benchLatencies[benchLatencyCount / 2];
+            latency99 = benchLatencies[(benchLatencyCount * 99) / 100];
+        }
+        qsort(benchSamples, samples, sizeof(double), benchCompare);
+        benchPrint(b->name, batch, samples, (double)total / samples / batch,
+                   benchSamples[samples / 2], benchSamples[(samples * 99) / 100],
+                   (double)calls / samples / batch, latency50, latency99, printed++ == 0);
+        fflush(stdout);
+    }
+    if (format == SMC_OUT_JSON)
+        printf("\n]\n");
+
+    transport = benchInner;
+    close(devnull);
+    close(saved);
+    return kIOReturnSuccess;
+}
@@ -0,0 +1,494 @@
+/*
+ *  smccache.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Persistent cache of key information (size, type and attributes of each key)
+ *
+ * The size and type of a key never change for a given SMC firmware, so they only
+ * need to be asked once with SMC_CMD_READ_KEYINFO. After that reading a key takes
+ * a single SMC_CMD_READ_BYTES call.
+ *
+ * The cache is kept in a file between runs. The file records the firmware version
+ * (SMC_CMD_READ_VERS) and the number of keys (#KEY). When the cache is opened both
+ * are read from the SMC; if either differs the cached information is thrown away.
+ * This costs two calls per connection, so the cache pays off as soon as a run
+ * reads more than two keys.
+ * Keys the SMC does not know are cached too, in a separate list, so asking for a
+ * fan that does not exist is not repeated either.
+ * Without a file (no SMCCacheOpen()) the cache still lives in memory for the
+ * duration of the run, so every key is asked about only once.
+ *
+ * The cache also remembers the key the SMC gave for each index (SMC_CMD_READ_INDEX).
+ * Only those answers fill this directory: the key info entries cannot stand in for
+ * it, as they also hold keys learned by reading them directly, which need not be
+ * among the indexed keys. Once a run has asked for every index, SMCPrintAll() no
+ * longer needs SMC_CMD_READ_INDEX.
+ *
+ * File layout (in the byte order of the machine; the file is only meant to be
+ * read back on the machine that wrote it):
+ * - SMCCacheHeader_t
+ * - 'entries' times SMCCacheEntry_t, sorted on key
+ * - 'missing' times a UInt32 key that does not exist, sorted
+ * - if 'indexed' is not 0, 'keyCount' times a UInt32: the key with that index, or 0 if
+ *   not known yet
+ * The file is memory mapped, so opening even a large cache costs next to nothing.
+ * The mapping is only copied to the heap when something new is learned (cacheOwn()).
+ *
+ * The lookup functions may be called from several threads at once (see SMCPrintAll()).
+ * SMCCacheOpen() and SMCCacheClose() may not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "smc.h"
+
+#define SMC_CACHE_MAGIC     "SMCk"
+#define SMC_CACHE_VERSION   3
+
+typedef struct {
+    char                  magic[4];     // SMC_CACHE_MAGIC
+    UInt32                version;      // SMC_CACHE_VERSION
+    SMCKeyData_vers_t     vers;         // Firmware version of the SMC
+    UInt32                keyCount;     // Value of #KEY
+    UInt32                entries;      // Number of SMCCacheEntry_t following the header
+    UInt32                missing;      // Number of missing keys following the entries
+    UInt32                indexed;      // Number of indexes in the directory with a key
+} SMCCacheHeader_t;
+
+typedef struct {
+    UInt32                key;
+    UInt32                dataType;
+    UInt8                 dataSize;
+    UInt8                 dataAttributes;
+    UInt16                reserved;
+} SMCCacheEntry_t;
+
+static char             *cacheFile = NULL;      // NULL: cache only lives in memory
+static SMCCacheHeader_t  cacheHeader;
+static SMCCacheEntry_t  *cacheEntries = NULL;   // Sorted on key
+static UInt32           *cacheMissing = NULL;   // Sorted
+static UInt32           *cacheDirectory = NULL; // Key of each index, 0 if not known; NULL if none known
+static int               cacheEntriesAllocated = 0;
+static int               cacheMissingAllocated = 0;
+static void             *cacheMap = NULL;       // Mapping of the file, while unchanged
+static size_t            cacheMapSize = 0;
+static int               cacheDirty = 0;        // Must be written back
+static pthread_mutex_t   cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Find 'key' in a sorted array of 'count' elements of 'size' bytes, each starting with a UInt32 key
+ * Returns the index of the element, or -(insertion point + 1) if the key is not present
+ */
+static int cacheFind(const void *array, int count, size_t size, UInt32 key)
+{
+    int lo = 0, hi = count - 1;
+
+    while (lo <= hi) {
+        int    mid = (lo + hi) / 2;
+        UInt32 k = *(const UInt32 *)((const char *)array + mid * size);
+        if (k == key)
+            return mid;
+        if (k < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -(lo + 1);
+}
+
+/*
+ * Move the cached arrays out of the (read only) file mapping, so they can be changed
+ * Returns 0 if there is no memory.
+ */
+static int cacheOwn(void)
+{
+    SMCCacheEntry_t *entries;
+    UInt32          *missing, *directory = NULL;
+
+    if (cacheMap == NULL)
+        return 1;
+    entries = malloc((cacheHeader.entries + 1) * sizeof(SMCCacheEntry_t));
+    missing = malloc((cacheHeader.missing + 1) * sizeof(UInt32));
+    if (cacheDirectory != NULL)
+        directory = malloc(cacheHeader.keyCount * sizeof(UInt32));
+    if (entries == NULL || missing == NULL || (cacheDirectory != NULL && directory == NULL)) {
+        free(entries);
+        free(missing);
+        free(directory);
+        return 0;
+    }
+    memcpy(entries, cacheEntries, cacheHeader.entries * sizeof(SMCCacheEntry_t));
+    memcpy(missing, cacheMissing, cacheHeader.missing * sizeof(UInt32));
+    if (directory != NULL)
+        memcpy(directory, cacheDirectory, cacheHeader.keyCount * sizeof(UInt32));
+    cacheEntries = entries;
+    cacheMissing = missing;
+    cacheDirectory = directory;
+    cacheEntriesAllocated = cacheHeader.entries + 1;
+    cacheMissingAllocated = cacheHeader.missing + 1;
+    munmap(cacheMap, cacheMapSize);
+    cacheMap = NULL;
+    cacheMapSize = 0;
+    return 1;
+}
+
+/*
+ * Make room for one more element at index 'i' of a sorted array of 'count' elements
+ * Returns 0 if there is no memory.
+ */
+static int cacheInsert(void **arrayp, int *allocatedp, int count, size_t size, int i)
+{
+    char *array;
+
+    if (!cacheOwn())
+        return 0;
+    array = *arrayp;
+    if (count == *allocatedp) {
+        int allocated = count ? 2 * count : 64;
+
+        array = realloc(array, allocated * size);
+        if (array == NULL)
+            return 0;
+        *arrayp = array;
+        *allocatedp = allocated;
+    }
+    memmove(array + (i + 1) * size, array + i * size, (count - i) * size);
+    memset(array + i * size, 0, size);     // No stray padding bytes in the file
+    return 1;
+}
+
+/*
+ * Read the firmware version and number of keys from the SMC into 'header'
+ */
+static kern_return_t cacheIdentify(SMCCacheHeader_t *header)
+{
+    kern_return_t result;
+    SMCKeyData_t  inputStructure;
+    SMCKeyData_t  outputStructure;
+
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+    inputStructure.data8 = SMC_CMD_READ_VERS;
+    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+    if (result != kIOReturnSuccess)
+        return result;
+    header->vers = outputStructure.vers;
+
+    // #KEY is always a ui32, so its bytes can be read without asking for its key info
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+    inputStructure.key = bytes2uint32("#KEY", 4);
+    inputStructure.keyInfo.dataSize = 4;
+    inputStructure.data8 = SMC_CMD_READ_BYTES;
+    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+    if (result != kIOReturnSuccess)
+        return result;
+    if (outputStructure.result != SMC_RESULT_SUCCESS)
+        return kIOReturnError;
+    header->keyCount = bytes2uint32(outputStructure.bytes, 4);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Map the cache file and use its contents if they match 'current'
+ */
+static void cacheMapFile(const char *filename, SMCCacheHeader_t *current)
+{
+    int               fd;
+    struct stat       st;
+    void             *map;
+    SMCCacheHeader_t *saved;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;     // No cache yet
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(SMCCacheHeader_t)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    saved = map;
+    if (memcmp(saved->magic, current->magic, 4) == 0 &&
+        saved->version == current->version &&
+        memcmp(&saved->vers, &current->vers, sizeof(current->vers)) == 0 &&
+        saved->keyCount == current->keyCount &&
+        saved->indexed <= current->keyCount &&
+        st.st_size == sizeof(SMCCacheHeader_t) + saved->entries * sizeof(SMCCacheEntry_t)
+                                               + saved->missing * sizeof(UInt32)
+                                               + (saved->indexed > 0 ? saved->keyCount : 0) * sizeof(UInt32))
+    {
+        cacheMap = map;
+        cacheMapSize = st.st_size;
+        cacheEntries = (SMCCacheEntry_t *)(saved + 1);
+        cacheMissing = (UInt32 *)(cacheEntries + saved->entries);
+        cacheDirectory = saved->indexed > 0 ? cacheMissing + saved->missing : NULL;
+        cacheEntriesAllocated = saved->entries;
+        cacheMissingAllocated = saved->missing;
+        cacheHeader.entries = saved->entries;
+        cacheHeader.missing = saved->missing;
+        cacheHeader.indexed = saved->indexed;
+        cacheDirty = 0;
+    }
+    else
+        munmap(map, st.st_size);
+}
+
+/*
+ * Empty the cache
+ */
+static void cacheReset(void)
+{
+    if (cacheMap != NULL) {
+        munmap(cacheMap, cacheMapSize);
+    } else {
+        free(cacheEntries);
+        free(cacheMissing);
+        free(cacheDirectory);
+    }
+    free(cacheFile);
+    cacheFile = NULL;
+    cacheEntries = NULL;
+    cacheMissing = NULL;
+    cacheDirectory = NULL;
+    cacheEntriesAllocated = 0;
+    cacheMissingAllocated = 0;
+    cacheMap = NULL;
+    cacheMapSize = 0;
+    cacheDirty = 0;
+    memset(&cacheHeader, 0, sizeof(cacheHeader));
+}
+
+/*
+ * Start using the key info cache in 'filename'
+ * Must be called after SMCOpen(). Reads the cache file if it exists and still
+ * matches the SMC; otherwise starts with an empty cache.
+ * Returns kIOReturnSuccess, or an error code if the SMC could not be identified
+ * (in which case no cache is used).
+ */
+kern_return_t SMCCacheOpen(const char *filename)
+{
+    kern_return_t    result;
+    SMCCacheHeader_t current;
+
+    memset(&current, 0, sizeof(current));
+    result = cacheIdentify(&current);
+    if (result != kIOReturnSuccess)
+        return result;
+    memcpy(current.magic, SMC_CACHE_MAGIC, 4);
+    current.version = SMC_CACHE_VERSION;
+
+    cacheReset();
+    cacheFile = strdup(filename);
+    cacheHeader = current;
+    cacheDirty = 1;
+    cacheMapFile(filename, &current);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Write the cache back to its file if anything changed, and empty it
+ * The file is replaced atomically, so concurrent runs never see half a cache.
+ */
+void SMCCacheClose(void)
+{
+    char *tmpname;
+    FILE *f;
+    int   ok;
+
+    if (cacheFile != NULL && cacheDirty) {
+        tmpname = malloc(strlen(cacheFile) + 16);
+        if (tmpname != NULL) {
+            sprintf(tmpname, "%s.%d", cacheFile, (int)getpid());
+            f = fopen(tmpname, "wb");
+            if (f != NULL) {
+                ok = fwrite(&cacheHeader, sizeof(cacheHeader), 1, f) == 1 &&
+                     fwrite(cacheEntries, sizeof(SMCCacheEntry_t), cacheHeader.entries, f) == cacheHeader.entries &&
+                     fwrite(cacheMissing, sizeof(UInt32), cacheHeader.missing, f) == cacheHeader.missing &&
+                     (cacheHeader.indexed == 0 ||
+                      fwrite(cacheDirectory, sizeof(UInt32), cacheHeader.keyCount, f) == cacheHeader.keyCount);
+                ok = (fclose(f) == 0) && ok;
+                if (!ok || rename(tmpname, cacheFile) != 0) {
+                    fprintf(stderr, "Warning: could not write key info cache '%s'\n", cacheFile);
+                    remove(tmpname);
+                }
+            }
+            free(tmpname);
+        }
+    }
+
+    cacheReset();
+}
+
+/*
+ * Look up the key info of 'key'
+ * Returns 1 and fills in 'keyInfop' if the key is in the cache, otherwise returns 0
+ * A key that is known not to exist is returned with a dataType of zero.
+ */
+int SMCCacheLookup(UInt32 key, SMCKeyData_keyInfo_t *keyInfop)
+{
+    int i, found = 1;
+
+    pthread_mutex_lock(&cacheLock);
+    i = cacheFind(cacheEntries, cacheHeader.entries, sizeof(SMCCacheEntry_t), key);
+    if (i >= 0) {
+        keyInfop->dataSize = cacheEntries[i].dataSize;
+        keyInfop->dataType = cacheEntries[i].dataType;
+        keyInfop->dataAttributes = cacheEntries[i].dataAttributes;
+    } else if (cacheFind(cacheMissing, cacheHeader.missing, sizeof(UInt32), key) >= 0) {
+        memset(keyInfop, 0, sizeof(SMCKeyData_keyInfo_t));
+    } else {
+        found = 0;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
+
+/*
+ * Add the key info of 'key' to the cache; see SMCCacheStore()
+ */
+static void cacheStore(UInt32 key, SMCKeyData_keyInfo_t *keyInfop)
+{
+    int i;
+
+    if (keyInfop->dataType == 0) {
+        i = cacheFind(cacheMissing, cacheHeader.missing, sizeof(UInt32), key);
+        if (i >= 0)
+            return;
+        i = -i - 1;
+        if (!cacheInsert((void **)&cacheMissing, &cacheMissingAllocated, cacheHeader.missing, sizeof(UInt32), i))
+            return;     // Simply do not cache
+        cacheMissing[i] = key;
+        cacheHeader.missing++;
+        cacheDirty = 1;
+        return;
+    }
+
+    i = cacheFind(cacheEntries, cacheHeader.entries, sizeof(SMCCacheEntry_t), key);
+    if (i < 0) {
+        i = -i - 1;
+        if (!cacheInsert((void **)&cacheEntries, &cacheEntriesAllocated, cacheHeader.entries, sizeof(SMCCacheEntry_t), i))
+            return;     // Simply do not cache
+        cacheHeader.entries++;
+    } else if (cacheEntries[i].dataSize == keyInfop->dataSize &&
+               cacheEntries[i].dataType == keyInfop->dataType &&
+               cacheEntries[i].dataAttributes == (UInt8)keyInfop->dataAttributes) {
+        return;     // Nothing new
+    } else if (!cacheOwn()) {
+        return;
+    }
+    cacheEntries[i].key = key;
+    cacheEntries[i].dataType = keyInfop->dataType;
+    cacheEntries[i].dataSize = keyInfop->dataSize;
+    cacheEntries[i].dataAttributes = keyInfop->dataAttributes;
+    cacheDirty = 1;
+}
+
+/*
+ * Add the key info of 'key' to the cache
+ * A 'keyInfop' with a dataType of zero records that the key does not exist.
+ */
+void SMCCacheStore(UInt32 key, SMCKeyData_keyInfo_t *keyInfop)
+{
+    pthread_mutex_lock(&cacheLock);
+    cacheStore(key, keyInfop);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/*
+ * Remove 'key' from the cache, for instance because the SMC rejected its cached size
+ */
+void SMCCacheForget(UInt32 key)
+{
+    int i;
+
+    pthread_mutex_lock(&cacheLock);
+    i = cacheFind(cacheEntries, cacheHeader.entries, sizeof(SMCCacheEntry_t), key);
+    if (i >= 0 && cacheOwn()) {
+        memmove(&cacheEntries[i], &cacheEntries[i + 1], (cacheHeader.entries - i - 1) * sizeof(SMCCacheEntry_t));
+        cacheHeader.entries--;
+        cacheDirty = 1;
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/*
+ * Number of keys in the SMC (#KEY), as checked when the cache was opened
+ * Returns 0 if no cache file is in use.
+ */
+UInt32 SMCCacheKeyCount(void)
+{
+    return cacheHeader.keyCount;
+}
+
+/*
+ * Get the key with index 'index' from the cached directory of the SMC
+ * Returns 1 and fills in 'keyp', or 0 if the SMC was not asked for that index yet.
+ */
+int SMCCacheKeyAt(int index, UInt32 *keyp)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&cacheLock);
+    if (cacheDirectory != NULL && index >= 0 && index < (int)cacheHeader.keyCount && cacheDirectory[index] != 0)
+    {
+        *keyp = cacheDirectory[index];
+        found = 1;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
+
+/*
+ * Add to the directory that the SMC gave 'key' for index 'index' (SMC_CMD_READ_INDEX)
+ * Ignored if no cache file is in use, as then the number of keys is not known.
+ */
+void SMCCacheStoreIndex(int index, UInt32 key)
+{
+    pthread_mutex_lock(&cacheLock);
+    if (cacheHeader.keyCount != 0 && index >= 0 && index < (int)cacheHeader.keyCount && key != 0 &&
+        (cacheDirectory == NULL || cacheDirectory[index] != key) && cacheOwn())
+    {
+        if (cacheDirectory == NULL)
+            cacheDirectory = calloc(cacheHeader.keyCount, sizeof(UInt32));
+        if (cacheDirectory != NULL)
+        {
+            if (cacheDirectory[index] == 0)
+                cacheHeader.indexed++;
+            cacheDirectory[index] = key;
+            cacheDirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
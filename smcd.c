@@ -0,0 +1,436 @@
+/*
+ *  smcd.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Daemon mode: keep one SMC connection open and serve other smc processes
+ *
+ * 'smc -d <socket>' opens the SMC once and listens on a Unix domain socket.
+ * 'smc -u <socket> ...' then uses the daemon as its transport instead of opening
+ * the SMC itself: every SMCCall() becomes one request/reply exchange on the socket.
+ * So all options (-r, -w, -l, -f) work unchanged through the daemon, and a client
+ * saves the cost of finding and opening the AppleSMC.
+ *
+ * The daemon answers what it can without bothering the SMC:
+ * - SMC_CMD_READ_KEYINFO from its key info cache (see smccache.c)
+ * - SMC_CMD_READ_INDEX from the key directory of the cache file, for the indexes asked before
+ * - SMC_CMD_READ_BYTES from a value cache, if the same key was read less than
+ *   the time-to-live (-t, in milliseconds) ago. A write to a key drops its cached value.
+ * Everything else is passed on to the SMC.
+ *
+ * Requests and replies are fixed size structures in the byte order of the machine;
+ * client and daemon are always the same program on the same machine.
+ * The socket is only accessible to the user running the daemon.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "smc.h"
+
+#define SMCD_MAGIC          0x534d4364  // "SMCd"
+#define SMCD_MAXCLIENTS     64
+#define SMCD_VALUESLOTS     1024        // Power of 2, well above the number of keys
+
+typedef struct {
+    UInt32                magic;        // SMCD_MAGIC
+    int                   index;        // As passed to SMCCall()
+    SMCKeyData_t          data;
+} SMCDRequest_t;
+
+typedef struct {
+    UInt32                magic;        // SMCD_MAGIC
+    kern_return_t         result;       // As returned by SMCCall()
+    SMCKeyData_t          data;
+} SMCDReply_t;
+
+// A cached value, in a hash table indexed by key
+typedef struct {
+    UInt32                key;          // 0: slot unused
+    UInt32                dataSize;
+    UInt64                time;         // When the value was read (SMCTimeNow()); 0 if not valid
+    SMCBytes_t            bytes;
+} SMCDValue_t;
+
+// A client, with the part of its next request received so far
+typedef struct {
+    size_t                received;     // Bytes of 'request'
+    SMCDRequest_t         request;
+} SMCDClient_t;
+
+static SMCDValue_t        values[SMCD_VALUESLOTS];
+static volatile sig_atomic_t stopping = 0;
+static char              *clientSocket = NULL;  // Socket of the daemon used by the client transport
+
+/*
+ * Find the value cache slot for 'key'
+ * Returns the slot holding the key, or the empty slot where it should go.
+ * Returns NULL if the table is full.
+ */
+static SMCDValue_t *valueSlot(UInt32 key)
+{
+    UInt32 i, h = (key * 2654435761u) & (SMCD_VALUESLOTS - 1);
+
+    for (i = 0; i < SMCD_VALUESLOTS; i++) {
+        SMCDValue_t *v = &values[(h + i) & (SMCD_VALUESLOTS - 1)];
+        if (v->key == key || v->key == 0)
+            return v;
+    }
+    return NULL;
+}
+
+/*
+ * Read or write all 'size' bytes of 'buf' on socket 'fd'
+ * Returns 0 on success, -1 on error or end of file.
+ */
+static int readAll(int fd, void *buf, size_t size)
+{
+    char   *p = buf;
+    ssize_t n;
+
+    while (size > 0) {
+        n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int writeAll(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    ssize_t     n;
+
+    while (size > 0) {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Fill in 'sun' with the address of socket 'path'
+ * Returns 0, or -1 if the path is too long.
+ */
+static int socketAddress(struct sockaddr_un *sun, const char *path)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path))
+        return -1;
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+/*
+ * Read what client 'fd' has sent of its next request, without waiting for the rest
+ * Returns 1 once the request is complete, 0 if part of it is still to come,
+ * -1 if the client went away.
+ */
+static int clientReceive(int fd, SMCDClient_t *client)
+{
+    ssize_t n;
+
+    do {
+        n = read(fd, (char *)&client->request + client->received, sizeof(client->request) - client->received);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (n <= 0)
+        return -1;
+    client->received += n;
+    if (client->received < sizeof(client->request))
+        return 0;
+    client->received = 0;
+    return 1;
+}
+
+/*
+ * Handle one request from a client
+ * - 'ttl' is the time-to-live of cached values in nanoseconds
+ */
+static void daemonHandle(SMCDRequest_t *request, SMCDReply_t *reply, UInt64 ttl)
+{
+    SMCKeyData_t         *in = &request->data;
+    SMCKeyData_t         *out = &reply->data;
+    SMCKeyData_keyInfo_t  keyInfo;
+    SMCDValue_t          *v;
+    UInt32                key;
+    UInt64                now;
+
+    memset(reply, 0, sizeof(*reply));
+    reply->magic = SMCD_MAGIC;
+    out->key = in->key;
+
+    if (request->index == KERNEL_INDEX_SMC) {
+        switch (in->data8) {
+            case SMC_CMD_READ_KEYINFO:
+                reply->result = SMCGetKeyInfo(in->key, &keyInfo);
+                if (reply->result == kIOReturnSuccess) {
+                    out->keyInfo = keyInfo;
+                } else if ((unsigned int)reply->result <= 0xff) {
+                    // An SMC result code, not a failed call
+                    out->result = (char)reply->result;
+                    reply->result = kIOReturnSuccess;
+                }
+                return;
+            case SMC_CMD_READ_INDEX:
+                if (SMCCacheKeyAt(in->data32, &key)) {
+                    out->key = key;
+                    return;
+                }
+                reply->result = SMCCall(request->index, in, out);
+                if (reply->result == kIOReturnSuccess && out->result == SMC_RESULT_SUCCESS)
+                    SMCCacheStoreIndex(in->data32, out->key);
+                return;
+            case SMC_CMD_READ_BYTES:
+                now = SMCTimeNow();
+                v = valueSlot(in->key);
+                if (v != NULL && v->key == in->key && v->dataSize == in->keyInfo.dataSize &&
+                    v->time > 0 && now - v->time < ttl) {
+                    memcpy(out->bytes, v->bytes, sizeof(out->bytes));
+                    return;
+                }
+                reply->result = SMCCall(request->index, in, out);
+                if (ttl > 0 && v != NULL && reply->result == kIOReturnSuccess && out->result == SMC_RESULT_SUCCESS) {
+                    v->key = in->key;
+                    v->dataSize = in->keyInfo.dataSize;
+                    v->time = now;
+                    memcpy(v->bytes, out->bytes, sizeof(v->bytes));
+                }
+                return;
+            case SMC_CMD_WRITE_BYTES:
+                v = valueSlot(in->key);
+                if (v != NULL && v->key == in->key)
+                    v->time = 0;
+                break;
+        }
+    }
+    reply->result = SMCCall(request->index, in, out);
+}
+
+/*
+ * Make way for the socket 'path'
+ * Only a socket that no daemon answers on any more, left behind by an earlier one,
+ * is removed. Returns 0 if 'path' is free now, otherwise -1 after saying why.
+ */
+static int socketReclaim(const char *path, struct sockaddr_un *sun)
+{
+    struct stat st;
+    int         fd, live;
+
+    if (lstat(path, &st) != 0)
+        return 0;
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "Error: '%s' exists and is not a socket\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Error: socket()");
+        return -1;
+    }
+    live = connect(fd, (struct sockaddr *)sun, sizeof(*sun)) == 0;
+    close(fd);
+    if (live) {
+        fprintf(stderr, "Error: a daemon is already listening on '%s'\n", path);
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
+
+static void daemonStop(int sig)
+{
+    stopping = 1;
+}
+
+/*
+ * Serve SMC requests on the Unix domain socket 'path' until interrupted
+ * - 'ttlms' is the time-to-live of cached values in milliseconds; 0 disables the value cache
+ * The SMC must already be open (SMCOpen()).
+ * Returns kIOReturnSuccess when stopped by SIGINT or SIGTERM, otherwise an error code.
+ */
+kern_return_t SMCServe(const char *path, int ttlms)
+{
+    struct sockaddr_un sun;
+    struct pollfd      fds[SMCD_MAXCLIENTS + 1];
+    SMCDClient_t       clients[SMCD_MAXCLIENTS + 1];    // Of fds[1 ..]
+    struct sigaction   sa;
+    int                nfds = 1, i, fd, received;
+    mode_t             mask;
+    SMCDReply_t        reply;
+
+    if (socketAddress(&sun, path) != 0) {
+        fprintf(stderr, "Error: socket path too long: '%s'\n", path);
+        return kIOReturnBadArgument;
+    }
+
+    if (socketReclaim(path, &sun) != 0)
+        return kIOReturnError;
+    fds[0].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fds[0].fd < 0) {
+        perror("Error: socket()");
+        return kIOReturnError;
+    }
+    mask = umask(077);
+    if (bind(fds[0].fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(fds[0].fd, 16) != 0) {
+        umask(mask);
+        perror("Error: cannot listen on socket");
+        close(fds[0].fd);
+        return kIOReturnError;
+    }
+    umask(mask);
+    fds[0].events = POLLIN;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemonStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    memset(values, 0, sizeof(values));
+
+    while (!stopping) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error: poll()");
+            break;
+        }
+
+        // New client?
+        if (fds[0].revents & POLLIN) {
+            fd = accept(fds[0].fd, NULL, NULL);
+            if (fd >= 0 && nfds <= SMCD_MAXCLIENTS) {
+                // Never wait on one client: a request that arrives in parts is collected in 'clients'
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                fds[nfds].fd = fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                clients[nfds].received = 0;
+                nfds++;
+            } else if (fd >= 0) {
+                close(fd);      // Too many clients
+            }
+        }
+
+        // Requests. Each client waits for its reply before sending the next request,
+        // so the reply fits in the socket buffer.
+        for (i = 1; i < nfds; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            received = (fds[i].revents & POLLIN) ? clientReceive(fds[i].fd, &clients[i]) : -1;
+            if (received == 0)
+                continue;
+            if (received > 0 && clients[i].request.magic == SMCD_MAGIC) {
+                daemonHandle(&clients[i].request, &reply, (UInt64)ttlms * 1000000);
+                if (writeAll(fds[i].fd, &reply, sizeof(reply)) == 0)
+                    continue;
+            }
+            // Client went away, or sent something that is not a request
+            close(fds[i].fd);
+            nfds--;
+            fds[i] = fds[nfds];
+            clients[i] = clients[nfds];
+            i--;
+        }
+    }
+
+    for (i = 0; i < nfds; i++)
+        close(fds[i].fd);
+    unlink(path);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Use the daemon listening on 'path' as the SMC (see SMCClientTransport)
+ */
+void SMCClientSetSocket(const char *path)
+{
+    clientSocket = strdup(path);
+}
+
+static kern_return_t clientOpen(io_connect_t *connp)
+{
+    struct sockaddr_un sun;
+    int                fd;
+
+    if (clientSocket == NULL || socketAddress(&sun, clientSocket) != 0)
+        return kIOReturnNoDevice;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return kIOReturnNotOpen;    // No daemon on the socket; SMCOpen() reports it
+    }
+    signal(SIGPIPE, SIG_IGN);
+    *connp = fd;
+    return kIOReturnSuccess;
+}
+
+static kern_return_t clientClose(io_connect_t conn)
+{
+    close(conn);
+    return kIOReturnSuccess;
+}
+
+static kern_return_t clientCall(io_connect_t conn, int index, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    SMCDRequest_t request;
+    SMCDReply_t   reply;
+
+    request.magic = SMCD_MAGIC;
+    request.index = index;
+    request.data = *inputStructurep;
+    if (writeAll(conn, &request, sizeof(request)) != 0 ||
+        readAll(conn, &reply, sizeof(reply)) != 0 ||
+        reply.magic != SMCD_MAGIC)
+        return kIOReturnIPCError;
+    *outputStructurep = reply.data;
+    return reply.result;
+}
+
+SMCTransport_t SMCClientTransport = {
+    "smc daemon",
+    clientOpen,
+    clientClose,
+    clientCall
+};
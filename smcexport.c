@@ -0,0 +1,307 @@
+/*
+ *  smcexport.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Exporter for the Prometheus node_exporter textfile collector (-P)
+ *
+ * Writes the fan speeds (F%dAc, F%dTg, F%dMn, F%dMx), all temperatures ('T...' keys)
+ * and all power readings ('P...' keys) of a fixed point type, plus any keys given
+ * with -k, to a file in the Prometheus text exposition format:
+ *   smc_fan_speed_rpm{fan="0"} 1200
+ *   smc_temperature_celsius{key="TC0H"} 42.25
+ * The file is rewritten every interval: the text goes to "<file>.tmp", which is then
+ * renamed to <file>. So the collector never sees a half written file.
+ *
+ * The set of keys is worked out once, at the start. After that an interval costs
+ * one SMC_CMD_READ_BYTES call per key (the key info comes from the cache), formatting
+ * into a buffer allocated at the start, and one write() and rename().
+ * Keys that cannot be read in an interval are left out of the file for that
+ * interval, and counted in smc_exporter_read_errors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "smc.h"
+
+#define EXPORT_LINE     128     // Longest line written for a key
+#define EXPORT_EXTRA    2048    // Room for the HELP and TYPE lines
+
+// The metrics, in the order they are written
+enum {
+    METRIC_FAN_SPEED,
+    METRIC_FAN_TARGET,
+    METRIC_FAN_MIN,
+    METRIC_FAN_MAX,
+    METRIC_TEMPERATURE,
+    METRIC_POWER,
+    METRIC_VALUE,
+    METRIC_COUNT
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    const char *fanKey;     // Key name pattern for the fan metrics
+} metrics[METRIC_COUNT] = {
+    { "smc_fan_speed_rpm",       "Actual fan speed in RPM (F%dAc).",   "F%dAc" },
+    { "smc_fan_target_rpm",      "Target fan speed in RPM (F%dTg).",   "F%dTg" },
+    { "smc_fan_min_rpm",         "Minimum fan speed in RPM (F%dMn).",  "F%dMn" },
+    { "smc_fan_max_rpm",         "Maximum fan speed in RPM (F%dMx).",  "F%dMx" },
+    { "smc_temperature_celsius", "Temperature reported by SMC key.",   NULL },
+    { "smc_power_watts",         "Power reported by SMC key.",         NULL },
+    { "smc_value",               "Value of an SMC key given with -k.", NULL },
+};
+
+// A key to export
+typedef struct {
+    UInt32Char_t          key;
+    int                   metric;       // METRIC_...
+    int                   fan;          // Fan number for the fan metrics
+    const SMCDecoder_t   *decoder;
+} SMCExportKey_t;
+
+static volatile sig_atomic_t exportStopping = 0;
+
+static void exportStop(int sig)
+{
+    exportStopping = 1;
+}
+
+/*
+ * Add 'key' to the keys to export, if it can be read and has a numeric value
+ * Returns 1 if added.
+ */
+static int exportAdd(SMCExportKey_t *keys, int *countp, const char *key, int metric, int fan)
+{
+    SMCKeyData_keyInfo_t keyInfo;
+    const SMCDecoder_t  *decoder;
+    int                  i;
+
+    for (i = 0; i < *countp; i++)
+        if (strncmp(keys[i].key, key, 4) == 0)
+            return 0;   // Already exported
+    if (SMCGetKeyInfo(bytes2uint32((char *)key, 4), &keyInfo) != kIOReturnSuccess)
+        return 0;
+    decoder = SMCDecoderFor(keyInfo.dataType);
+    if (decoder == NULL || decoder->kind == SMC_DECODE_NONE || decoder->kind == SMC_DECODE_CHARS)
+        return 0;
+
+    strncpy(keys[*countp].key, key, 4);
+    keys[*countp].key[4] = '\0';
+    keys[*countp].metric = metric;
+    keys[*countp].fan = fan;
+    keys[*countp].decoder = decoder;
+    (*countp)++;
+    return 1;
+}
+
+/*
+ * Add 's' to the buffer as a label value, escaped as the exposition format wants
+ */
+static char *exportLabel(char *p, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' || *s == '"')
+            *p++ = '\\';
+        *p++ = *s;
+    }
+    return p;
+}
+
+/*
+ * Read all keys and write the exposition text to 'filename', through 'tmpname'
+ * - 'buffer' must hold at least count * EXPORT_LINE + EXPORT_EXTRA bytes
+ * Returns kIOReturnSuccess, or kIOReturnError if the file can not be written.
+ */
+static kern_return_t exportWrite(const char *filename, const char *tmpname,
+                                 SMCExportKey_t *keys, int count, char *buffer)
+{
+    SMCVal_t  val;
+    UInt64    start = SMCTimeNow();
+    char     *p = buffer;
+    int       i, fd, errors = 0, metric = -1;
+    ssize_t   n;
+
+    for (i = 0; i < count; i++)
+    {
+        if (SMCReadKey(keys[i].key, &val) != kIOReturnSuccess)
+        {
+            errors++;
+            continue;
+        }
+        if (keys[i].metric != metric)
+        {
+            metric = keys[i].metric;
+            p += sprintf(p, "# HELP %s %s\n# TYPE %s gauge\n",
+                         metrics[metric].name, metrics[metric].help, metrics[metric].name);
+        }
+        if (metrics[metric].fanKey != NULL)
+        {
+            p += sprintf(p, "%s{fan=\"%d\"} ", metrics[metric].name, keys[i].fan);
+        }
+        else
+        {
+            p += sprintf(p, "%s{key=\"", metrics[metric].name);
+            p = exportLabel(p, keys[i].key);
+            p += sprintf(p, "\"} ");
+        }
+        p += sprintf(p, "%.10g\n", SMCDecode(keys[i].decoder, val.bytes, val.dataSize));
+    }
+    p += sprintf(p, "# HELP smc_exporter_read_errors Keys that could not be read in the last interval.\n"
+                    "# TYPE smc_exporter_read_errors gauge\n"
+                    "smc_exporter_read_errors %d\n"
+                    "# HELP smc_exporter_duration_seconds Time taken to read the keys.\n"
+                    "# TYPE smc_exporter_duration_seconds gauge\n"
+                    "smc_exporter_duration_seconds %.6f\n",
+                 errors, (SMCTimeNow() - start) / 1e9);
+
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("Error: cannot create exporter file");
+        return kIOReturnError;
+    }
+    n = write(fd, buffer, p - buffer);
+    if (close(fd) != 0 || n != p - buffer || rename(tmpname, filename) != 0)
+    {
+        perror("Error: cannot write exporter file");
+        unlink(tmpname);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Export the fan, temperature and power keys, and the 'nextra' keys in 'extra',
+ * to 'filename' every 'interval' nanoseconds
+ * - 'count' is the number of times to write the file; 0 means until interrupted (SIGINT, SIGTERM)
+ * Returns kIOReturnSuccess, or an error code if the file can not be written.
+ */
+kern_return_t SMCExport(const char *filename, UInt32Char_t *extra, int nextra,
+                        UInt64 interval, unsigned long count)
+{
+    SMCExportKey_t  *keys;
+    SMCVal_t         val;
+    UInt32Char_t     key;
+    UInt32           totalKeys, keyValue;
+    int              totalFans = 0, nkeys = 0, metric, fan, i;
+    char            *tmpname, *buffer = NULL;
+    struct sigaction sa;
+    kern_return_t    result = kIOReturnSuccess;
+    UInt64           deadline;
+    unsigned long    written = 0;
+
+    if (SMCReadKey("FNum", &val) == kIOReturnSuccess)
+        totalFans = bytes2uint32(val.bytes, val.dataSize);
+    if (totalFans > MAXFANS)
+        totalFans = MAXFANS;    // The others have no key names
+    totalKeys = SMCReadIndexCount();
+
+    keys = calloc(4 * totalFans + totalKeys + nextra, sizeof(SMCExportKey_t));
+    tmpname = malloc(strlen(filename) + 5);
+    if (keys == NULL || tmpname == NULL)
+    {
+        free(keys);
+        free(tmpname);
+        return kIOReturnNoMemory;
+    }
+    sprintf(tmpname, "%s.tmp", filename);
+
+    // The fans, then the temperatures and power readings, then the extra keys
+    for (metric = METRIC_FAN_SPEED; metric <= METRIC_FAN_MAX; metric++)
+    {
+        for (fan = 0; fan < totalFans; fan++)
+        {
+            snprintf(key, sizeof(key), metrics[metric].fanKey, fan);
+            exportAdd(keys, &nkeys, key, metric, fan);
+        }
+    }
+    for (i = 0; i < totalKeys; i++)
+    {
+        if (SMCGetKeyAtIndex(i, &keyValue) != kIOReturnSuccess)
+            continue;
+        uint32tostr(key, keyValue);
+        if (key[0] == 'T')
+            exportAdd(keys, &nkeys, key, METRIC_TEMPERATURE, 0);
+        else if (key[0] == 'P')
+            exportAdd(keys, &nkeys, key, METRIC_POWER, 0);
+    }
+    for (i = 0; i < nextra; i++)
+    {
+        if (!exportAdd(keys, &nkeys, extra[i], METRIC_VALUE, 0))
+            fprintf(stderr, "Warning: key '%s' not exported; it does not exist, has no numeric value or is exported already\n", extra[i]);
+    }
+
+    // Group the keys by metric, keeping their order within a metric
+    for (i = 1; i < nkeys; i++)
+    {
+        SMCExportKey_t k = keys[i];
+        int            j;
+
+        for (j = i; j > 0 && keys[j - 1].metric > k.metric; j--)
+            keys[j] = keys[j - 1];
+        keys[j] = k;
+    }
+
+    buffer = malloc(nkeys * EXPORT_LINE + EXPORT_EXTRA);
+    if (buffer == NULL)
+    {
+        free(keys);
+        free(tmpname);
+        return kIOReturnNoMemory;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = exportStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    deadline = SMCTimeNow();
+    while (!exportStopping && (count == 0 || written < count))
+    {
+        SMCSleepUntil(deadline);
+        if (SMCTimeNow() < deadline)
+            continue;   // Woken up early by a signal
+
+        result = exportWrite(filename, tmpname, keys, nkeys, buffer);
+        if (result != kIOReturnSuccess)
+            break;
+        written++;
+
+        // Next deadline; skip the ones that have passed
+        deadline += interval;
+        while (deadline < SMCTimeNow())
+            deadline += interval;
+    }
+
+    free(keys);
+    free(tmpname);
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,410 @@
+/*
+ *  smcfan.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Fan control: keep the temperature at a set point by driving the fans (-C)
+ *
+ * Every interval the temperature keys (-k) are read, and the hottest one is fed to
+ * a PID controller. Its output, from 0 to 1, sets the target speed ("F%dTg") of every
+ * fan between its minimum ("F%dMn") and maximum ("F%dMx") speed.
+ * - The integral only grows while the output is not clamped (no wind-up), so the fans
+ *   react as soon as the temperature turns.
+ * - A fan's target is only written when it differs from the last value written by at
+ *   least the deadband (-b), or reaches the minimum or maximum speed. This keeps the
+ *   SMC writes down to a few while the temperature is steady.
+ * - The targets that change are written in one batch (see SMCWriteKeys()). A cycle in
+ *   which no temperature can be read is skipped; a write that fails is tried again in
+ *   the next cycle.
+ *
+ * At most MAXFANS fans are controlled, F0 to F9; further fans are left to the SMC.
+ *
+ * At the start the fans are put in forced mode (their bit in "FS! "). When done, also
+ * after SIGINT or SIGTERM, "FS! " is set back to the value it had, which gives the
+ * fans back to the automatic control of the SMC.
+ *
+ * Each cycle prints a line with the temperature, the output and the fan targets.
+ * When done, the number of cycles, writes, suppressed writes and failures, and the
+ * largest control latency (from reading the temperatures to the last write) are
+ * printed on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "smc.h"
+
+#define FAN_TRIES           5       // Attempts to set up, and to give the fans back to the SMC
+
+// A fan under control
+typedef struct {
+    UInt32Char_t          target;       // "F%dTg"
+    const SMCDecoder_t   *decoder;      // Of the target
+    UInt32                size;         // Of the target
+    double                min, max;     // Speed range
+    double                written;      // Last target written, or -1
+    double                speed;        // Target of this cycle
+    kern_return_t         result;       // Of writing it
+} SMCFan_t;
+
+static volatile sig_atomic_t fanStopping = 0;
+
+static void fanStop(int sig)
+{
+    fanStopping = 1;
+}
+
+/*
+ * The decoder of the type of 'valp', or NULL if it has no numeric value
+ */
+static const SMCDecoder_t *fanDecoder(SMCVal_t *valp)
+{
+    const SMCDecoder_t *decoder = SMCDecoderFor(bytes2uint32(valp->dataType, 4));
+
+    if (decoder == NULL || decoder->kind == SMC_DECODE_NONE || decoder->kind == SMC_DECODE_CHARS)
+        return NULL;
+    return decoder;
+}
+
+/*
+ * Read the numeric value of 'key' into '*valuep'
+ */
+static kern_return_t fanReadNumber(const char *key, double *valuep)
+{
+    const SMCDecoder_t *decoder;
+    SMCVal_t            val;
+    kern_return_t       result;
+
+    result = SMCReadKey((char *)key, &val);
+    if (result != kIOReturnSuccess)
+        return result;
+    decoder = fanDecoder(&val);
+    if (decoder == NULL)
+        return kIOReturnUnsupported;
+    *valuep = SMCDecode(decoder, val.bytes, val.dataSize);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Write 'value' to 'key', encoded with 'decoder' in 'size' bytes
+ */
+static kern_return_t fanWrite(const char *key, const SMCDecoder_t *decoder, UInt32 size, double value)
+{
+    SMCVal_t      val;
+    kern_return_t result;
+
+    memset(&val, 0, sizeof(val));
+    memcpy(val.key, key, 4);
+    val.dataSize = size;
+    result = SMCEncode(decoder, value, val.bytes, size);
+    if (result != kIOReturnSuccess)
+        return result;
+    return SMCWriteKey(val);
+}
+
+/*
+ * Set the forced mode bits in "FS! " to 'mode'
+ */
+static kern_return_t fanSetMode(UInt32 mode)
+{
+    static const SMCDecoder_t ui16 = { 0, SMC_DECODE_UNSIGNED, 2, 1.0 };
+
+    return fanWrite("FS! ", &ui16, 2, mode);
+}
+
+/*
+ * Find the fans, and the current value of "FS! "
+ * - '*fansp' is set to an array of '*totalFansp' fans, to be freed by the caller
+ */
+static kern_return_t fanSetup(SMCFan_t **fansp, int *totalFansp, UInt32 *modep)
+{
+    SMCKeyData_keyInfo_t keyInfo;
+    SMCFan_t            *fans;
+    UInt32Char_t         key;
+    kern_return_t        result;
+    double               value;
+    int                  i;
+
+    if ((result = fanReadNumber("FNum", &value)) != kIOReturnSuccess)
+        return result;
+    *totalFansp = (int)value;
+    if (*totalFansp <= 0)
+        return kIOReturnNotFound;
+    if (*totalFansp > MAXFANS)
+        *totalFansp = MAXFANS;      // The others have no key names
+    if ((result = fanReadNumber("FS! ", &value)) != kIOReturnSuccess)
+        return result;
+    *modep = (UInt32)value;
+
+    free(*fansp);
+    *fansp = fans = calloc(*totalFansp, sizeof(SMCFan_t));
+    if (fans == NULL)
+        return kIOReturnNoMemory;
+    for (i = 0; i < *totalFansp; i++)
+    {
+        snprintf(fans[i].target, sizeof(fans[i].target), "F%dTg", i);
+        result = SMCGetKeyInfo(bytes2uint32(fans[i].target, 4), &keyInfo);
+        if (result != kIOReturnSuccess)
+            return result;
+        fans[i].decoder = SMCDecoderFor(keyInfo.dataType);
+        fans[i].size = keyInfo.dataSize;
+        if (fans[i].decoder == NULL)
+            return kIOReturnUnsupported;
+        snprintf(key, sizeof(key), "F%dMn", i);
+        if ((result = fanReadNumber(key, &fans[i].min)) != kIOReturnSuccess)
+            return result;
+        snprintf(key, sizeof(key), "F%dMx", i);
+        if ((result = fanReadNumber(key, &fans[i].max)) != kIOReturnSuccess)
+            return result;
+        fans[i].written = -1;
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Keep the hottest of the 'count' temperature keys in 'keys' at 'setpoint' degrees
+ * - 'gains' are the proportional, integral and derivative gains, in output (0 to 1)
+ *   per degree, per degree second and per degree per second
+ * - 'deadband' is the smallest change in RPM of a fan target that is written
+ * - 'interval' is the time between cycles in nanoseconds
+ * - 'cycles' is the number of cycles to run; 0 means until interrupted (SIGINT, SIGTERM)
+ * - '*statsp', if not NULL, is set to the counts printed at the end
+ * Returns kIOReturnSuccess, or an error code if the fans or keys cannot be found.
+ */
+kern_return_t SMCFanControl(UInt32Char_t *keys, int count, double setpoint, const double gains[3],
+                            double deadband, UInt64 interval, unsigned long cycles, SMCFanStats_t *statsp)
+{
+    SMCFan_t            *fans = NULL;
+    SMCVal_t            *vals, *batch = NULL;
+    kern_return_t       *results, *batchResults = NULL;
+    UInt32               mode = 0;
+    struct sigaction     sa;
+    kern_return_t        result = kIOReturnError;
+    UInt64               start, deadline, now, latency, maxLatency = 0;
+    unsigned long        done = 0, writes = 0, suppressed = 0, readFailures = 0, writeFailures = 0;
+    double               temperature, error, lastError = 0, integral = 0, output, step, speed;
+    int                  totalFans = 0, i, j, first = 1, forced = 0, tries, nbatch, *batchFans = NULL;
+
+    if (statsp != NULL)
+        memset(statsp, 0, sizeof(SMCFanStats_t));
+    vals = calloc(count, sizeof(SMCVal_t));
+    results = calloc(count, sizeof(kern_return_t));
+    if (vals == NULL || results == NULL)
+    {
+        result = kIOReturnNoMemory;
+        goto out;
+    }
+
+    // Find the fans, and read the keys once, which checks them and takes the key info
+    // calls out of the loop. Tried more than once, as a call may fail now and then.
+    for (tries = 0; tries < FAN_TRIES; tries++)
+    {
+        result = fanSetup(&fans, &totalFans, &mode);
+        if (result == kIOReturnSuccess)
+            result = SMCReadKeys(keys, count, vals, results);
+        if (result == kIOReturnSuccess || result == kIOReturnBadArgument || result == kIOReturnNoMemory)
+            break;
+    }
+    if (result != kIOReturnSuccess)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (results[i] == kIOReturnBadArgument)
+                fprintf(stderr, "Error: key '%s' given more than once\n", keys[i]);
+            else if (results[i] != kIOReturnSuccess)
+                fprintf(stderr, "Error: SMCReadKey() = %08x for key '%s'\n", results[i], keys[i]);
+        }
+        goto out;
+    }
+    // A temperature has to be a number; a key of any other type would count as 0 degrees
+    for (i = 0; i < count; i++)
+    {
+        if (fanDecoder(&vals[i]) == NULL)
+        {
+            fprintf(stderr, "Error: key '%s' has no numeric value (type '%s')\n", keys[i], vals[i].dataType);
+            result = kIOReturnUnsupported;
+        }
+    }
+    if (result != kIOReturnSuccess)
+        goto out;
+
+    batch = calloc(totalFans, sizeof(SMCVal_t));
+    batchResults = calloc(totalFans, sizeof(kern_return_t));
+    batchFans = calloc(totalFans, sizeof(int));
+    if (batch == NULL || batchResults == NULL || batchFans == NULL)
+    {
+        result = kIOReturnNoMemory;
+        goto out;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fanStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    start = deadline = SMCTimeNow();
+    while (!fanStopping && (cycles == 0 || done < cycles))
+    {
+        SMCSleepUntil(deadline);
+        now = SMCTimeNow();
+        if (now < deadline)
+            continue;   // Woken up early by a signal
+        done++;
+
+        // Next deadline; skip the ones that have passed
+        deadline += interval;
+        while (deadline < now)
+            deadline += interval;
+
+        // Take over the fans; tried again every cycle until it works
+        if (!forced)
+        {
+            if (fanSetMode(mode | ((1u << totalFans) - 1)) != kIOReturnSuccess)
+            {
+                writeFailures++;
+                continue;
+            }
+            forced = 1;
+        }
+
+        // The hottest temperature that could be read
+        SMCReadKeys(keys, count, vals, results);
+        temperature = -1e9;
+        for (i = 0; i < count; i++)
+        {
+            // A key that changed to a type without a number since the setup is skipped, like a failed read
+            const SMCDecoder_t *decoder = results[i] == kIOReturnSuccess ? fanDecoder(&vals[i]) : NULL;
+
+            if (decoder != NULL)
+            {
+                double t = SMCDecode(decoder, vals[i].bytes, vals[i].dataSize);
+
+                if (t > temperature)
+                    temperature = t;
+            }
+        }
+        if (temperature == -1e9)
+        {
+            readFailures++;
+            continue;
+        }
+
+        // PID, on a positive error when it is too hot
+        error = temperature - setpoint;
+        step = error * interval / 1e9;
+        output = gains[0] * error + gains[1] * (integral + step) +
+                 (first ? 0 : gains[2] * (error - lastError) * 1e9 / interval);
+        if (output > 1)
+            output = 1;
+        else if (output < 0)
+            output = 0;
+        else
+            integral += step;
+        lastError = error;
+        first = 0;
+
+        // The targets that need writing, written in one batch
+        for (i = 0, nbatch = 0; i < totalFans; i++)
+        {
+            speed = fans[i].speed = fans[i].min + output * (fans[i].max - fans[i].min);
+            fans[i].result = kIOReturnSuccess;
+            if (fans[i].written >= 0 && (speed > fans[i].written ? speed - fans[i].written : fans[i].written - speed) < deadband &&
+                speed != fans[i].min && speed != fans[i].max)
+            {
+                suppressed++;
+                continue;
+            }
+            if (speed == fans[i].written)
+                continue;   // At the minimum or maximum already
+            memset(&batch[nbatch], 0, sizeof(SMCVal_t));
+            memcpy(batch[nbatch].key, fans[i].target, 4);
+            batch[nbatch].dataSize = fans[i].size;
+            if (SMCEncode(fans[i].decoder, speed, batch[nbatch].bytes, fans[i].size) == kIOReturnSuccess)
+                batchFans[nbatch++] = i;
+        }
+        if (nbatch > 0)
+        {
+            SMCWriteKeys(batch, nbatch, batchResults, NULL);
+            for (j = 0; j < nbatch; j++)
+            {
+                i = batchFans[j];
+                fans[i].result = batchResults[j];
+                if (batchResults[j] == kIOReturnSuccess)
+                {
+                    fans[i].written = fans[i].speed;
+                    writes++;
+                }
+                else if (batchResults[j] != kIOReturnAborted)
+                {
+                    writeFailures++;    // Not those left out after it
+                }
+            }
+        }
+        latency = SMCTimeNow() - now;
+        if (latency > maxLatency)
+            maxLatency = latency;
+
+        printf("%12.6f  %7.2f  %5.1f%%", (now - start) / 1e9, temperature, output * 100);
+        for (i = 0; i < totalFans; i++)
+            printf("  %s %.0f%s", fans[i].target, fans[i].speed, fans[i].result != kIOReturnSuccess ? "!" : "");
+        printf("\n");
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "%lu cycles: %lu writes, %lu suppressed by the deadband, %lu failed reads, %lu failed writes\n",
+            done, writes, suppressed, readFailures, writeFailures);
+    fprintf(stderr, "Largest control latency: %.3f ms\n", maxLatency / 1e6);
+    if (statsp != NULL)
+    {
+        statsp->cycles = done;
+        statsp->writes = writes;
+        statsp->suppressed = suppressed;
+        statsp->readFailures = readFailures;
+        statsp->writeFailures = writeFailures;
+        statsp->maxLatency = maxLatency;
+    }
+
+    // Give the fans back
+    if (forced)
+    {
+        for (tries = 0; tries < FAN_TRIES; tries++)
+        {
+            result = fanSetMode(mode);
+            if (result == kIOReturnSuccess)
+                break;
+        }
+        if (result != kIOReturnSuccess)
+            fprintf(stderr, "Error: cannot set \"FS! \" back to %04x; the fans are still forced\n", mode);
+    }
+
+out:
+    free(batch);
+    free(batchResults);
+    free(batchFans);
+    free(fans);
+    free(vals);
+    free(results);
+    return result;
+}
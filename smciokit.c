@@ -0,0 +1,141 @@
+/*
+ *  smciokit.c
+ *  Smc
+ */
+
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * The transport to the AppleSMC kernel extension, through IOKit (see SMCTransport_t)
+ *
+ * It is the default transport of smc on macOS, and of SMCHandleOpen() (libsmc.c).
+ * Elsewhere this file is empty.
+ */
+
+#include "smc.h"
+
+#ifdef __APPLE__
+/*
+ * Open a connection to the "AppleSMC" kernel extension
+ * - connection is returned through 'connp'
+ * - on error returns the error code; kIOReturnNoDevice if there is no SMC
+ * - on success returns kIOReturnSuccess
+ */
+static kern_return_t IOKitOpen(io_connect_t *connp)
+{
+    kern_return_t result;
+    mach_port_t   masterPort;
+    io_iterator_t iterator;
+    io_object_t   device;
+    
+    result = IOMasterPort(MACH_PORT_NULL, &masterPort);
+    
+    CFMutableDictionaryRef matchingDictionary = IOServiceMatching("AppleSMC");
+    result = IOServiceGetMatchingServices(masterPort, matchingDictionary, &iterator);
+    if (result != kIOReturnSuccess)
+        return result;
+    
+    device = IOIteratorNext(iterator);
+    IOObjectRelease(iterator);
+    if (device == 0)
+        return kIOReturnNoDevice;
+    
+    // Nothing is printed here, as libsmc.c uses this transport too
+    result = IOServiceOpen(device, mach_task_self(), 0, connp);
+    IOObjectRelease(device);
+    return result;
+}
+
+/*
+ * Close the connection given in 'conn'
+ */
+static kern_return_t IOKitClose(io_connect_t conn)
+{
+    return IOServiceClose(conn);
+}
+
+/*
+ * Exchange data with the kernel extension (SMC device in the AppleSMC extension)
+ * - 'conn' is the connection returned by IOKitOpen()
+ * - 'index' is passed to the kernel extension as the command to execute
+ * - 'inputStructure' contains data passed to the kernel extension
+ * - 'outputStructure' will contain data returned from the kernel extension
+ */
+static kern_return_t IOKitCall(io_connect_t conn, int index, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    kern_return_t	kernResult;
+    size_t  structureInputSize;
+    size_t  structureOutputSize;
+    
+    structureInputSize = sizeof(SMCKeyData_t);
+    structureOutputSize = sizeof(SMCKeyData_t);
+
+    // IOConnectMethodStructureIStructureO is depricated and no longer available
+    // See https://developer.apple.com/library/mac/samplecode/SimpleUserClient/Listings/SimpleUserClientInterface_c.html
+    // for an example of a replacement.
+    // This code is based on the SimpleUserClientInterface.c example mentioned above.
+    // It compiles differently for 32-bit and 64-bit targets
+    
+#if !defined(__LP64__)  // 32-bit mode?
+    // Check if Mac OS X 10.5 API is available...
+    if (IOConnectCallStructMethod != NULL) {
+        // ...and use it if it is.
+        kernResult =
+        IOConnectCallStructMethod(  conn,                   // an io_connect_t returned from IOServiceOpen().
+                                    index,                  // selector of the function to be called via the user client.
+                                    inputStructurep,         // pointer to the input struct parameter.
+                                    structureInputSize,     // the size of the input structure parameter.
+                                    outputStructurep,        // pointer to the output struct parameter.
+                                    &structureOutputSize	// pointer to the size of the output structure parameter.
+                                 );
+    }
+    else {
+        // Otherwise fall back to older API.
+        kernResult =
+        IOConnectMethodStructureIStructureO(    conn,					// an io_connect_t returned from IOServiceOpen().
+                                                index,                  // an index to the function to be called via the user client.
+                                                structureInputSize,     // the size of the input struct paramter.
+                                                &structureOutputSize,   // a pointer to the size of the output struct paramter.
+                                                inputStructurep,        // a pointer to the input struct parameter.
+                                                outputStructurep        // a pointer to the output struct parameter.
+                                           );
+    }
+#else // 64-bit mode
+    kernResult =
+    IOConnectCallStructMethod(  conn,                   // an io_connect_t returned from IOServiceOpen().
+                                index,                  // selector of the function to be called via the user client.
+                                inputStructurep,        // pointer to the input struct parameter.
+                                structureInputSize,     // the size of the input structure parameter.
+                                outputStructurep,       // pointer to the output struct parameter.
+                                &structureOutputSize	// pointer to the size of the output structure parameter.
+                                );
+#endif
+
+    return kernResult;
+}
+
+SMCTransport_t SMCIOKitTransport = {
+    "AppleSMC",
+    IOKitOpen,
+    IOKitClose,
+    IOKitCall
+};
+#endif /* __APPLE__ */
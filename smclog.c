@@ -0,0 +1,440 @@
+/*
+ *  smclog.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Binary log of sampled values (-W with -o, read back with -R)
+ *
+ * The log holds the raw bytes of the keys, instead of the text printed by -r or -W.
+ * A 'sp78' temperature then takes 2 bytes per sample instead of about 40.
+ *
+ * File layout (in the byte order of the machine that wrote it):
+ * - SMCLogHeader_t
+ * - 'keyCount' times SMCLogKey_t: the keys, their types and sizes, in sampling order
+ * - the records, one per sample:
+ *   - the time of the sample, as the change in the time between samples: the
+ *     difference in nanoseconds between this interval and the previous one, zigzag
+ *     encoded into a variable length integer (7 bits per byte, low bits first).
+ *     Samples taken exactly on schedule take a single byte.
+ *   - a bitmap of (keyCount + 7) / 8 bytes: bit i set if key i was read successfully
+ *   - with SMC_LOG_DUE in 'flags' (multi-rate sampling), a second such bitmap: bit i set
+ *     if key i was not due in this sample, and not read at all
+ *   - the bytes of each key that was read successfully, 'dataSize' of them
+ *   - a check byte: the sum of all bytes of the record so far
+ *
+ * The file is only ever appended to, with a whole number of records per write().
+ * A writer that crashes leaves at most one incomplete record at the end; readers
+ * stop at the first record that is incomplete or fails its check byte. So a log
+ * can be read while it is still being written.
+ * Readers memory map the file, and decode the values a block of records at a time:
+ * the 16 bit fixed point keys with SMCDecodeColumn(), the others with SMCFormatValue().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "smc.h"
+
+#define SMC_LOG_MAGIC       "SMCl"
+#define SMC_LOG_VERSION     2               // 1: no 'flags'; still read
+#define SMC_LOG_DUE         0x1             // Flag: records have the bitmap of keys not due
+#define SMC_LOG_BUFFER      65536           // Bytes collected before they are written
+#define SMC_LOG_SYNC        1000000000u     // Nanoseconds between fsync() calls
+#define SMC_LOG_BLOCK       256             // Records decoded together by readers
+
+typedef struct {
+    char                  magic[4];     // SMC_LOG_MAGIC
+    UInt32                version;      // SMC_LOG_VERSION
+    UInt32                keyCount;     // Number of SMCLogKey_t following the header
+    UInt32                flags;        // SMC_LOG_DUE; 0 in version 1
+    UInt64                startTime;    // Wall clock time of the first sample, microseconds since 1970
+    UInt64                interval;     // Sample interval in nanoseconds
+} SMCLogHeader_t;
+
+typedef struct {
+    UInt32                key;
+    UInt32                dataType;
+    UInt32                dataSize;
+} SMCLogKey_t;
+
+struct SMCLog {
+    int                   fd;
+    int                   count;        // Keys per record
+    int                   due;          // Records have the bitmap of keys not due
+    SMCLogKey_t          *keys;
+    UInt64                lastTime;     // Time of the previous record
+    UInt64                lastDelta;    // Interval before the previous record
+    UInt64                lastSync;
+    size_t                used;         // Bytes in 'buffer'
+    unsigned char         buffer[SMC_LOG_BUFFER];
+};
+
+/*
+ * Largest possible record for 'count' keys
+ */
+static size_t logRecordMax(int count, SMCLogKey_t *keys)
+{
+    size_t size = 10 + 2 * ((count + 7) / 8) + 1;  // Time, bitmaps, check byte
+    int    i;
+
+    for (i = 0; i < count; i++)
+        size += keys[i].dataSize;
+    return size;
+}
+
+/*
+ * Write the collected records to the file, and fsync() it if that is due
+ * Returns kIOReturnSuccess or kIOReturnError.
+ */
+static kern_return_t logFlush(SMCLog_t *log, UInt64 time)
+{
+    size_t  done = 0;
+    ssize_t n;
+
+    while (done < log->used) {
+        n = write(log->fd, log->buffer + done, log->used - done);
+        if (n <= 0) {
+            perror("Error: cannot write log");
+            return kIOReturnError;
+        }
+        done += n;
+    }
+    log->used = 0;
+    if (time - log->lastSync >= SMC_LOG_SYNC) {
+        fsync(log->fd);
+        log->lastSync = time;
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Create the log 'filename' for the 'count' keys in 'vals', sampled every 'interval' nanoseconds
+ * The key names, types and sizes are taken from 'vals'.
+ * - 'due' set: a sample may leave out keys that were not due (kIOReturnNotReady, multi-rate
+ *   sampling), and the log records which
+ * An existing file is replaced.
+ * Returns the log, or NULL after printing an error message.
+ */
+SMCLog_t *SMCLogCreate(const char *filename, SMCVal_t *vals, int count, UInt64 interval, int due)
+{
+    SMCLog_t       *log;
+    SMCLogHeader_t  header;
+    struct timeval  tv;
+    int             i;
+
+    log = calloc(1, sizeof(SMCLog_t));
+    if (log != NULL)
+        log->keys = calloc(count, sizeof(SMCLogKey_t));
+    if (log == NULL || log->keys == NULL) {
+        fprintf(stderr, "Error: no memory for log\n");
+        free(log);
+        return NULL;
+    }
+    log->count = count;
+    log->due = due;
+    for (i = 0; i < count; i++) {
+        log->keys[i].key = bytes2uint32(vals[i].key, 4);
+        log->keys[i].dataType = bytes2uint32(vals[i].dataType, 4);
+        log->keys[i].dataSize = vals[i].dataSize > BYTECOUNT ? BYTECOUNT : vals[i].dataSize;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SMC_LOG_MAGIC, 4);
+    header.version = SMC_LOG_VERSION;
+    header.keyCount = count;
+    header.flags = due ? SMC_LOG_DUE : 0;
+    gettimeofday(&tv, NULL);
+    header.startTime = (UInt64)tv.tv_sec * 1000000 + tv.tv_usec;
+    header.interval = interval;
+
+    log->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (log->fd < 0) {
+        perror("Error: cannot create log");
+        free(log->keys);
+        free(log);
+        return NULL;
+    }
+    memcpy(log->buffer, &header, sizeof(header));
+    memcpy(log->buffer + sizeof(header), log->keys, count * sizeof(SMCLogKey_t));
+    log->used = sizeof(header) + count * sizeof(SMCLogKey_t);
+    if (logFlush(log, SMC_LOG_SYNC) != kIOReturnSuccess) {     // Header goes to disk right away
+        close(log->fd);
+        free(log->keys);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+/*
+ * Add a record for one sample to the log
+ * - 'time' is the time of the sample in nanoseconds since the first one (see SMCWatch())
+ * - 'vals' and 'results' hold the values and the results of reading them; kIOReturnNotReady
+ *   for a key that was not due, if the log was created for that
+ * Records are collected in memory and written when the buffer is full; see SMCLogFlush().
+ * Returns kIOReturnSuccess or kIOReturnError.
+ */
+kern_return_t SMCLogAppend(SMCLog_t *log, UInt64 time, SMCVal_t *vals, kern_return_t *results)
+{
+    unsigned char *p, *record, check = 0;
+    UInt64         delta, zigzag;
+    int            i;
+
+    if (SMC_LOG_BUFFER - log->used < logRecordMax(log->count, log->keys) &&
+        logFlush(log, time) != kIOReturnSuccess)
+        return kIOReturnError;
+
+    record = p = log->buffer + log->used;
+
+    // Time: change of the interval, zigzag encoded so small negative changes stay small
+    delta = time - log->lastTime;
+    zigzag = (delta - log->lastDelta) << 1;
+    if ((SInt64)(delta - log->lastDelta) < 0)
+        zigzag = ~zigzag;
+    log->lastTime = time;
+    log->lastDelta = delta;
+    do {
+        *p = zigzag & 0x7f;
+        zigzag >>= 7;
+        if (zigzag != 0)
+            *p |= 0x80;
+        p++;
+    } while (zigzag != 0);
+
+    // Bitmap of the keys that were read, then their bytes
+    memset(p, 0, (log->count + 7) / 8);
+    for (i = 0; i < log->count; i++)
+        if (results[i] == kIOReturnSuccess)
+            p[i / 8] |= 1 << (i % 8);
+    p += (log->count + 7) / 8;
+    if (log->due) {
+        memset(p, 0, (log->count + 7) / 8);
+        for (i = 0; i < log->count; i++)
+            if (results[i] == kIOReturnNotReady)
+                p[i / 8] |= 1 << (i % 8);
+        p += (log->count + 7) / 8;
+    }
+    for (i = 0; i < log->count; i++) {
+        if (results[i] == kIOReturnSuccess) {
+            memcpy(p, vals[i].bytes, log->keys[i].dataSize);
+            p += log->keys[i].dataSize;
+        }
+    }
+
+    while (record < p)
+        check += *record++;
+    *p++ = check;
+    log->used = p - log->buffer;
+    return kIOReturnSuccess;
+}
+
+/*
+ * Write all records added so far to the file
+ */
+kern_return_t SMCLogFlush(SMCLog_t *log)
+{
+    return logFlush(log, log->lastTime);
+}
+
+/*
+ * Write the remaining records, and close the log
+ */
+kern_return_t SMCLogClose(SMCLog_t *log)
+{
+    kern_return_t result;
+
+    result = logFlush(log, log->lastSync + SMC_LOG_SYNC);
+    close(log->fd);
+    free(log->keys);
+    free(log);
+    return result;
+}
+
+/*
+ * Print the 'rows' samples collected by SMCLogPrint(): key i of sample r is in vals[r * count + i]
+ * The keys with a decoder in 'decoders' (16 bit fixed point, most of what is logged) are
+ * decoded a column at a time with SMCDecodeColumn(), into 'numbers'.
+ */
+static void logPrintBlock(int count, int rows, UInt64 *times, SMCVal_t *vals, kern_return_t *results,
+                          const SMCDecoder_t **decoders, float *numbers)
+{
+    char  column[2 * SMC_LOG_BLOCK];
+    float decoded[SMC_LOG_BLOCK];
+    int   i, r;
+
+    for (i = 0; i < count; i++) {
+        if (decoders[i] != NULL) {
+            for (r = 0; r < rows; r++)
+                memcpy(column + 2 * r, vals[r * count + i].bytes, 2);
+            SMCDecodeColumn(decoders[i], column, rows, decoded, SMC_COLUMN_BEST);
+        }
+        for (r = 0; r < rows; r++)
+            numbers[r * count + i] = (decoders[i] != NULL && results[r * count + i] == kIOReturnSuccess) ? decoded[r] : NAN;
+    }
+    for (r = 0; r < rows; r++)
+        SMCPrintSample(times[r], &vals[r * count], &results[r * count], count, NULL, &numbers[r * count]);
+}
+
+/*
+ * Print the samples in the log 'filename', in the same form as SMCWatch()
+ * Records still being written by another process are left out.
+ * The records are decoded SMC_LOG_BLOCK at a time (see logPrintBlock()).
+ * Returns kIOReturnSuccess, or an error code if the file is not a log.
+ */
+kern_return_t SMCLogPrint(const char *filename)
+{
+    const unsigned char  *map, *p, *end, *record;
+    const SMCLogHeader_t *header;
+    const SMCLogKey_t    *keys;
+    const SMCDecoder_t   *decoders[MAXKEYS];
+    SMCVal_t             *vals, *row;
+    kern_return_t        *results;
+    float                *numbers;
+    UInt64                times[SMC_LOG_BLOCK];
+    struct stat           st;
+    UInt64                time = 0, delta = 0, zigzag;
+    unsigned long         records = 0;
+    unsigned char         check;
+    int                   fd, i, r, shift, count, due, rows = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error: cannot open log");
+        return kIOReturnNotFound;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(SMCLogHeader_t)) {
+        fprintf(stderr, "Error: '%s' is not an smc log\n", filename);
+        close(fd);
+        return kIOReturnBadArgument;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error: cannot map log");
+        return kIOReturnError;
+    }
+    end = map + st.st_size;
+
+    header = (const SMCLogHeader_t *)map;
+    count = header->keyCount;
+    keys = (const SMCLogKey_t *)(header + 1);
+    if (memcmp(header->magic, SMC_LOG_MAGIC, 4) != 0 || header->version < 1 || header->version > SMC_LOG_VERSION ||
+        (header->version >= 2 && (header->flags & ~SMC_LOG_DUE) != 0) || count < 1 || count > MAXKEYS ||
+        (const unsigned char *)(keys + count) > end) {
+        fprintf(stderr, "Error: '%s' is not an smc log\n", filename);
+        munmap((void *)map, st.st_size);
+        return kIOReturnBadArgument;
+    }
+    vals = calloc(SMC_LOG_BLOCK * count, sizeof(SMCVal_t));
+    results = calloc(SMC_LOG_BLOCK * count, sizeof(kern_return_t));
+    numbers = calloc(SMC_LOG_BLOCK * count, sizeof(float));
+    if (vals == NULL || results == NULL || numbers == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(vals);
+        free(results);
+        free(numbers);
+        munmap((void *)map, st.st_size);
+        return kIOReturnNoMemory;
+    }
+    for (i = 0; i < count; i++) {
+        for (r = 0; r < SMC_LOG_BLOCK; r++) {
+            row = &vals[r * count];
+            uint32tostr(row[i].key, keys[i].key);
+            uint32tostr(row[i].dataType, keys[i].dataType);
+            row[i].dataSize = keys[i].dataSize > BYTECOUNT ? BYTECOUNT : keys[i].dataSize;
+        }
+        decoders[i] = SMCDecoderFor(keys[i].dataType);
+        if (decoders[i] != NULL && (decoders[i]->size != 2 || keys[i].dataSize != 2 ||
+            (decoders[i]->kind != SMC_DECODE_FIXED && decoders[i]->kind != SMC_DECODE_SIGNED_FIXED)))
+            decoders[i] = NULL;
+    }
+
+    due = header->version >= 2 && (header->flags & SMC_LOG_DUE) != 0;
+
+    p = (const unsigned char *)(keys + count);
+    while (p < end) {
+        record = p;
+        row = &vals[rows * count];
+
+        // Time
+        zigzag = 0;
+        for (shift = 0; p < end && shift < 64; shift += 7) {
+            zigzag |= (UInt64)(*p & 0x7f) << shift;
+            if ((*p++ & 0x80) == 0)
+                break;
+        }
+
+        // Bitmaps and values; keys not due are left out when printed, as SMCWatch() does
+        if (end - p < (due ? 2 : 1) * ((count + 7) / 8))
+            break;
+        for (i = 0; i < count; i++)
+            results[rows * count + i] = (p[i / 8] & (1 << (i % 8))) ? kIOReturnSuccess : kIOReturnError;
+        p += (count + 7) / 8;
+        if (due) {
+            for (i = 0; i < count; i++)
+                if (p[i / 8] & (1 << (i % 8)))
+                    results[rows * count + i] = kIOReturnNotReady;
+            p += (count + 7) / 8;
+        }
+        for (i = 0; i < count; i++) {
+            if (results[rows * count + i] == kIOReturnSuccess) {
+                if (end - p < row[i].dataSize)
+                    break;
+                memcpy(row[i].bytes, p, row[i].dataSize);
+                p += row[i].dataSize;
+            }
+        }
+        if (i < count || p >= end)
+            break;      // Incomplete; possibly still being written
+
+        for (check = 0; record < p; record++)
+            check += *record;
+        if (check != *p++) {
+            fprintf(stderr, "Warning: damaged record after %lu records; rest of the log ignored\n", records);
+            break;
+        }
+
+        delta += (zigzag & 1) ? ~(zigzag >> 1) : (zigzag >> 1);
+        time += delta;
+        times[rows++] = time;
+        records++;
+        if (rows == SMC_LOG_BLOCK) {
+            logPrintBlock(count, rows, times, vals, results, decoders, numbers);
+            rows = 0;
+        }
+    }
+    logPrintBlock(count, rows, times, vals, results, decoders, numbers);
+
+    free(vals);
+    free(results);
+    free(numbers);
+    munmap((void *)map, st.st_size);
+    return kIOReturnSuccess;
+}
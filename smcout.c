@@ -0,0 +1,318 @@
+/*
+ *  smcout.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Output of values for -l, -r and -f
+ *
+ * Everything is formatted into one static buffer, which is written to stdout
+ * when it is (nearly) full and by SMCOutEnd(). So a full listing takes a few
+ * write() calls instead of a stdio call per byte.
+ *
+ * Formats:
+ * - SMC_OUT_TEXT    the classic output:  "  TC0H  [sp78]  42.25 (bytes 2a 40)"
+ * - SMC_OUT_JSON    one array holding an object per value (--json)
+ * - SMC_OUT_NDJSON  one object per line (--ndjson)
+ * - SMC_OUT_CSV     a header line, then one line per value (--csv)
+ * -l --names and --types print the keys without values, through SMCOutKey().
+ * The objects and lines of the machine readable formats all carry the key, the
+ * type, the decoded value (a number, a string, or empty/null if the type has no
+ * decoded form or the key could not be read), the bytes in hexadecimal, and the
+ * error code of reading the key (0 if it was read).
+ *
+ * The output functions are only to be called from one thread.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smc.h"
+
+#define SMC_OUT_BUFFER      65536
+#define SMC_OUT_RECORD      512     // More than the longest record of any format
+
+static int      outFormat = SMC_OUT_TEXT;
+static int      outRecords = 0;     // Records since SMCOutBegin()
+static size_t   outUsed = 0;
+static char     outBuffer[SMC_OUT_BUFFER];
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/*
+ * Select the output format (SMC_OUT_...)
+ */
+void SMCOutSetFormat(int format)
+{
+    outFormat = format;
+}
+
+int SMCOutFormat(void)
+{
+    return outFormat;
+}
+
+/*
+ * Write the buffered output to stdout
+ * Anything printed with stdio before goes first.
+ */
+void SMCOutFlush(void)
+{
+    size_t  done = 0;
+    ssize_t n;
+
+    fflush(stdout);
+    while (done < outUsed) {
+        n = write(STDOUT_FILENO, outBuffer + done, outUsed - done);
+        if (n <= 0)
+            break;      // Nothing sensible to do; stdout is gone
+        done += n;
+    }
+    outUsed = 0;
+}
+
+/*
+ * Make sure there is room for one record in the buffer
+ */
+static void outReserve(void)
+{
+    if (SMC_OUT_BUFFER - outUsed < SMC_OUT_RECORD)
+        SMCOutFlush();
+}
+
+static void outChar(char c)
+{
+    outBuffer[outUsed++] = c;
+}
+
+static void outString(const char *s)
+{
+    while (*s != '\0')
+        outBuffer[outUsed++] = *s++;
+}
+
+/*
+ * Add 'len' characters of 's' as a JSON string, or as a CSV field (csv != 0)
+ * A CSV field is only quoted if it has to be.
+ */
+static void outQuoted(const char *s, size_t len, int csv)
+{
+    size_t i;
+
+    if (csv) {
+        if (strcspn(s, ",\"\r\n") >= len) {
+            for (i = 0; i < len; i++)
+                outChar(s[i]);
+            return;
+        }
+        outChar('"');
+        for (i = 0; i < len; i++) {
+            if (s[i] == '"')
+                outChar('"');
+            outChar(s[i]);
+        }
+        outChar('"');
+        return;
+    }
+
+    outChar('"');
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            outChar('\\');
+            outChar(c);
+        } else if (c < ' ' || c >= 0x7f) {
+            outString("\\u00");
+            outChar(hexDigits[c >> 4]);
+            outChar(hexDigits[c & 0xf]);
+        } else {
+            outChar(c);
+        }
+    }
+    outChar('"');
+}
+
+/*
+ * Add formatted text to the output, like printf()
+ * Used for the lines of the text format that are not values (like those of -f).
+ */
+void SMCOutPrintf(const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    outReserve();
+    va_start(ap, format);
+    n = vsnprintf(outBuffer + outUsed, SMC_OUT_BUFFER - outUsed, format, ap);
+    va_end(ap);
+    if (n > 0)
+        outUsed += (n < SMC_OUT_BUFFER - outUsed) ? n : SMC_OUT_BUFFER - outUsed - 1;
+}
+
+/*
+ * Start a list of values
+ */
+void SMCOutBegin(void)
+{
+    outRecords = 0;
+    outReserve();
+    if (outFormat == SMC_OUT_JSON)
+        outString("[");
+    else if (outFormat == SMC_OUT_CSV)
+        outString("key,type,value,bytes,error\n");
+}
+
+/*
+ * Output one value
+ * - 'result' is the result of reading it. In the text format values that could
+ *   not be read are left to the caller, which knows best how to report them.
+ */
+void SMCOutValue(const SMCVal_t *valp, kern_return_t result)
+{
+    const SMCDecoder_t *decoder;
+    char                text[BYTECOUNT + 3];
+    int                 len = 0, i, csv = (outFormat == SMC_OUT_CSV);
+    UInt32              size = valp->dataSize > BYTECOUNT ? BYTECOUNT : valp->dataSize;
+
+    outReserve();
+    if (outFormat == SMC_OUT_TEXT) {
+        // - two spaces
+        // - 4 characters for the name of the key
+        // - 4 characters of the datatype of the key (in square braces).
+        // - two spaces
+        outString("  ");
+        outString(valp->key);
+        outString("  [");
+        outString(valp->dataType);
+        outString("]  ");
+        if (size == 0) {
+            outString("no data\n");
+            return;
+        }
+        // The decoded value, if the data type has one (see smctypes.c), then the bytes
+        len = SMCFormatValue(valp, text, sizeof(text));
+        if (len > 0) {
+            outString(text);
+            outChar(' ');
+        }
+        outString("(bytes");
+        for (i = 0; i < size; i++) {
+            outChar(' ');
+            outChar(hexDigits[(valp->bytes[i] >> 4) & 0xf]);
+            outChar(hexDigits[valp->bytes[i] & 0xf]);
+        }
+        outString(")\n");
+        return;
+    }
+
+    // The decoded value, as a number if it is one. Full precision for the machine formats.
+    if (result == kIOReturnSuccess && size > 0) {
+        decoder = SMCDecoderFor(bytes2uint32((char *)valp->dataType, 4));
+        if (decoder != NULL && decoder->kind == SMC_DECODE_CHARS) {
+            len = SMCFormatValue(valp, text, sizeof(text));
+        } else if ((decoder != NULL && decoder->kind != SMC_DECODE_NONE) ||
+                   (decoder == NULL && SMCFormatValue(valp, text, sizeof(text)) > 0)) {
+            len = snprintf(text, sizeof(text), "%.17g",
+                           decoder != NULL ? SMCDecode(decoder, valp->bytes, size) : val2float(valp));
+        }
+    }
+
+    if (outFormat == SMC_OUT_JSON && outRecords > 0)
+        outChar(',');
+    if (outFormat != SMC_OUT_CSV)
+        outString(outFormat == SMC_OUT_JSON ? "\n{\"key\":" : "{\"key\":");
+    outQuoted(valp->key, strlen(valp->key), csv);
+    outString(csv ? "," : ",\"type\":");
+    outQuoted(valp->dataType, strlen(valp->dataType), csv);
+    outString(csv ? "," : ",\"value\":");
+    if (len > 0 && text[0] == '"')
+        outQuoted(text + 1, len - 2, csv);      // Characters; without the quotes of SMCFormatValue()
+    else if (len > 0)
+        outString(text);
+    else if (!csv)
+        outString("null");
+    outString(csv ? "," : ",\"bytes\":\"");
+    for (i = 0; result == kIOReturnSuccess && i < size; i++) {
+        outChar(hexDigits[(valp->bytes[i] >> 4) & 0xf]);
+        outChar(hexDigits[valp->bytes[i] & 0xf]);
+    }
+    if (!csv)
+        outChar('"');
+    snprintf(text, sizeof(text), csv ? ",%u\n" : ",\"error\":%u}", (unsigned int)result);
+    outString(text);
+    if (outFormat == SMC_OUT_NDJSON)
+        outChar('\n');
+    outRecords++;
+}
+
+/*
+ * Output the name of a key, and its type and size if 'withType' (-l --names, --types)
+ * - 'result' is the result of reading the type
+ * The machine readable formats have the fields of SMCOutValue(), without a value or bytes.
+ */
+void SMCOutKey(const SMCVal_t *valp, kern_return_t result, int withType)
+{
+    char text[64];
+    int  csv = (outFormat == SMC_OUT_CSV);
+
+    outReserve();
+    if (outFormat == SMC_OUT_TEXT) {
+        outString("  ");
+        outString(valp->key);
+        if (withType && result == kIOReturnSuccess) {
+            snprintf(text, sizeof(text), "  [%-4s]  %u byte%s", valp->dataType,
+                     (unsigned int)valp->dataSize, valp->dataSize == 1 ? "" : "s");
+            outString(text);
+        } else if (withType) {
+            outString("  [    ]  no key info");
+        }
+        outChar('\n');
+        return;
+    }
+
+    if (outFormat == SMC_OUT_JSON && outRecords > 0)
+        outChar(',');
+    if (outFormat != SMC_OUT_CSV)
+        outString(outFormat == SMC_OUT_JSON ? "\n{\"key\":" : "{\"key\":");
+    outQuoted(valp->key, strlen(valp->key), csv);
+    outString(csv ? "," : ",\"type\":");
+    outQuoted(valp->dataType, strlen(valp->dataType), csv);
+    snprintf(text, sizeof(text), csv ? ",,,%u\n" : ",\"value\":null,\"bytes\":\"\",\"error\":%u}",
+             (unsigned int)result);
+    outString(text);
+    if (outFormat == SMC_OUT_NDJSON)
+        outChar('\n');
+    outRecords++;
+}
+
+/*
+ * End the list of values, and write all output
+ */
+void SMCOutEnd(void)
+{
+    outReserve();
+    if (outFormat == SMC_OUT_JSON)
+        outString(outRecords > 0 ? "\n]\n" : "]\n");
+    SMCOutFlush();
+}
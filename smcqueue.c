@@ -0,0 +1,295 @@
+/*
+ *  smcqueue.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Asynchronous SMC requests for other programs (libsmc.h)
+ *
+ * SMCHandleRead() blocks for the whole exchange with the SMC. A queue instead takes
+ * requests to read or write a key, and hands back their completions later, so a program
+ * can do other work, or keep several requests in flight:
+ *
+ *     SMCQueue_t   *queue;
+ *     SMCRequest_t  request = { SMC_REQUEST_READ, "TC0P" }, done[16];
+ *
+ *     SMCQueueCreate(NULL, 4, 64, &queue);
+ *     request.userData = ...;
+ *     SMCQueueSubmit(queue, &request, 1);
+ *     ...
+ *     n = SMCQueueReap(queue, done, 16, 0);   // done[0 .. n-1]: results, values and userData
+ *     ...
+ *     SMCQueueDestroy(queue);
+ *
+ * - The requests are carried out by worker threads, each with a handle (a connection)
+ *   of its own, in the order submitted. As they run in parallel, completions can come
+ *   back in another order; 'userData' tells them apart.
+ * - A queue holds at most 'depth' requests that were submitted and not yet reaped, in
+ *   two rings of that size, so submitting and reaping allocate no memory.
+ *   SMCQueueSubmit() takes as many requests as fit.
+ * - SMCQueueReap() can wait for a completion, or return at once. Instead of waiting
+ *   there, a program can poll the descriptor of SMCQueueFd() with its other
+ *   descriptors: it is readable while there are completions to reap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "libsmc.h"
+
+#define QUEUE_MAXWORKERS  16      // Like -j
+
+struct SMCQueue {
+    pthread_mutex_t       lock;
+    pthread_cond_t        submitted;    // Signalled when a request is added
+    pthread_cond_t        completed;    // Signalled when a request completes
+    int                   depth;
+    int                   outstanding;  // Submitted and not yet reaped
+    SMCRequest_t         *requests;     // Ring of requests to carry out
+    int                   requestFirst, requestCount;
+    SMCRequest_t         *completions;  // Ring of completed requests
+    int                   completionFirst, completionCount;
+    int                   stop;         // Set by SMCQueueDestroy()
+    int                   fds[2];       // Pipe; a byte in it while completions are waiting
+    int                   workers;
+    int                   started;      // Workers that took their handle
+    SMCHandle_t          *handles[QUEUE_MAXWORKERS];
+    pthread_t             threads[QUEUE_MAXWORKERS];
+};
+
+/*
+ * Put the byte that says there are completions in the pipe ('set'), or take it out
+ * The pipe never holds more than that byte, so neither blocks; only a signal can
+ * interrupt them, and then they are tried again.
+ */
+static void queueMark(SMCQueue_t *queue, int set)
+{
+    char    byte = 0;
+    ssize_t n;
+
+    do
+        n = set ? write(queue->fds[1], &byte, 1) : read(queue->fds[0], &byte, 1);
+    while (n < 0 && errno == EINTR);
+}
+
+/*
+ * A worker: carry out requests on its own handle until the queue is destroyed
+ * Requests still waiting then are carried out first.
+ */
+static void *queueWorker(void *arg)
+{
+    SMCQueue_t   *queue = arg;
+    SMCHandle_t  *handle;
+    SMCRequest_t  request;
+
+    pthread_mutex_lock(&queue->lock);
+    handle = queue->handles[queue->started++];
+    for (;;)
+    {
+        while (queue->requestCount == 0 && !queue->stop)
+            pthread_cond_wait(&queue->submitted, &queue->lock);
+        if (queue->requestCount == 0)
+            break;
+        request = queue->requests[queue->requestFirst];
+        queue->requestFirst = (queue->requestFirst + 1) % queue->depth;
+        queue->requestCount--;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (request.type == SMC_REQUEST_WRITE)
+            request.result = SMCHandleWrite(handle, &request.val);
+        else
+            request.result = SMCHandleRead(handle, request.val.key, &request.val);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->completions[(queue->completionFirst + queue->completionCount) % queue->depth] = request;
+        if (queue->completionCount++ == 0)
+            queueMark(queue, 1);
+        pthread_cond_broadcast(&queue->completed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/*
+ * Create a queue in '*queuep' with 'workers' threads, each with a connection through 'transport'
+ * (or the AppleSMC if NULL, see SMCHandleOpen()), for at most 'depth' requests at a time
+ * Returns kIOReturnBadArgument if 'workers' or 'depth' is out of range, or the error of
+ * allocating or opening the connections; then '*queuep' is NULL.
+ */
+kern_return_t SMCQueueCreate(const SMCTransport_t *transport, int workers, int depth, SMCQueue_t **queuep)
+{
+    SMCQueue_t    *queue;
+    kern_return_t  result = kIOReturnSuccess;
+    int            i;
+
+    *queuep = NULL;
+    if (workers < 1 || workers > QUEUE_MAXWORKERS || depth < 1)
+        return kIOReturnBadArgument;
+    queue = calloc(1, sizeof(SMCQueue_t));
+    if (queue == NULL)
+        return kIOReturnNoMemory;
+    queue->depth = depth;
+    queue->requests = calloc(depth, sizeof(SMCRequest_t));
+    queue->completions = calloc(depth, sizeof(SMCRequest_t));
+    queue->fds[0] = queue->fds[1] = -1;
+    if (queue->requests == NULL || queue->completions == NULL)
+        result = kIOReturnNoMemory;
+    else if (pipe(queue->fds) != 0)
+        result = kIOReturnError;
+    for (i = 0; i < workers && result == kIOReturnSuccess; i++)
+        result = SMCHandleOpen(transport, &queue->handles[i]);
+    if (result != kIOReturnSuccess)
+    {
+        for (i = 0; i < workers; i++)
+            SMCHandleClose(queue->handles[i]);
+        if (queue->fds[0] >= 0)
+        {
+            close(queue->fds[0]);
+            close(queue->fds[1]);
+        }
+        free(queue->requests);
+        free(queue->completions);
+        free(queue);
+        return result;
+    }
+    fcntl(queue->fds[0], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->submitted, NULL);
+    pthread_cond_init(&queue->completed, NULL);
+
+    // The workers take the handles in turn; those of workers that could not be started are closed
+    pthread_mutex_lock(&queue->lock);
+    for (queue->workers = 0; queue->workers < workers; queue->workers++)
+    {
+        if (pthread_create(&queue->threads[queue->workers], NULL, queueWorker, queue) != 0)
+            break;
+    }
+    for (i = queue->workers; i < workers; i++)
+        SMCHandleClose(queue->handles[i]);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (queue->workers == 0)
+    {
+        SMCQueueDestroy(queue);
+        return kIOReturnNoMemory;
+    }
+    *queuep = queue;
+    return kIOReturnSuccess;
+}
+
+/*
+ * Carry out the requests still submitted, then stop the workers, close their
+ * connections and free 'queue'
+ * Completions not reaped are dropped. NULL is ignored.
+ */
+void SMCQueueDestroy(SMCQueue_t *queue)
+{
+    int i;
+
+    if (queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->lock);
+    queue->stop = 1;
+    pthread_cond_broadcast(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+    for (i = 0; i < queue->workers; i++)
+    {
+        pthread_join(queue->threads[i], NULL);
+        SMCHandleClose(queue->handles[i]);
+    }
+    pthread_cond_destroy(&queue->submitted);
+    pthread_cond_destroy(&queue->completed);
+    pthread_mutex_destroy(&queue->lock);
+    close(queue->fds[0]);
+    close(queue->fds[1]);
+    free(queue->requests);
+    free(queue->completions);
+    free(queue);
+}
+
+/*
+ * Submit the 'count' requests in 'requests'
+ * - 'type' is SMC_REQUEST_READ to read 'val.key', or SMC_REQUEST_WRITE to write the
+ *   'val.dataSize' bytes in 'val.bytes' to it (see SMCHandleWrite())
+ * - 'userData' is handed back with the completion
+ * Returns the number of requests taken, from the first; fewer than 'count' if the queue
+ * holds 'depth' requests that were not reaped.
+ */
+int SMCQueueSubmit(SMCQueue_t *queue, const SMCRequest_t *requests, int count)
+{
+    int n;
+
+    pthread_mutex_lock(&queue->lock);
+    for (n = 0; n < count && queue->outstanding < queue->depth; n++)
+    {
+        queue->requests[(queue->requestFirst + queue->requestCount) % queue->depth] = requests[n];
+        queue->requestCount++;
+        queue->outstanding++;
+    }
+    if (n == 1)
+        pthread_cond_signal(&queue->submitted);
+    else if (n > 1)
+        pthread_cond_broadcast(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+    return n;
+}
+
+/*
+ * Take up to 'max' completed requests into 'completions'
+ * A completion is the request, with 'result' holding the result of carrying it out
+ * (see SMCHandleRead() and SMCHandleWrite()) and, for a read, 'val' the value read.
+ * - 'wait' set: wait until there is at least one, unless no request is outstanding
+ * Returns the number of completions taken.
+ */
+int SMCQueueReap(SMCQueue_t *queue, SMCRequest_t *completions, int max, int wait)
+{
+    int n;
+
+    pthread_mutex_lock(&queue->lock);
+    while (wait && queue->completionCount == 0 && queue->outstanding > 0)
+        pthread_cond_wait(&queue->completed, &queue->lock);
+    for (n = 0; n < max && queue->completionCount > 0; n++)
+    {
+        completions[n] = queue->completions[queue->completionFirst];
+        queue->completionFirst = (queue->completionFirst + 1) % queue->depth;
+        queue->completionCount--;
+        queue->outstanding--;
+    }
+    if (n > 0 && queue->completionCount == 0)
+        queueMark(queue, 0);
+    pthread_mutex_unlock(&queue->lock);
+    return n;
+}
+
+/*
+ * A descriptor that is readable while there are completions to reap, to poll() or
+ * select() on. It must only be polled; SMCQueueReap() reads it.
+ */
+int SMCQueueFd(SMCQueue_t *queue)
+{
+    return queue->fds[0];
+}
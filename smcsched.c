@@ -0,0 +1,267 @@
+/*
+ *  smcsched.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Multi-rate scheduler for watch mode (-W with -k <key>@<ms>)
+ *
+ * Every key has its own period, or is read only once, and a priority.
+ * Reading n of key k is due at start + n * period, however late earlier reads were.
+ * The keys are kept in a binary heap ordered by the time their next read is due,
+ * so finding the next wake-up time is O(1) and taking a key out is O(log keys).
+ * All keys due at a wake-up are read together, as one sample.
+ *
+ * A budget (-B) limits the number of SMC calls per second. It is a token bucket:
+ * tokens come in at the budget rate, and the bucket holds at most a tenth of a second
+ * worth of them (and at least one). Every key read takes a token. When there are more
+ * keys due than tokens, the keys with the highest priority (the lowest number) are
+ * read, and the others stay due: they are read when there are tokens again, if no key
+ * with a higher priority wants them. So an overloaded schedule first slows down the
+ * low priority keys. A key that falls more than a period behind skips the reads it
+ * missed.
+ *
+ * For every key the scheduler keeps the number of reads, deferrals (due but left for
+ * lack of tokens) and skipped reads, and the lag: how long after it was due a read
+ * was taken.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smc.h"
+
+// The state of one key
+typedef struct {
+    UInt64                period;       // 0: read once
+    int                   priority;     // Lower is more important
+    UInt64                due;          // Time the next read is due
+    unsigned long         reads;
+    unsigned long         deferred;
+    unsigned long         skipped;
+    UInt64                lagSum;
+    UInt64                lagMax;
+} SMCSchedKey_t;
+
+struct SMCSched {
+    int                   count;
+    SMCSchedKey_t        *keys;
+    int                  *heap;         // Key indexes, ordered by 'due'
+    int                   heapCount;
+    int                  *taken;        // Room for the keys due at one wake-up
+    double                budget;       // Calls per second; 0 for no limit
+    double                tokens;
+    double                maxTokens;
+    UInt64                refilled;     // Time the tokens were last topped up
+    UInt64                start;
+};
+
+/*
+ * Heap order: earlier due time first; for equal times the higher priority
+ */
+static int schedBefore(SMCSched_t *s, int a, int b)
+{
+    if (s->keys[a].due != s->keys[b].due)
+        return s->keys[a].due < s->keys[b].due;
+    return s->keys[a].priority < s->keys[b].priority;
+}
+
+static void schedPush(SMCSched_t *s, int key)
+{
+    int i = s->heapCount++, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!schedBefore(s, key, s->heap[parent]))
+            break;
+        s->heap[i] = s->heap[parent];
+        i = parent;
+    }
+    s->heap[i] = key;
+}
+
+static int schedPop(SMCSched_t *s)
+{
+    int top = s->heap[0], key = s->heap[--s->heapCount], i = 0, child;
+
+    while ((child = 2 * i + 1) < s->heapCount) {
+        if (child + 1 < s->heapCount && schedBefore(s, s->heap[child + 1], s->heap[child]))
+            child++;
+        if (!schedBefore(s, s->heap[child], key))
+            break;
+        s->heap[i] = s->heap[child];
+        i = child;
+    }
+    s->heap[i] = key;
+    return top;
+}
+
+/*
+ * Create a scheduler for 'count' keys, with the periods (in nanoseconds; 0 to read
+ * once) and priorities in 'schedule', starting at time 'start' (see SMCTimeNow())
+ * - 'budget' is the largest number of SMC calls per second; 0 for no limit
+ * Returns NULL if out of memory.
+ */
+SMCSched_t *SMCSchedCreate(const SMCSchedule_t *schedule, int count, UInt64 start, double budget)
+{
+    SMCSched_t *s;
+    int         i;
+
+    s = calloc(1, sizeof(SMCSched_t));
+    if (s == NULL)
+        return NULL;
+    s->keys = calloc(count, sizeof(SMCSchedKey_t));
+    s->heap = calloc(count, sizeof(int));
+    s->taken = calloc(count, sizeof(int));
+    if (s->keys == NULL || s->heap == NULL || s->taken == NULL) {
+        SMCSchedFree(s);
+        return NULL;
+    }
+    s->count = count;
+    s->start = start;
+    s->budget = budget;
+    s->maxTokens = budget / 10 < 1 ? 1 : budget / 10;
+    s->tokens = s->maxTokens;
+    s->refilled = start;
+    for (i = 0; i < count; i++) {
+        s->keys[i].period = schedule[i].period;
+        s->keys[i].priority = schedule[i].priority;
+        s->keys[i].due = start;
+        schedPush(s, i);
+    }
+    return s;
+}
+
+void SMCSchedFree(SMCSched_t *s)
+{
+    if (s == NULL)
+        return;
+    free(s->keys);
+    free(s->heap);
+    free(s->taken);
+    free(s);
+}
+
+/*
+ * Time of the next wake-up: when the first key is due, or later if the budget
+ * has no token for it by then
+ * Returns 0 if all keys have been read and none is due again.
+ */
+UInt64 SMCSchedNext(SMCSched_t *s)
+{
+    UInt64 next;
+
+    if (s->heapCount == 0)
+        return 0;
+    next = s->keys[s->heap[0]].due;
+    if (s->budget > 0 && s->tokens < 1) {
+        UInt64 refill = s->refilled + (UInt64)((1 - s->tokens) * 1e9 / s->budget) + 1;
+        if (refill > next)
+            next = refill;
+    }
+    return next;
+}
+
+/*
+ * Take the keys due at time 'now' that the budget allows
+ * Sets due[i] for the keys to read now, and clears it for the others.
+ * Returns the number of keys to read.
+ */
+int SMCSchedTake(SMCSched_t *s, UInt64 now, char *due)
+{
+    SMCSchedKey_t *k;
+    int            n = 0, allowed, i, j, key;
+    UInt64         lag;
+
+    memset(due, 0, s->count);
+
+    // Top up the tokens
+    if (s->budget > 0) {
+        s->tokens += (now - s->refilled) * s->budget / 1e9;
+        if (s->tokens > s->maxTokens)
+            s->tokens = s->maxTokens;
+        s->refilled = now;
+    }
+
+    // All keys that are due, by priority (see schedBefore(); equal times are rare)
+    while (s->heapCount > 0 && s->keys[s->heap[0]].due <= now)
+        s->taken[n++] = schedPop(s);
+    for (i = 1; i < n; i++) {
+        key = s->taken[i];
+        for (j = i; j > 0 && s->keys[s->taken[j - 1]].priority > s->keys[key].priority; j--)
+            s->taken[j] = s->taken[j - 1];
+        s->taken[j] = key;
+    }
+
+    allowed = n;
+    if (s->budget > 0 && allowed > (int)s->tokens)
+        allowed = (int)s->tokens;
+
+    for (i = 0; i < n; i++) {
+        k = &s->keys[s->taken[i]];
+        if (i >= allowed) {
+            // No tokens left; stays due
+            k->deferred++;
+            schedPush(s, s->taken[i]);
+            continue;
+        }
+        due[s->taken[i]] = 1;
+        lag = now - k->due;
+        k->reads++;
+        k->lagSum += lag;
+        if (lag > k->lagMax)
+            k->lagMax = lag;
+        if (k->period == 0)
+            continue;   // Read once; done
+        k->due += k->period;
+        if (k->due <= now) {
+            // Fallen behind: skip the reads that are past
+            UInt64 skip = (now - k->due) / k->period + 1;
+            k->skipped += skip;
+            k->due += skip * k->period;
+        }
+        schedPush(s, s->taken[i]);
+    }
+    if (s->budget > 0)
+        s->tokens -= allowed;
+    return allowed;
+}
+
+/*
+ * Print the statistics of every key on stderr
+ * - 'elapsed' is the time the schedule ran, in nanoseconds
+ */
+void SMCSchedReport(SMCSched_t *s, UInt32Char_t *keys, UInt64 elapsed)
+{
+    SMCSchedKey_t *k;
+    int            i;
+
+    fprintf(stderr, "Key   period(ms) prio    reads  per second  deferred  skipped  mean lag(ms)  max lag(ms)\n");
+    for (i = 0; i < s->count; i++) {
+        k = &s->keys[i];
+        fprintf(stderr, "%-4s  %10.3f %4d %8lu  %10.2f  %8lu  %7lu  %12.3f  %11.3f\n",
+                keys[i], k->period / 1e6, k->priority, k->reads,
+                elapsed > 0 ? k->reads * 1e9 / elapsed : 0.0, k->deferred, k->skipped,
+                k->reads > 0 ? k->lagSum / 1e6 / k->reads : 0.0, k->lagMax / 1e6);
+    }
+}
@@ -0,0 +1,661 @@
+/*
+ *  smcsim.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * A simulated SMC, used as a transport instead of the AppleSMC kernel extension.
+ *
+ * The key table is read from a text file. Each line holds a key name, followed by
+ * the data type in square braces, and optionally the bytes of the value:
+ *   F0Ac  [fpe2]    Actual speed
+ *   TC0H  [sp78]  42.25 (bytes 2a 40)
+ * So both Keylist.txt and the output of 'smc -l' can be used.
+ * Lines starting with '=' are comments. Keys without bytes get a plausible value.
+ *
+ * The simulated SMC understands SMC_CMD_READ_INDEX, SMC_CMD_READ_KEYINFO,
+ * SMC_CMD_READ_BYTES, SMC_CMD_WRITE_BYTES and SMC_CMD_READ_VERS.
+ * Temperatures ('T...' keys of a fixed point type) swing slowly around their
+ * initial value. The actual fan speeds ("F%dAc") follow the target speeds ("F%dTg").
+ *
+ * Its behaviour can be tuned with environment variables:
+ * - SMCSIM_LATENCY  time in microseconds every call takes, optionally followed by
+ *                   a different time per command: "50,index=20,keyinfo=30,read=40,write=80"
+ * - SMCSIM_JITTER   random extra time in microseconds (0 up to this value) per call
+ * - SMCSIM_SEED     seed for the random numbers, to make runs repeatable
+ * - SMCSIM_VERS     SMC firmware version returned by SMC_CMD_READ_VERS, like "1.30f3"
+ * - SMCSIM_STATS    if set, the number of calls per command and the elapsed time
+ *                   are printed on stderr when the connection is closed
+ * - SMCSIM_FAIL     chance (0 to 1) that a call fails with kIOReturnError, optionally
+ *                   followed by a different chance per command, as for SMCSIM_LATENCY:
+ *                   "0,write=0.2" makes one in five writes fail
+ * - SMCSIM_COOLING  degrees the temperatures drop per 1000 RPM of the average actual
+ *                   fan speed, so fan control has something to control
+ *
+ * Several connections may be used at once from different threads. Their calls
+ * are handled one at a time, but the latencies overlap, as they would for the
+ * round trips to the kernel with a real SMC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "smc.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// How the value of a simulated key evolves over time
+enum {
+    SIM_MODEL_STATIC,       // Value only changes when written
+    SIM_MODEL_TEMPERATURE,  // Value swings around 'base'
+    SIM_MODEL_FAN           // Value follows the value of key 'target'
+};
+
+// Slots for the statistics and latencies of the commands
+enum {
+    SIM_CMD_INDEX,
+    SIM_CMD_KEYINFO,
+    SIM_CMD_READ,
+    SIM_CMD_WRITE,
+    SIM_CMD_OTHER,
+    SIM_CMD_COUNT
+};
+
+static const char *simCmdNames[SIM_CMD_COUNT] = { "index", "keyinfo", "read", "write", "other" };
+
+typedef struct {
+    UInt32                key;
+    UInt32                dataType;
+    UInt32                dataSize;
+    char                  dataAttributes;
+    SMCBytes_t            bytes;
+    int                   loaded;   // Value was given in the key list
+    int                   model;    // SIM_MODEL_...
+    double                base;     // SIM_MODEL_TEMPERATURE: centre of the swing
+    double                phase;    // SIM_MODEL_TEMPERATURE: phase of the swing
+    int                   target;   // SIM_MODEL_FAN: index of the key to follow
+    double                value;    // SIM_MODEL_FAN: current value
+    double                updated;  // SIM_MODEL_FAN: time of last update
+} SMCSimKey_t;
+
+static SMCSimKey_t   *simKeys = NULL;
+static int            simKeyCount = 0;
+
+static long           simLatency[SIM_CMD_COUNT];    // microseconds
+static long           simJitter = 0;                // microseconds
+static unsigned long  simCalls[SIM_CMD_COUNT];
+static double         simFail[SIM_CMD_COUNT];       // chance that a call fails
+static unsigned long  simFailed = 0;
+static double         simCooling = 0;               // degrees per 1000 RPM
+static int           *simFans = NULL;               // indexes of the F%dAc keys
+static int            simFanCount = 0;
+static int            simStats = 0;
+static unsigned int   simRandom = 1;
+static SMCKeyData_vers_t simVers = { 1, 30, 15, { 0 }, 3 };
+static struct timeval simStart;
+static int            simConnections = 0;   // Connections currently open
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Sizes of the data types, as listed in Keytypes.txt
+ * Entries are matched on their length, so "fp" matches all fixed point types.
+ */
+static const struct {
+    const char *type;
+    int         size;
+} simTypeSizes[] = {
+    { "ch8*", 8 },  { "char", 1 },  { "flag", 1 },  { "fp",   2 },
+    { "hex_", 1 },  { "si8 ", 1 },  { "si16", 2 },  { "sp",   2 },
+    { "ui8 ", 1 },  { "ui16", 2 },  { "ui32", 4 },
+    { "{alc", 16 }, { "{fds", 16 }, { "{lim", 3 },  { "{lsc", 10 },
+    { "{lsd", 8 },  { "{lsf", 6 },  { "{lso", 2 },  { "{mss", 1 },
+    { "{pwm", 2 },  { "{rev", 6 }
+};
+
+/*
+ * Seconds since the simulated SMC was loaded
+ */
+static double simNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec - simStart.tv_sec) + (tv.tv_usec - simStart.tv_usec) / 1e6;
+}
+
+/*
+ * Pseudo random number in the range [0, 1)
+ * A simple xorshift, so a given SMCSIM_SEED always gives the same run.
+ */
+static double simRand(void)
+{
+    simRandom ^= simRandom << 13;
+    simRandom ^= simRandom >> 17;
+    simRandom ^= simRandom << 5;
+    return (simRandom & 0xffffff) / (double)0x1000000;
+}
+
+/*
+ * Store 'value' in the bytes of key 'k', encoded according to its data type
+ * Only fixed point and unsigned integer types are handled; other types are left alone.
+ */
+static void simEncode(SMCSimKey_t *k, double value)
+{
+    UInt32Char_t type;
+    UInt32       raw;
+    int          signbits, fracbits, i;
+
+    uint32tostr(type, k->dataType);
+    if (type[0] == 'f' || type[0] == 's') {
+        if (type[1] != 'p' || hex2int(type[2]) < 0 || hex2int(type[3]) < 0)
+            return;
+        signbits = (type[0] == 's');
+        fracbits = hex2int(type[3]);
+        raw = (UInt32)(fabs(value) * (1 << fracbits) + 0.5);
+        if (signbits && value < 0)
+            raw |= 1u << (8 * k->dataSize - 1);
+    } else if (strncmp(type, "ui", 2) == 0) {
+        raw = value < 0 ? 0 : (UInt32)(value + 0.5);
+    } else {
+        return;
+    }
+    for (i = k->dataSize - 1; i >= 0; i--) {
+        k->bytes[i] = raw & 0xff;
+        raw >>= 8;
+    }
+}
+
+/*
+ * Decode the bytes of key 'k' into a double, using the same rules as val2float()
+ */
+static double simDecode(SMCSimKey_t *k)
+{
+    SMCVal_t val;
+
+    memset(&val, 0, sizeof(val));
+    val.dataSize = k->dataSize;
+    uint32tostr(val.dataType, k->dataType);
+    memcpy(val.bytes, k->bytes, sizeof(val.bytes));
+    if (strncmp(val.dataType, "ui", 2) == 0)
+        return bytes2uint32(val.bytes, val.dataSize);
+    return val2float(&val);
+}
+
+/*
+ * Find a key in the (sorted) table
+ * Returns the index of the key, or -1 if the key does not exist
+ */
+static int simFind(UInt32 key)
+{
+    int lo = 0, hi = simKeyCount - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (simKeys[mid].key == key)
+            return mid;
+        if (simKeys[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+static int simCompare(const void *a, const void *b)
+{
+    UInt32 ka = ((const SMCSimKey_t *)a)->key;
+    UInt32 kb = ((const SMCSimKey_t *)b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+/*
+ * Parse one line of a key list into 'k'
+ * Returns 1 if the line holds a key, 0 if it should be skipped
+ */
+static int simParseLine(char *line, SMCSimKey_t *k)
+{
+    char *p = line, *q;
+    int   i;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '=' || strlen(p) < 11)
+        return 0;
+
+    // The type, in braces, follows the 4 characters of the key name
+    q = p + 4;
+    while (*q == ' ' || *q == '\t')
+        q++;
+    if (q == p + 4 || strlen(q) < 6 || q[0] != '[' || q[5] != ']')
+        return 0;
+
+    memset(k, 0, sizeof(*k));
+    k->key = bytes2uint32(p, 4);
+    k->dataType = bytes2uint32(q + 1, 4);
+    k->dataAttributes = (char)0xc0;     // readable and writable
+    k->target = -1;
+
+    // Take the size from the bytes if they are given, otherwise from the type
+    p = strstr(q, "(bytes");
+    if (p != NULL) {
+        p += strlen("(bytes");
+        while (k->dataSize < BYTECOUNT) {
+            while (*p == ' ')
+                p++;
+            if (hex2int(p[0]) < 0 || hex2int(p[1]) < 0)
+                break;
+            k->bytes[k->dataSize++] = 16 * hex2int(p[0]) + hex2int(p[1]);
+            p += 2;
+        }
+        k->loaded = 1;
+    } else {
+        for (i = 0; i < sizeof(simTypeSizes) / sizeof(simTypeSizes[0]); i++) {
+            if (strncmp(q + 1, simTypeSizes[i].type, strlen(simTypeSizes[i].type)) == 0) {
+                k->dataSize = simTypeSizes[i].size;
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Give keys without a value from the key list a plausible value,
+ * and set up the way the values evolve over time
+ */
+static void simInitValues(void)
+{
+    UInt32Char_t name, target;
+    int          i, fans = 0, fan;
+    char         field[3];
+
+    for (i = 0; i < simKeyCount; i++) {
+        SMCSimKey_t *k = &simKeys[i];
+
+        uint32tostr(name, k->key);
+        if (sscanf(name, "F%1d%2c", &fan, field) == 2) {
+            field[2] = '\0';
+            if (strcmp(field, "Ac") == 0)
+                fans++;
+            if (!k->loaded) {
+                if (strcmp(field, "Mn") == 0 || strcmp(field, "Sf") == 0)
+                    simEncode(k, 1000 + 200 * fan);
+                else if (strcmp(field, "Mx") == 0)
+                    simEncode(k, 4000 + 500 * fan);
+                else if (strcmp(field, "Tg") == 0 || strcmp(field, "Ac") == 0)
+                    simEncode(k, 1200 + 200 * fan);
+                else if (strcmp(field, "ID") == 0)
+                    snprintf(&k->bytes[4], k->dataSize > 4 ? k->dataSize - 4 : 0, "Fan %d", fan);
+            }
+            if (strcmp(field, "Ac") == 0) {
+                if (simFans != NULL)
+                    simFans[simFanCount++] = i;
+                snprintf(target, sizeof(target), "F%dTg", fan);
+                k->model = SIM_MODEL_FAN;
+                k->target = simFind(bytes2uint32(target, 4));
+                k->value = simDecode(k);
+            }
+        } else if (name[0] == 'T' &&
+                   ((k->dataType >> 16) == ('s' << 8 | 'p') || (k->dataType >> 16) == ('f' << 8 | 'p'))) {
+            if (!k->loaded)
+                simEncode(k, 35 + 20 * simRand());
+            k->model = SIM_MODEL_TEMPERATURE;
+            k->base = simDecode(k);
+            k->phase = 2 * M_PI * simRand();
+        }
+    }
+
+    // The counters
+    for (i = 0; i < simKeyCount; i++) {
+        if (simKeys[i].loaded)
+            continue;
+        uint32tostr(name, simKeys[i].key);
+        if (strcmp(name, "#KEY") == 0) {
+            simEncode(&simKeys[i], simKeyCount);
+            simKeys[i].dataAttributes = (char)0x80;    // read only
+        } else if (strcmp(name, "FNum") == 0) {
+            simEncode(&simKeys[i], fans);
+        }
+    }
+}
+
+/*
+ * Bring the value of key 'k' up to date with the current time
+ */
+static void simEvolve(SMCSimKey_t *k)
+{
+    double now, goal;
+    int    i;
+
+    switch (k->model) {
+        case SIM_MODEL_TEMPERATURE:
+            now = simNow();
+            goal = k->base + 3.0 * sin(2 * M_PI * now / 60.0 + k->phase) + 0.5 * (simRand() - 0.5);
+            if (simCooling > 0 && simFanCount > 0) {
+                double rpm = 0;
+                for (i = 0; i < simFanCount; i++) {
+                    simEvolve(&simKeys[simFans[i]]);
+                    rpm += simKeys[simFans[i]].value;
+                }
+                goal -= simCooling * rpm / simFanCount / 1000.0;
+            }
+            simEncode(k, goal);
+            break;
+        case SIM_MODEL_FAN:
+            if (k->target < 0)
+                break;
+            now = simNow();
+            goal = simDecode(&simKeys[k->target]);
+            // Spin up or down towards the target with a time constant of 2 seconds
+            k->value = goal + (k->value - goal) * exp(-(now - k->updated) / 2.0);
+            k->updated = now;
+            simEncode(k, k->value + 10.0 * (simRand() - 0.5));
+            break;
+    }
+}
+
+/*
+ * Parse a per command setting like "50,index=20,read=40" from environment variable 'name'
+ * into 'values': the first number for all commands, then the exceptions.
+ * Leaves 'values' alone if the variable is not set.
+ */
+static void simParseCommands(const char *name, double *values)
+{
+    char  *env, *p;
+    double all;
+    int    i;
+
+    env = getenv(name);
+    if (env == NULL)
+        return;
+    all = strtod(env, &p);
+    for (i = 0; i < SIM_CMD_COUNT; i++)
+        values[i] = all;
+    while (*p == ',') {
+        p++;
+        for (i = 0; i < SIM_CMD_COUNT; i++) {
+            size_t l = strlen(simCmdNames[i]);
+            if (strncmp(p, simCmdNames[i], l) == 0 && p[l] == '=') {
+                values[i] = strtod(p + l + 1, &p);
+                break;
+            }
+        }
+        if (i == SIM_CMD_COUNT) {
+            fprintf(stderr, "Warning: unrecognised %s entry '%s'\n", name, p);
+            break;
+        }
+    }
+}
+
+/*
+ * Parse the SMCSIM_* environment variables
+ */
+static void simConfigure(void)
+{
+    char  *env;
+    double latency[SIM_CMD_COUNT];
+    int    i;
+
+    memset(latency, 0, sizeof(latency));
+    memset(simFail, 0, sizeof(simFail));
+    memset(simCalls, 0, sizeof(simCalls));
+
+    simParseCommands("SMCSIM_LATENCY", latency);
+    for (i = 0; i < SIM_CMD_COUNT; i++)
+        simLatency[i] = (long)latency[i];
+    simParseCommands("SMCSIM_FAIL", simFail);
+    env = getenv("SMCSIM_COOLING");
+    if (env != NULL)
+        simCooling = strtod(env, NULL);
+    env = getenv("SMCSIM_JITTER");
+    if (env != NULL)
+        simJitter = strtol(env, NULL, 10);
+    env = getenv("SMCSIM_SEED");
+    if (env != NULL && strtoul(env, NULL, 10) != 0)
+        simRandom = (unsigned int)strtoul(env, NULL, 10);
+    env = getenv("SMCSIM_VERS");
+    if (env != NULL) {
+        int  major, minor, release;
+        char letter;
+        // The letter is kept as a hex digit: "1.30f3" is build 0xf, release 3, like the default
+        if (sscanf(env, "%d.%d%c%d", &major, &minor, &letter, &release) == 4 && hex2int(letter) >= 10) {
+            simVers.major = major;
+            simVers.minor = minor;
+            simVers.build = hex2int(letter);
+            simVers.release = release;
+        } else
+            fprintf(stderr, "Warning: SMCSIM_VERS should look like \"1.30f3\", found '%s'\n", env);
+    }
+    simStats = getenv("SMCSIM_STATS") != NULL;
+}
+
+/*
+ * Load the key table of the simulated SMC from 'filename'
+ * Returns kIOReturnSuccess, or prints an error message and returns an error code
+ */
+kern_return_t SMCSimLoad(const char *filename)
+{
+    FILE *f;
+    char  line[256];
+    int   allocated = 0;
+    SMCSimKey_t k;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Error: cannot open key list '%s'\n", filename);
+        return kIOReturnNotFound;
+    }
+
+    free(simKeys);
+    simKeys = NULL;
+    simKeyCount = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (!simParseLine(line, &k))
+            continue;
+        if (simKeyCount == allocated) {
+            allocated = allocated ? 2 * allocated : 256;
+            simKeys = realloc(simKeys, allocated * sizeof(SMCSimKey_t));
+            if (simKeys == NULL) {
+                fclose(f);
+                return kIOReturnNoMemory;
+            }
+        }
+        simKeys[simKeyCount++] = k;
+    }
+    fclose(f);
+
+    if (simKeyCount == 0) {
+        fprintf(stderr, "Error: no keys found in '%s'\n", filename);
+        return kIOReturnNotFound;
+    }
+
+    // The SMC hands out its keys in sorted order
+    qsort(simKeys, simKeyCount, sizeof(SMCSimKey_t), simCompare);
+
+    simConfigure();
+    gettimeofday(&simStart, NULL);
+    free(simFans);
+    simFans = malloc(simKeyCount * sizeof(int));
+    simFanCount = 0;
+    simInitValues();
+    return kIOReturnSuccess;
+}
+
+static kern_return_t simOpen(io_connect_t *connp)
+{
+    if (simKeys == NULL)
+        return kIOReturnNoDevice;   // SMCSimLoad() not called
+    pthread_mutex_lock(&simLock);
+    *connp = ++simConnections;
+    pthread_mutex_unlock(&simLock);
+    return kIOReturnSuccess;
+}
+
+static kern_return_t simClose(io_connect_t conn)
+{
+    int           i;
+    unsigned long total = 0;
+    int           last;
+
+    // Only report when the last connection closes
+    pthread_mutex_lock(&simLock);
+    last = (--simConnections == 0);
+    pthread_mutex_unlock(&simLock);
+    if (simStats && last) {
+        for (i = 0; i < SIM_CMD_COUNT; i++)
+            total += simCalls[i];
+        fprintf(stderr, "smcsim: %lu calls (", total);
+        for (i = 0; i < SIM_CMD_COUNT; i++)
+            fprintf(stderr, "%s%s %lu", i ? ", " : "", simCmdNames[i], simCalls[i]);
+        if (simFailed > 0)
+            fprintf(stderr, "; %lu failed", simFailed);
+        fprintf(stderr, ") in %.3f s\n", simNow());
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Carry out command 'cmd' on the simulated SMC
+ * Called with 'simLock' held.
+ */
+static void simExecute(int cmd, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    int          i;
+    SMCSimKey_t *k;
+
+    memset(outputStructurep, 0, sizeof(SMCKeyData_t));
+    outputStructurep->result = SMC_RESULT_SUCCESS;
+
+    if (cmd == SIM_CMD_INDEX) {
+        if (inputStructurep->data32 >= (UInt32)simKeyCount)
+            outputStructurep->result = SMC_RESULT_KEY_INDEX_RANGE;
+        else
+            outputStructurep->key = simKeys[inputStructurep->data32].key;
+        return;
+    }
+    if (inputStructurep->data8 == SMC_CMD_READ_VERS) {
+        outputStructurep->vers = simVers;
+        return;
+    }
+    if (cmd == SIM_CMD_OTHER) {
+        outputStructurep->result = SMC_RESULT_BAD_COMMAND;
+        return;
+    }
+
+    i = simFind(inputStructurep->key);
+    if (i < 0) {
+        outputStructurep->result = SMC_RESULT_KEY_NOT_FOUND;
+        return;
+    }
+    k = &simKeys[i];
+    outputStructurep->key = k->key;
+
+    switch (cmd) {
+        case SIM_CMD_KEYINFO:
+            outputStructurep->keyInfo.dataSize = k->dataSize;
+            outputStructurep->keyInfo.dataType = k->dataType;
+            outputStructurep->keyInfo.dataAttributes = k->dataAttributes;
+            break;
+        case SIM_CMD_READ:
+            if (inputStructurep->keyInfo.dataSize != k->dataSize) {
+                outputStructurep->result = SMC_RESULT_KEY_SIZE_MISMATCH;
+                break;
+            }
+            simEvolve(k);
+            memcpy(outputStructurep->bytes, k->bytes, k->dataSize);
+            break;
+        case SIM_CMD_WRITE:
+            if (!(k->dataAttributes & 0x40)) {
+                outputStructurep->result = SMC_RESULT_KEY_NOT_WRITABLE;
+                break;
+            }
+            if (inputStructurep->keyInfo.dataSize != k->dataSize) {
+                outputStructurep->result = SMC_RESULT_KEY_SIZE_MISMATCH;
+                break;
+            }
+            memcpy(k->bytes, inputStructurep->bytes, k->dataSize);
+            if (k->model == SIM_MODEL_TEMPERATURE)
+                k->base = simDecode(k);
+            else if (k->model == SIM_MODEL_FAN)
+                k->value = simDecode(k);
+            break;
+    }
+}
+
+/*
+ * Execute one SMC command on the simulated SMC
+ * The command is in inputStructurep->data8, like for the real SMC.
+ */
+static kern_return_t simCall(io_connect_t conn, int index, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    int          cmd, fail;
+    long         delay;
+
+    if (index != KERNEL_INDEX_SMC)
+        return kIOReturnBadArgument;
+
+    switch (inputStructurep->data8) {
+        case SMC_CMD_READ_INDEX:    cmd = SIM_CMD_INDEX;   break;
+        case SMC_CMD_READ_KEYINFO:  cmd = SIM_CMD_KEYINFO; break;
+        case SMC_CMD_READ_BYTES:    cmd = SIM_CMD_READ;    break;
+        case SMC_CMD_WRITE_BYTES:   cmd = SIM_CMD_WRITE;   break;
+        default:                    cmd = SIM_CMD_OTHER;   break;
+    }
+    pthread_mutex_lock(&simLock);
+    simCalls[cmd]++;
+    delay = simLatency[cmd];
+    if (simJitter > 0)
+        delay += (long)(simJitter * simRand());
+    fail = simFail[cmd] > 0 && simRand() < simFail[cmd];
+    if (fail)
+        simFailed++;
+    pthread_mutex_unlock(&simLock);
+
+    // Take the time a real SMC would take
+    if (delay > 0) {
+        struct timespec ts = { delay / 1000000, (delay % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+
+    if (fail)
+        return kIOReturnError;
+
+    pthread_mutex_lock(&simLock);
+    simExecute(cmd, inputStructurep, outputStructurep);
+    pthread_mutex_unlock(&simLock);
+    return kIOReturnSuccess;
+}
+
+SMCTransport_t SMCSimTransport = {
+    "simulator",
+    simOpen,
+    simClose,
+    simCall
+};
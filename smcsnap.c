@@ -0,0 +1,467 @@
+/*
+ *  smcsnap.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Snapshots of all keys (-l with -o) and their differences (--diff)
+ *
+ * A snapshot holds the type and raw bytes of every key, instead of the text printed by -l.
+ *
+ * File layout (in the byte order of the machine that wrote it):
+ * - SMCSnapHeader_t
+ * - 'keyCount' times SMCSnapKey_t: the key directory, sorted by key
+ * - the value blob: the bytes of all values, 'blobSize' bytes. A key's value is
+ *   at 'offset' in the blob, 'dataSize' bytes long.
+ * The file is written under a temporary name and then renamed, so a snapshot is
+ * always complete.
+ *
+ * --diff maps the snapshots into memory and walks the directories of two of them
+ * side by side. As both are sorted, that takes one pass over each: keys only in the
+ * first are removed, keys only in the second added, keys in both with another type
+ * (or size) have a type change, and keys with other bytes, or another result of
+ * reading them, a value change. A value is only decoded to print it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "smc.h"
+
+#define SMC_SNAP_MAGIC      "SMCs"
+#define SMC_SNAP_VERSION    1
+
+typedef struct {
+    char                  magic[4];     // SMC_SNAP_MAGIC
+    UInt32                version;      // SMC_SNAP_VERSION
+    UInt32                keyCount;     // Number of SMCSnapKey_t following the header
+    UInt32                blobSize;     // Bytes of values following the keys
+    UInt64                time;         // Wall clock time of the snapshot, microseconds since 1970
+    SMCKeyData_vers_t     vers;         // SMC firmware version; all zero if unknown
+    UInt16                reserved;
+} SMCSnapHeader_t;
+
+typedef struct {
+    UInt32                key;
+    UInt32                dataType;
+    UInt32                dataSize;
+    UInt32                offset;       // Of the value in the blob
+    kern_return_t         result;       // Of reading the value; no bytes if not kIOReturnSuccess
+} SMCSnapKey_t;
+
+// A snapshot mapped into memory
+typedef struct {
+    const char           *filename;
+    const unsigned char  *map;
+    size_t                size;
+    const SMCSnapHeader_t *header;
+    const SMCSnapKey_t   *keys;
+    const unsigned char  *blob;
+} SMCSnap_t;
+
+// What --diff found for one key
+enum {
+    SNAP_ADDED,
+    SNAP_REMOVED,
+    SNAP_TYPE,
+    SNAP_VALUE
+};
+
+static const char *snapChanges[] = { "added", "removed", "type", "value" };
+
+static unsigned long snapPrinted = 0;   // Changes printed, for the JSON separators
+
+static int snapCompare(const void *a, const void *b)
+{
+    UInt32 x = ((const SMCSnapKey_t *)a)->key, y = ((const SMCSnapKey_t *)b)->key;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * Write a snapshot of all keys to 'filename', read over 'connections' SMC connections
+ * Returns kIOReturnSuccess, or an error code after printing an error message.
+ */
+kern_return_t SMCSnapshotWrite(const char *filename, int connections)
+{
+    SMCSnapHeader_t  header;
+    SMCSnapKey_t    *keys;
+    SMCVal_t        *vals;
+    char            *found, *tmpname;
+    kern_return_t   *results;
+    SMCKeyData_t     inputStructure, outputStructure;
+    struct timeval   tv;
+    FILE            *f;
+    int              totalKeys, count = 0, i, ok;
+    UInt32           blobSize = 0;
+    size_t           size;
+
+    totalKeys = SMCReadIndexCount();
+    keys = calloc(totalKeys + 1, sizeof(SMCSnapKey_t));
+    vals = calloc(totalKeys + 1, sizeof(SMCVal_t));
+    found = calloc(totalKeys + 1, 1);
+    results = calloc(totalKeys + 1, sizeof(kern_return_t));
+    tmpname = malloc(strlen(filename) + 5);
+    if (keys == NULL || vals == NULL || found == NULL || results == NULL || tmpname == NULL)
+    {
+        free(keys);
+        free(vals);
+        free(found);
+        free(results);
+        free(tmpname);
+        return kIOReturnNoMemory;
+    }
+    sprintf(tmpname, "%s.tmp", filename);
+
+    SMCReadAll(connections, 0, totalKeys, SMC_LIST_VALUES, NULL, vals, found, results);
+
+    // The directory; the values go in the blob in index order
+    for (i = 0; i < totalKeys; i++)
+    {
+        if (!found[i])
+            continue;
+        keys[count].key = bytes2uint32(vals[i].key, 4);
+        keys[count].result = results[i];
+        if (results[i] == kIOReturnSuccess)
+        {
+            keys[count].dataType = bytes2uint32(vals[i].dataType, 4);
+            keys[count].dataSize = vals[i].dataSize > BYTECOUNT ? BYTECOUNT : vals[i].dataSize;
+            keys[count].offset = blobSize;
+            blobSize += keys[count].dataSize;
+        }
+        count++;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SMC_SNAP_MAGIC, 4);
+    header.version = SMC_SNAP_VERSION;
+    header.keyCount = count;
+    header.blobSize = blobSize;
+    gettimeofday(&tv, NULL);
+    header.time = (UInt64)tv.tv_sec * 1000000 + tv.tv_usec;
+    memset(&inputStructure, 0, sizeof(SMCKeyData_t));
+    memset(&outputStructure, 0, sizeof(SMCKeyData_t));
+    inputStructure.data8 = SMC_CMD_READ_VERS;
+    if (SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure) == kIOReturnSuccess &&
+        outputStructure.result == SMC_RESULT_SUCCESS)
+        header.vers = outputStructure.vers;
+
+    qsort(keys, count, sizeof(SMCSnapKey_t), snapCompare);
+    f = fopen(tmpname, "wb");
+    ok = f != NULL && fwrite(&header, sizeof(header), 1, f) == 1 &&
+         fwrite(keys, sizeof(SMCSnapKey_t), count, f) == count;
+    for (i = 0; ok && i < totalKeys; i++)
+    {
+        size = vals[i].dataSize > BYTECOUNT ? BYTECOUNT : vals[i].dataSize;
+        if (found[i] && results[i] == kIOReturnSuccess)
+            ok = fwrite(vals[i].bytes, 1, size, f) == size;
+    }
+    if (f != NULL && fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmpname, filename) != 0)
+        ok = 0;
+    if (!ok)
+    {
+        perror("Error: cannot write snapshot");
+        unlink(tmpname);
+    }
+
+    free(keys);
+    free(vals);
+    free(found);
+    free(results);
+    free(tmpname);
+    return ok ? kIOReturnSuccess : kIOReturnError;
+}
+
+/*
+ * Map the snapshot 'filename' into '*snap'
+ * Returns kIOReturnSuccess, or an error code after printing an error message.
+ */
+static kern_return_t snapOpen(const char *filename, SMCSnap_t *snap)
+{
+    struct stat st;
+    int         fd, i;
+
+    memset(snap, 0, sizeof(SMCSnap_t));
+    snap->filename = filename;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(filename);
+        return kIOReturnNotFound;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(SMCSnapHeader_t))
+    {
+        fprintf(stderr, "Error: '%s' is not an smc snapshot\n", filename);
+        close(fd);
+        return kIOReturnBadArgument;
+    }
+    snap->size = st.st_size;
+    snap->map = mmap(NULL, snap->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snap->map == MAP_FAILED)
+    {
+        perror("Error: cannot map snapshot");
+        return kIOReturnError;
+    }
+    snap->header = (const SMCSnapHeader_t *)snap->map;
+    snap->keys = (const SMCSnapKey_t *)(snap->header + 1);
+    snap->blob = (const unsigned char *)(snap->keys + snap->header->keyCount);
+    if (memcmp(snap->header->magic, SMC_SNAP_MAGIC, 4) != 0 || snap->header->version != SMC_SNAP_VERSION ||
+        snap->size != sizeof(SMCSnapHeader_t) + (size_t)snap->header->keyCount * sizeof(SMCSnapKey_t) +
+                      snap->header->blobSize)
+    {
+        fprintf(stderr, "Error: '%s' is not an smc snapshot\n", filename);
+        munmap((void *)snap->map, snap->size);
+        return kIOReturnBadArgument;
+    }
+    for (i = 0; i < snap->header->keyCount; i++)
+    {
+        if (snap->keys[i].dataSize > BYTECOUNT ||
+            snap->keys[i].offset + (UInt64)snap->keys[i].dataSize > snap->header->blobSize ||
+            (i > 0 && snap->keys[i].key <= snap->keys[i - 1].key))
+        {
+            fprintf(stderr, "Error: snapshot '%s' is damaged\n", filename);
+            munmap((void *)snap->map, snap->size);
+            return kIOReturnBadArgument;
+        }
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Format the value of key 'k' of 'snap' into 'buf' of 'size' bytes: a number if the
+ * data type is known, otherwise the bytes in hexadecimal, or the error of reading it
+ */
+static void snapValue(const SMCSnap_t *snap, const SMCSnapKey_t *k, char *buf, size_t size)
+{
+    SMCVal_t val;
+    UInt32   i;
+
+    if (k->result != kIOReturnSuccess)
+    {
+        snprintf(buf, size, "error(%08x)", k->result);
+        return;
+    }
+    memset(&val, 0, sizeof(val));
+    uint32tostr(val.key, k->key);
+    uint32tostr(val.dataType, k->dataType);
+    val.dataSize = k->dataSize;
+    memcpy(val.bytes, snap->blob + k->offset, k->dataSize);
+    if (SMCFormatValue(&val, buf, size) > 0)
+        return;
+    buf[0] = '\0';
+    for (i = 0; i < k->dataSize && 2 * i + 2 < size; i++)
+        sprintf(buf + 2 * i, "%02x", (unsigned char)val.bytes[i]);
+}
+
+/*
+ * Print 'str' in double quotes, escaped for CSV if 'csv', otherwise for JSON
+ */
+static void snapQuoted(const char *str, int csv)
+{
+    putchar('"');
+    for (; *str != '\0'; str++)
+    {
+        if (*str == '"')
+            fputs(csv ? "\"\"" : "\\\"", stdout);
+        else if (*str == '\\' && !csv)
+            fputs("\\\\", stdout);
+        else if ((unsigned char)*str < ' ' && !csv)
+            printf("\\u%04x", (unsigned char)*str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+
+/*
+ * Print one change of the snapshot 'b' against 'a', in the output format
+ * - 'ka' and 'kb' are the key in 'a' and in 'b'; NULL if it is not there
+ */
+static void snapPrint(const SMCSnap_t *a, const SMCSnap_t *b, int change,
+                      const SMCSnapKey_t *ka, const SMCSnapKey_t *kb)
+{
+    UInt32Char_t  key, typeA = "", typeB = "";
+    char          valueA[3 * BYTECOUNT] = "", valueB[3 * BYTECOUNT] = "";
+
+    uint32tostr(key, ka != NULL ? ka->key : kb->key);
+    if (ka != NULL)
+    {
+        if (ka->result == kIOReturnSuccess)
+            uint32tostr(typeA, ka->dataType);
+        snapValue(a, ka, valueA, sizeof(valueA));
+    }
+    if (kb != NULL)
+    {
+        if (kb->result == kIOReturnSuccess)
+            uint32tostr(typeB, kb->dataType);
+        snapValue(b, kb, valueB, sizeof(valueB));
+    }
+
+    switch (SMCOutFormat())
+    {
+        case SMC_OUT_TEXT:
+            if (change == SNAP_ADDED)
+                printf("  added    %-4s  [%-4s]  %s\n", key, typeB, valueB);
+            else if (change == SNAP_REMOVED)
+                printf("  removed  %-4s  [%-4s]  %s\n", key, typeA, valueA);
+            else if (change == SNAP_TYPE)
+                printf("  type     %-4s  [%-4s] -> [%-4s]  %s -> %s\n", key, typeA, typeB, valueA, valueB);
+            else
+                printf("  value    %-4s  [%-4s]  %s -> %s\n", key, typeB, valueA, valueB);
+            break;
+        case SMC_OUT_JSON:
+        case SMC_OUT_NDJSON:
+            if (SMCOutFormat() == SMC_OUT_JSON)
+                printf(snapPrinted == 0 ? "[\n  " : ",\n  ");
+            printf("{\"snapshot\":");
+            snapQuoted(b->filename, 0);
+            printf(",\"change\":\"%s\",\"key\":", snapChanges[change]);
+            snapQuoted(key, 0);
+            printf(",\"old_type\":");
+            snapQuoted(typeA, 0);
+            printf(",\"new_type\":");
+            snapQuoted(typeB, 0);
+            printf(",\"old\":");
+            snapQuoted(valueA, 0);
+            printf(",\"new\":");
+            snapQuoted(valueB, 0);
+            printf(SMCOutFormat() == SMC_OUT_NDJSON ? "}\n" : "}");
+            break;
+        case SMC_OUT_CSV:
+            if (snapPrinted == 0)
+                printf("snapshot,change,key,old_type,new_type,old,new\n");
+            snapQuoted(b->filename, 1);
+            printf(",%s,", snapChanges[change]);
+            snapQuoted(key, 1);
+            printf(",");
+            snapQuoted(typeA, 1);
+            printf(",");
+            snapQuoted(typeB, 1);
+            printf(",");
+            snapQuoted(valueA, 1);
+            printf(",");
+            snapQuoted(valueB, 1);
+            printf("\n");
+            break;
+    }
+    snapPrinted++;
+}
+
+/*
+ * Print the differences of snapshot 'b' against snapshot 'a'
+ * Returns the number of keys that differ.
+ */
+static unsigned long snapDiff(const SMCSnap_t *a, const SMCSnap_t *b)
+{
+    const SMCSnapKey_t *ka = a->keys, *kb = b->keys;
+    const SMCSnapKey_t *enda = ka + a->header->keyCount, *endb = kb + b->header->keyCount;
+    unsigned long       counts[4] = { 0, 0, 0, 0 };
+    int                 change;
+
+    if (SMCOutFormat() == SMC_OUT_TEXT)
+        printf("--- %s\n+++ %s\n", a->filename, b->filename);
+    if (SMCOutFormat() == SMC_OUT_TEXT &&
+        memcmp(&a->header->vers, &b->header->vers, sizeof(SMCKeyData_vers_t)) != 0)
+        printf("  firmware %d.%d%x%d -> %d.%d%x%d\n",
+               a->header->vers.major, a->header->vers.minor, a->header->vers.build, a->header->vers.release,
+               b->header->vers.major, b->header->vers.minor, b->header->vers.build, b->header->vers.release);
+
+    while (ka < enda || kb < endb)
+    {
+        if (kb == endb || (ka < enda && ka->key < kb->key))
+        {
+            snapPrint(a, b, SNAP_REMOVED, ka++, NULL);
+            counts[SNAP_REMOVED]++;
+            continue;
+        }
+        if (ka == enda || kb->key < ka->key)
+        {
+            snapPrint(a, b, SNAP_ADDED, NULL, kb++);
+            counts[SNAP_ADDED]++;
+            continue;
+        }
+        change = -1;
+        if (ka->result == kIOReturnSuccess && kb->result == kIOReturnSuccess &&
+            (ka->dataType != kb->dataType || ka->dataSize != kb->dataSize))
+            change = SNAP_TYPE;
+        else if (ka->result != kb->result ||
+                 (ka->result == kIOReturnSuccess &&
+                  memcmp(a->blob + ka->offset, b->blob + kb->offset, ka->dataSize) != 0))
+            change = SNAP_VALUE;
+        if (change >= 0)
+        {
+            snapPrint(a, b, change, ka, kb);
+            counts[change]++;
+        }
+        ka++;
+        kb++;
+    }
+
+    if (SMCOutFormat() == SMC_OUT_TEXT)
+        printf("  %lu added, %lu removed, %lu type changes, %lu value changes\n",
+               counts[SNAP_ADDED], counts[SNAP_REMOVED], counts[SNAP_TYPE], counts[SNAP_VALUE]);
+    return counts[SNAP_ADDED] + counts[SNAP_REMOVED] + counts[SNAP_TYPE] + counts[SNAP_VALUE];
+}
+
+/*
+ * Print the differences of each of the 'count' snapshots in 'others' against the snapshot 'base'
+ * Returns the number of snapshots that differ from 'base' or cannot be read, or -1 if
+ * 'base' cannot be read. Snapshots that cannot be read are reported and skipped.
+ */
+int SMCSnapshotDiff(const char *base, char **others, int count)
+{
+    SMCSnap_t a, b;
+    int       i, differ = 0, same = 0, bad = 0;
+
+    if (snapOpen(base, &a) != kIOReturnSuccess)
+        return -1;
+    for (i = 0; i < count; i++)
+    {
+        if (snapOpen(others[i], &b) != kIOReturnSuccess)
+        {
+            bad++;
+            continue;
+        }
+        if (snapDiff(&a, &b) > 0)
+            differ++;
+        else
+            same++;
+        munmap((void *)b.map, b.size);
+    }
+    if (SMCOutFormat() == SMC_OUT_JSON)
+        printf(snapPrinted > 0 ? "\n]\n" : "[]\n");
+    munmap((void *)a.map, a.size);
+
+    if (count > 1)
+        fprintf(stderr, "%d snapshots: %d differ from %s, %d the same, %d not readable\n",
+                count, differ, base, same, bad);
+    return differ + bad;
+}
@@ -0,0 +1,243 @@
+/*
+ *  smcstats.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Statistics of the SMC calls (-S)
+ *
+ * When enabled, SMCCall() times every call and hands it to SMCStatsRecord(). For every
+ * command (SMC_CMD_READ_INDEX, ...) that keeps the number of calls, the calls that failed
+ * (an error code from the transport), the calls the SMC answered with an error (a non-zero
+ * result byte), the total and largest time taken, and a histogram of the times with
+ * buckets that double in width: bucket b counts the calls that took from 2^(b-1) up to
+ * 2^b nanoseconds. For every key with a failed call or an error it keeps the number of
+ * them, and the last command and error.
+ *
+ * When not enabled, SMCCall() only tests SMCStatsEnabled.
+ *
+ * SMCStatsPrint() prints the statistics on stderr, as text or, with --json or --ndjson,
+ * as one JSON object.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "smc.h"
+
+#define STATS_BUCKETS   40      // Up to 2^39 ns, about 9 minutes
+#define STATS_KEYS      256     // Keys with errors that are counted
+
+// The commands counted; the last one takes all others
+static const struct {
+    int         command;
+    const char *name;
+} statsCommands[] = {
+    { SMC_CMD_READ_INDEX,   "READ_INDEX" },
+    { SMC_CMD_READ_KEYINFO, "READ_KEYINFO" },
+    { SMC_CMD_READ_BYTES,   "READ_BYTES" },
+    { SMC_CMD_WRITE_BYTES,  "WRITE_BYTES" },
+    { SMC_CMD_READ_VERS,    "READ_VERS" },
+    { SMC_CMD_READ_PLIMIT,  "READ_PLIMIT" },
+    { -1,                   "other" },
+};
+#define STATS_COMMANDS (sizeof(statsCommands) / sizeof(statsCommands[0]))
+
+typedef struct {
+    unsigned long         calls;
+    unsigned long         failed;       // Error code from the transport
+    unsigned long         errors;       // Non-zero result byte from the SMC
+    UInt64                total;        // Nanoseconds
+    UInt64                max;
+    unsigned long         buckets[STATS_BUCKETS];
+} SMCStatsCommand_t;
+
+typedef struct {
+    UInt32                key;          // 0 for a free entry
+    unsigned long         errors;       // Failed calls and errors
+    int                   command;      // Index in statsCommands[] of the last one
+    kern_return_t         lastFailure;  // Of the last one; kIOReturnSuccess if it was an SMC error
+    int                   lastResult;   // Result byte of the last SMC error
+} SMCStatsKey_t;
+
+int                       SMCStatsEnabled = 0;
+
+static pthread_mutex_t    statsLock = PTHREAD_MUTEX_INITIALIZER;  // -l -j calls from several threads
+static SMCStatsCommand_t  statsCounts[STATS_COMMANDS];
+static SMCStatsKey_t      statsKeys[STATS_KEYS];
+static unsigned long      statsKeysLost = 0;    // Errors of keys that did not fit in statsKeys[]
+
+/*
+ * Start counting the SMC calls
+ */
+void SMCStatsEnable(void)
+{
+    SMCStatsEnabled = 1;
+}
+
+/*
+ * Count one SMC call
+ * - 'inputStructurep' and 'outputStructurep' are those of the call, 'result' its
+ *   return value, and 'ns' the time it took in nanoseconds
+ */
+void SMCStatsRecord(const SMCKeyData_t *inputStructurep, const SMCKeyData_t *outputStructurep,
+                    kern_return_t result, UInt64 ns)
+{
+    SMCStatsCommand_t *counts;
+    SMCStatsKey_t     *entry;
+    int                command, bucket, i;
+
+    for (command = 0; command < STATS_COMMANDS - 1; command++)
+        if (statsCommands[command].command == inputStructurep->data8)
+            break;
+    for (bucket = 0; bucket < STATS_BUCKETS - 1 && (ns >> bucket) != 0; bucket++)
+        ;
+
+    pthread_mutex_lock(&statsLock);
+    counts = &statsCounts[command];
+    counts->calls++;
+    counts->total += ns;
+    if (ns > counts->max)
+        counts->max = ns;
+    counts->buckets[bucket]++;
+    if (result != kIOReturnSuccess)
+        counts->failed++;
+    else if (outputStructurep->result != SMC_RESULT_SUCCESS)
+        counts->errors++;
+
+    // Errors per key; the key of a READ_INDEX call is what it would return
+    if ((result != kIOReturnSuccess || outputStructurep->result != SMC_RESULT_SUCCESS) &&
+        inputStructurep->data8 != SMC_CMD_READ_INDEX)
+    {
+        // Open addressing on the key
+        for (i = inputStructurep->key % STATS_KEYS, entry = NULL; entry == NULL; i = (i + 1) % STATS_KEYS)
+        {
+            if (statsKeys[i].key == inputStructurep->key || statsKeys[i].key == 0)
+                entry = &statsKeys[i];
+            else if (i == (inputStructurep->key + STATS_KEYS - 1) % STATS_KEYS)
+                break;  // Full
+        }
+        if (entry == NULL)
+        {
+            statsKeysLost++;
+        }
+        else
+        {
+            entry->key = inputStructurep->key;
+            entry->errors++;
+            entry->command = command;
+            entry->lastFailure = result;
+            entry->lastResult = (unsigned char)outputStructurep->result;
+        }
+    }
+    pthread_mutex_unlock(&statsLock);
+}
+
+/*
+ * Print the statistics on stderr, in the output format (see SMCOutFormat())
+ */
+void SMCStatsPrint(void)
+{
+    SMCStatsCommand_t *counts;
+    SMCStatsKey_t     *entry;
+    UInt32Char_t       key;
+    int                json, command, bucket, i, first;
+
+    json = SMCOutFormat() == SMC_OUT_JSON || SMCOutFormat() == SMC_OUT_NDJSON;
+    pthread_mutex_lock(&statsLock);
+
+    if (json)
+        fprintf(stderr, "{\"commands\":[");
+    else
+        fprintf(stderr, "Command          calls    failed  SMC errors    mean(us)     max(us)\n");
+    for (command = 0, first = 1; command < STATS_COMMANDS; command++)
+    {
+        counts = &statsCounts[command];
+        if (counts->calls == 0)
+            continue;
+        if (json)
+            fprintf(stderr, "%s{\"command\":\"%s\",\"calls\":%lu,\"failed\":%lu,\"errors\":%lu,"
+                            "\"total_ns\":%llu,\"max_ns\":%llu,\"histogram\":[",
+                    first ? "" : ",", statsCommands[command].name, counts->calls, counts->failed,
+                    counts->errors, (unsigned long long)counts->total, (unsigned long long)counts->max);
+        else
+            fprintf(stderr, "%-12s %9lu %9lu  %10lu  %10.1f  %10.1f\n",
+                    statsCommands[command].name, counts->calls, counts->failed, counts->errors,
+                    counts->total / 1e3 / counts->calls, counts->max / 1e3);
+        first = 0;
+
+        // The histogram: all buckets as JSON, the used range as text
+        if (json)
+        {
+            for (bucket = 0; bucket < STATS_BUCKETS; bucket++)
+                fprintf(stderr, "%s%lu", bucket == 0 ? "" : ",", counts->buckets[bucket]);
+            fprintf(stderr, "]}");
+            continue;
+        }
+        fprintf(stderr, "  ");
+        for (bucket = 0; bucket < STATS_BUCKETS; bucket++)
+        {
+            if (counts->buckets[bucket] == 0)
+                continue;
+            if (bucket < 10)
+                fprintf(stderr, " <%lluns:%lu", 1ull << bucket, counts->buckets[bucket]);
+            else if (bucket < 20)
+                fprintf(stderr, " <%lluus:%lu", (1ull << bucket) / 1000, counts->buckets[bucket]);
+            else
+                fprintf(stderr, " <%llums:%lu", (1ull << bucket) / 1000000, counts->buckets[bucket]);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (json)
+        fprintf(stderr, "],\"keys\":[");
+    for (i = 0, first = 1; i < STATS_KEYS; i++)
+    {
+        entry = &statsKeys[i];
+        if (entry->key == 0)
+            continue;
+        uint32tostr(key, entry->key);
+        if (json)
+            fprintf(stderr, "%s{\"key\":\"%s\",\"errors\":%lu,\"command\":\"%s\",\"failure\":%u,\"result\":%d}",
+                    first ? "" : ",", key, entry->errors, statsCommands[entry->command].name,
+                    (unsigned)entry->lastFailure, entry->lastResult);
+        else
+        {
+            if (first)
+                fprintf(stderr, "Keys with errors:\n");
+            if (entry->lastFailure != kIOReturnSuccess)
+                fprintf(stderr, "  %-4s  errors: %lu, last: %s failed (%08x)\n",
+                        key, entry->errors, statsCommands[entry->command].name, entry->lastFailure);
+            else
+                fprintf(stderr, "  %-4s  errors: %lu, last: %s result 0x%02x\n",
+                        key, entry->errors, statsCommands[entry->command].name, entry->lastResult);
+        }
+        first = 0;
+    }
+    if (json)
+        fprintf(stderr, "],\"keys_not_counted\":%lu}\n", statsKeysLost);
+    else if (statsKeysLost > 0)
+        fprintf(stderr, "  and %lu errors of other keys\n", statsKeysLost);
+
+    pthread_mutex_unlock(&statsLock);
+}
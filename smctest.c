@@ -0,0 +1,290 @@
+/*
+ *  smctest.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Self-test of the value decoders (--selftest)
+ *
+ * The decoders of smctypes.c replaced a val2float() that worked out every value from
+ * the type name, bit by bit. The self-test keeps that code as the reference, and checks
+ * for every 16 bit fixed point type ("fpIF" with I + F = 16, "spIF" with 1 + I + F = 16)
+ * and every one of the 65536 values that
+ * - SMCDecode() and val2float() give exactly the reference value
+ * - SMCDecodeColumn() gives it as a float, with each method the processor has
+ * It needs no SMC, and runs in well under a second.
+ *
+ * With a key list for the simulated SMC (-s), fan control (-C, see smcfan.c) is run
+ * against it too, with and without failing calls (SMCSIM_FAIL), and each run checked:
+ * - every cycle is run, and the fans are given back: "FS! " has its old value again
+ * - the control latency stays below the interval, with 100 us per SMC call
+ * - the deadband suppresses writes, and without one none are suppressed
+ * - failed calls are counted, and do not stop the control
+ * The simulator is seeded, so the runs can be repeated; the counts still vary a little, as
+ * the simulated temperatures follow the clock. The runs take about four seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "smc.h"
+
+#define TEST_VALUES     65536
+#define TEST_REPORT     10          // Differences printed per type at most
+
+extern __thread io_connect_t conn;  // smc.c
+
+// A fan control run against the simulated SMC
+typedef struct {
+    const char           *name;
+    const char           *fail;         // SMCSIM_FAIL
+    double                deadband;     // RPM
+    unsigned long         cycles;
+    UInt64                interval;     // Nanoseconds
+} SMCFanTest_t;
+
+static const SMCFanTest_t fanTests[] = {
+    { "no faults",   "0",              50,  50, 20000000 },
+    { "no deadband", "0",               0,  50, 20000000 },
+    { "faults",      "0.05,write=0.2", 50, 100, 20000000 },
+};
+
+/*
+ * val2float() as it was before the decoder table: the reference
+ */
+static double referenceVal2float(const SMCVal_t *valp)
+{
+    float total = 0.0;  // Running total of the return value
+    int signbits = 0;   // Number of sign bits (0 or 1)
+    int intbits = 0;    // Number of integer bits
+    int fracbits = 0;   // Number of fraction bits
+    unsigned char byte; // Temporary holder for a single byte
+    int sign = 0;       // Flag for sign bit. 1= negative, 0= positive
+    int i;
+
+    // Analise the data type
+    if (valp->dataType[0]=='s'){  // First letter is an s?
+        signbits = 1;           // Then we have a sign bit
+    }
+    intbits = hex2int(valp->dataType[2]);     // Get the nr of integer bits
+    fracbits = hex2int(valp->dataType[3]);    // Get the nr of fraction bits
+    if (intbits < 0 || fracbits < 0)
+        return 0.0;
+
+    // Build up the number from the bytes
+    // The first byte may contain a sign
+    byte = valp->bytes[0];
+    if (signbits > 0) {
+        sign = byte >> 7; // Isolate the top bit
+        byte &= 0x7f;     // Remove the sign bit from the value
+    }
+
+    total = byte;
+    for (i = 1; i < (signbits+intbits+fracbits)/8; i++)
+    {
+        total *= (double)(1<<8);    // 'shift' the total 8 bits to the left (multiply by 256)
+        byte = valp->bytes[i];    // go via 'byte' to prevent problems with signed char
+        total += byte;      // Add the next byte
+    }
+
+    // Divide by 2 for each fractional bit
+    for (i = 0; i < fracbits; i++) {
+        total /= 2.0;   // Ensure floating point divide
+    }
+
+    // Add the sign
+    // (Don't do this before we have all the bytes. Higher bytes might be zero, and we would lose the sign)
+    if (sign) {
+        total = - total;
+    }
+    return total;
+}
+
+/*
+ * Check all values of the 16 bit type 'type' against the reference
+ * Returns the number of values that differ.
+ */
+static int testType(const char *type)
+{
+    static const char  *methods[] = { NULL, "scalar", "SSE2", "AVX2" };
+    static char         raw[2 * TEST_VALUES];
+    static float        column[TEST_VALUES];
+    const SMCDecoder_t *decoder;
+    SMCVal_t            val;
+    double              expected;
+    int                 i, m, failed = 0;
+
+    decoder = SMCDecoderFor(bytes2uint32((char *)type, 4));
+    if (decoder == NULL) {
+        printf("%s: not in the decoder table\n", type);
+        return TEST_VALUES;
+    }
+
+    memset(&val, 0, sizeof(val));
+    strcpy(val.dataType, type);
+    val.dataSize = 2;
+    for (i = 0; i < TEST_VALUES; i++) {
+        raw[2 * i] = val.bytes[0] = (char)(i >> 8);
+        raw[2 * i + 1] = val.bytes[1] = (char)i;
+        expected = referenceVal2float(&val);
+        if (SMCDecode(decoder, val.bytes, 2) != expected || val2float(&val) != expected) {
+            if (failed++ < TEST_REPORT)
+                printf("%s: %02x%02x is %.9g, SMCDecode() %.9g, val2float() %.9g\n", type, i >> 8, i & 0xff,
+                       expected, SMCDecode(decoder, val.bytes, 2), val2float(&val));
+        }
+    }
+
+    for (m = SMC_COLUMN_SCALAR; m <= SMC_COLUMN_AVX2; m++) {
+        if (SMCDecodeColumn(decoder, raw, TEST_VALUES, column, m) != kIOReturnSuccess)
+            continue;   // Not on this processor
+        for (i = 0; i < TEST_VALUES; i++) {
+            memcpy(val.bytes, raw + 2 * i, 2);
+            if (column[i] != (float)referenceVal2float(&val)) {
+                if (failed++ < TEST_REPORT)
+                    printf("%s: %02x%02x is %.9g, SMCDecodeColumn(%s) %.9g\n", type, i >> 8, i & 0xff,
+                           referenceVal2float(&val), methods[m], column[i]);
+            }
+        }
+    }
+    return failed;
+}
+
+/*
+ * Read the number in 'key', trying again when a call fails
+ */
+static kern_return_t testFanRead(const char *key, double *valuep)
+{
+    SMCVal_t      val;
+    kern_return_t result = kIOReturnError;
+    int           tries;
+
+    for (tries = 0; tries < 10 && result != kIOReturnSuccess; tries++)
+        result = SMCReadKey((char *)key, &val);
+    if (result == kIOReturnSuccess)
+        *valuep = SMCDecode(SMCDecoderFor(bytes2uint32(val.dataType, 4)), val.bytes, val.dataSize);
+    return result;
+}
+
+/*
+ * Run fan control as 'test' says against the simulated SMC with the keys in 'simfile'
+ * Returns 1 if a check fails, 0 if all is well.
+ */
+static int testFan(const char *simfile, const SMCFanTest_t *test)
+{
+    static const double gains[3] = { 0.05, 0.005, 0 };
+    UInt32Char_t        keys[1] = { "TC0H" };
+    SMCFanStats_t       stats;
+    kern_return_t       result;
+    double              temperature, before, after = -1;
+    const char         *problem = NULL;
+    int                 out, err, null;
+
+    setenv("SMCSIM_LATENCY", "100", 1);
+    setenv("SMCSIM_JITTER", "0", 1);
+    setenv("SMCSIM_SEED", "1", 1);
+    setenv("SMCSIM_COOLING", "5", 1);
+    setenv("SMCSIM_FAIL", test->fail, 1);
+    if (SMCSimLoad(simfile) != kIOReturnSuccess)
+        return 1;
+    transport = &SMCSimTransport;
+    if (SMCOpen(&conn) != kIOReturnSuccess || testFanRead("FS! ", &before) != kIOReturnSuccess ||
+        testFanRead(keys[0], &temperature) != kIOReturnSuccess) {
+        printf("Fan control, %s: cannot open the simulated SMC\n", test->name);
+        return 1;
+    }
+
+    // Aim a little below the temperature, so the fans run between their minimum and maximum.
+    // Only the counts matter here, not the lines of every cycle.
+    fflush(stdout);
+    fflush(stderr);
+    out = dup(STDOUT_FILENO);
+    err = dup(STDERR_FILENO);
+    null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    result = SMCFanControl(keys, 1, temperature - 5, gains, test->deadband, test->interval, test->cycles, &stats);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    close(out);
+    close(err);
+    close(null);
+
+    if (result != kIOReturnSuccess)
+        problem = "SMCFanControl() failed";
+    else if (stats.cycles != test->cycles)
+        problem = "not every cycle was run";
+    else if (testFanRead("FS! ", &after) != kIOReturnSuccess || after != before)
+        problem = "\"FS! \" was not set back";
+    else if (stats.writes == 0)
+        problem = "no fan targets were written";
+    else if (stats.maxLatency == 0 || stats.maxLatency >= test->interval)
+        problem = "the control latency is not below the interval";
+    else if (test->deadband > 0 && stats.suppressed == 0)
+        problem = "the deadband suppressed no writes";
+    else if (test->deadband == 0 && stats.suppressed != 0)
+        problem = "writes were suppressed without a deadband";
+    else if (strcmp(test->fail, "0") == 0 && stats.readFailures + stats.writeFailures != 0)
+        problem = "failures without faults";
+    else if (strcmp(test->fail, "0") != 0 && stats.readFailures + stats.writeFailures == 0)
+        problem = "the injected faults were not counted";
+
+    printf("Fan control, %s: %lu cycles, %lu writes, %lu suppressed, %lu failed reads, %lu failed writes, "
+           "latency %.3f ms: %s\n", test->name, stats.cycles, stats.writes, stats.suppressed, stats.readFailures,
+           stats.writeFailures, stats.maxLatency / 1e6, problem != NULL ? problem : "ok");
+    SMCClose(conn);
+    return problem != NULL;
+}
+
+/*
+ * Run the self-test, and print the result
+ * - 'simfile', if not NULL, is the key list of the simulated SMC to run fan control against
+ * Returns the number of values that differ and fan control runs that failed; 0 if all is well.
+ */
+int SMCSelfTest(const char *simfile)
+{
+    char type[5];
+    int  bits, i, types = 0, failed = 0;
+
+    // "fpIF": I + F = 16; "spIF": 1 + I + F = 16. I and F are single hex digits.
+    for (bits = 1; bits <= 15; bits++) {
+        snprintf(type, sizeof(type), "fp%x%x", 16 - bits, bits);
+        failed += testType(type);
+        types++;
+    }
+    for (bits = 0; bits <= 15; bits++) {
+        snprintf(type, sizeof(type), "sp%x%x", 15 - bits, bits);
+        failed += testType(type);
+        types++;
+    }
+    printf("Decoders: %d types, %d values each: %s\n", types, TEST_VALUES,
+           failed == 0 ? "all equal to the reference" : "DIFFERENCES FOUND");
+    if (simfile != NULL) {
+        for (i = 0; i < (int)(sizeof(fanTests) / sizeof(fanTests[0])); i++)
+            failed += testFan(simfile, &fanTests[i]);
+    }
+    return failed;
+}
@@ -0,0 +1,479 @@
+/*
+ *  smctrace.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Traces of SMC calls: record them (--record) and replay them (--replay)
+ *
+ * The recorder is a transport that wraps the one in use, and writes every call to a
+ * trace file: its input and output SMCKeyData_t, its return value, when it started
+ * and how long it took. The replayer is a transport that answers calls from a trace.
+ * So a trace taken once on a Mac can be used to run and time smc on any machine.
+ *
+ * File layout (in the byte order of the machine that wrote it):
+ * - SMCTraceHeader_t
+ * - the records, one per call:
+ *   - the index (the first argument of the transport call), one byte
+ *   - the start of the call, as the difference in nanoseconds with the start of the
+ *     previous call, zigzag encoded into a variable length integer (7 bits per byte,
+ *     low bits first), as in smclog.c
+ *   - the time the call took in nanoseconds, a variable length integer
+ *   - the return value, a variable length integer
+ *   - the input, then the output SMCKeyData_t: a bitmap of the bytes of the structure
+ *     that are not zero, followed by those bytes. As most of a structure is zero,
+ *     a call takes about 40 bytes instead of twice sizeof(SMCKeyData_t).
+ *   - a check byte: the sum of all bytes of the record so far
+ * Readers stop at the first record that is incomplete or fails its check byte, so a trace
+ * cut short by a crash can still be replayed up to there.
+ *
+ * Replay answers each call with the next record of the trace, if its index and input
+ * match. If not, the call diverged from the trace: it is reported, and answered by the first
+ * unused record further on with the same input, else by any record with that input, else
+ * with kIOReturnNotFound. So a run that does the same calls in a different order (like
+ * -l -j <n>) still works. With a speed above 0 every call takes the time it took when recorded,
+ * divided by the speed; 0 answers as fast as possible. When the last connection closes,
+ * the number of calls, divergences and calls not in the trace are printed on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "smc.h"
+
+#define SMC_TRACE_MAGIC     "SMCt"
+#define SMC_TRACE_VERSION   1
+#define SMC_TRACE_RECORD    (1 + 3 * 10 + 2 * ((sizeof(SMCKeyData_t) + 7) / 8 + sizeof(SMCKeyData_t)) + 1)
+#define SMC_TRACE_REPORT    10      // Divergences reported one by one
+#define SMC_TRACE_SPIN      200000  // Nanoseconds of a replayed call not slept, but waited out
+
+typedef struct {
+    char                  magic[4];     // SMC_TRACE_MAGIC
+    UInt32                version;      // SMC_TRACE_VERSION
+    UInt32                structSize;   // sizeof(SMCKeyData_t) of the machine that wrote it
+    UInt32                reserved;
+} SMCTraceHeader_t;
+
+// A call read from a trace
+typedef struct {
+    int                   index;
+    kern_return_t         result;
+    UInt64                latency;      // Nanoseconds
+    SMCKeyData_t          input;
+    SMCKeyData_t          output;
+    int                   used;
+} SMCTraceCall_t;
+
+static pthread_mutex_t    traceLock = PTHREAD_MUTEX_INITIALIZER;
+static int                traceConnections = 0;
+
+// Recording
+static SMCTransport_t    *traceInner;       // The transport recorded
+static FILE              *traceFile;
+static UInt64             traceLastStart;
+static unsigned long      traceRecorded = 0;
+static int                traceFailed = 0;
+
+// Replaying
+static SMCTraceCall_t    *traceCalls;
+static unsigned long      traceCount = 0;
+static unsigned long      traceNext = 0;    // The record the next call should match
+static double             traceSpeed = 0;
+static unsigned long      traceReplayed = 0;
+static unsigned long      traceDiverged = 0;
+static unsigned long      traceMissing = 0;
+
+/*
+ * Add 'value' to 'p' as a variable length integer
+ */
+static unsigned char *tracePutVarint(unsigned char *p, UInt64 value)
+{
+    while (value >= 0x80) {
+        *p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+/*
+ * Take a variable length integer from 'p', not going past 'end'
+ * Returns the position after it, or NULL if it is incomplete.
+ */
+static const unsigned char *traceGetVarint(const unsigned char *p, const unsigned char *end, UInt64 *valuep)
+{
+    int shift;
+
+    *valuep = 0;
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        *valuep |= (UInt64)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+/*
+ * Add the structure '*data' to 'p': a bitmap of its non-zero bytes, then those bytes
+ */
+static unsigned char *tracePutStruct(unsigned char *p, const SMCKeyData_t *data)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned char       *bitmap = p;
+    size_t               i;
+
+    memset(bitmap, 0, (sizeof(SMCKeyData_t) + 7) / 8);
+    p += (sizeof(SMCKeyData_t) + 7) / 8;
+    for (i = 0; i < sizeof(SMCKeyData_t); i++) {
+        if (bytes[i] != 0) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            *p++ = bytes[i];
+        }
+    }
+    return p;
+}
+
+/*
+ * Take a structure added by tracePutStruct() from 'p', not going past 'end'
+ * Returns the position after it, or NULL if it is incomplete.
+ */
+static const unsigned char *traceGetStruct(const unsigned char *p, const unsigned char *end, SMCKeyData_t *data)
+{
+    unsigned char       *bytes = (unsigned char *)data;
+    const unsigned char *bitmap = p;
+    size_t               i;
+
+    if (p == NULL || end - p < (sizeof(SMCKeyData_t) + 7) / 8)
+        return NULL;
+    p += (sizeof(SMCKeyData_t) + 7) / 8;
+    memset(data, 0, sizeof(SMCKeyData_t));
+    for (i = 0; i < sizeof(SMCKeyData_t); i++) {
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            if (p >= end)
+                return NULL;
+            bytes[i] = *p++;
+        }
+    }
+    return p;
+}
+
+static kern_return_t recordOpen(io_connect_t *connp)
+{
+    kern_return_t result = traceInner->open(connp);
+
+    if (result == kIOReturnSuccess) {
+        pthread_mutex_lock(&traceLock);
+        traceConnections++;
+        pthread_mutex_unlock(&traceLock);
+    }
+    return result;
+}
+
+static kern_return_t recordClose(io_connect_t conn)
+{
+    int last;
+
+    // Finish the trace when the last connection closes
+    pthread_mutex_lock(&traceLock);
+    last = (--traceConnections == 0);
+    if (last && traceFile != NULL) {
+        if (fclose(traceFile) != 0)
+            traceFailed = 1;
+        traceFile = NULL;
+        if (traceFailed)
+            fprintf(stderr, "Error: cannot write trace; %lu calls recorded\n", traceRecorded);
+    }
+    pthread_mutex_unlock(&traceLock);
+    return traceInner->close(conn);
+}
+
+static kern_return_t recordCall(io_connect_t conn, int index,
+                                SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    unsigned char  record[SMC_TRACE_RECORD], *p = record, check = 0, *q;
+    SMCKeyData_t   input = *inputStructurep;   // The transport may change it
+    kern_return_t  result;
+    UInt64         start, end;
+    SInt64         delta;
+
+    start = SMCTimeNow();
+    result = traceInner->call(conn, index, inputStructurep, outputStructurep);
+    end = SMCTimeNow();
+
+    pthread_mutex_lock(&traceLock);
+    if (traceFile != NULL) {
+        delta = (SInt64)(start - traceLastStart);  // Calls on other threads may start earlier
+        traceLastStart = start;
+        *p++ = (unsigned char)index;
+        p = tracePutVarint(p, ((UInt64)delta << 1) ^ (UInt64)(delta >> 63));
+        p = tracePutVarint(p, end - start);
+        p = tracePutVarint(p, (UInt32)result);
+        p = tracePutStruct(p, &input);
+        p = tracePutStruct(p, outputStructurep);
+        for (q = record; q < p; q++)
+            check += *q;
+        *p++ = check;
+        if (fwrite(record, 1, p - record, traceFile) != p - record)
+            traceFailed = 1;
+        traceRecorded++;
+    }
+    pthread_mutex_unlock(&traceLock);
+    return result;
+}
+
+static SMCTransport_t SMCRecordTransport = {
+    "record", recordOpen, recordClose, recordCall
+};
+
+/*
+ * Record all SMC calls to the trace 'filename', from now on
+ * The transport in use is wrapped, so this must be called after it is chosen and before SMCOpen().
+ * An existing file is replaced.
+ * Returns kIOReturnSuccess, or kIOReturnError after printing an error message.
+ */
+kern_return_t SMCTraceRecord(const char *filename)
+{
+    SMCTraceHeader_t header;
+
+    if (transport == NULL) {
+        printf("Error: no SMC found\n");
+        return kIOReturnError;
+    }
+    traceFile = fopen(filename, "wb");
+    if (traceFile == NULL) {
+        perror("Error: cannot create trace");
+        return kIOReturnError;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SMC_TRACE_MAGIC, 4);
+    header.version = SMC_TRACE_VERSION;
+    header.structSize = sizeof(SMCKeyData_t);
+    if (fwrite(&header, sizeof(header), 1, traceFile) != 1) {
+        perror("Error: cannot write trace");
+        fclose(traceFile);
+        traceFile = NULL;
+        return kIOReturnError;
+    }
+    traceLastStart = SMCTimeNow();
+    traceInner = transport;
+    transport = &SMCRecordTransport;
+    return kIOReturnSuccess;
+}
+
+static kern_return_t replayOpen(io_connect_t *connp)
+{
+    pthread_mutex_lock(&traceLock);
+    *connp = ++traceConnections;
+    pthread_mutex_unlock(&traceLock);
+    return kIOReturnSuccess;
+}
+
+static kern_return_t replayClose(io_connect_t conn)
+{
+    unsigned long unused = 0, i;
+    int           last;
+
+    // Only report when the last connection closes
+    pthread_mutex_lock(&traceLock);
+    last = (--traceConnections == 0);
+    if (last) {
+        for (i = 0; i < traceCount; i++)
+            unused += !traceCalls[i].used;
+        fprintf(stderr, "replay: %lu calls, %lu diverged from the trace, %lu not in the trace; "
+                        "%lu of %lu calls of the trace not used\n",
+                traceReplayed, traceDiverged, traceMissing, unused, traceCount);
+    }
+    pthread_mutex_unlock(&traceLock);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Is record 'i' a call with 'index' and 'input'?
+ */
+static int replayMatches(unsigned long i, int index, const SMCKeyData_t *input)
+{
+    return traceCalls[i].index == index && memcmp(&traceCalls[i].input, input, sizeof(SMCKeyData_t)) == 0;
+}
+
+static const char *replayCommand(int command)
+{
+    switch (command) {
+        case SMC_CMD_READ_INDEX:    return "READ_INDEX";
+        case SMC_CMD_READ_KEYINFO:  return "READ_KEYINFO";
+        case SMC_CMD_READ_BYTES:    return "READ_BYTES";
+        case SMC_CMD_WRITE_BYTES:   return "WRITE_BYTES";
+        case SMC_CMD_READ_VERS:     return "READ_VERS";
+        case SMC_CMD_READ_PLIMIT:   return "READ_PLIMIT";
+        default:                    return "other";
+    }
+}
+
+static kern_return_t replayCall(io_connect_t conn, int index,
+                                SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep)
+{
+    SMCTraceCall_t *call = NULL;
+    UInt32Char_t    key, expected;
+    unsigned long   i;
+    UInt64          deadline;
+
+    pthread_mutex_lock(&traceLock);
+    traceReplayed++;
+    if (traceNext < traceCount && replayMatches(traceNext, index, inputStructurep)) {
+        call = &traceCalls[traceNext++];
+    } else {
+        // Diverged: report it, then look for the same call elsewhere
+        traceDiverged++;
+        if (traceDiverged <= SMC_TRACE_REPORT) {
+            uint32tostr(key, inputStructurep->key);
+            if (traceNext < traceCount) {
+                uint32tostr(expected, traceCalls[traceNext].input.key);
+                fprintf(stderr, "replay: call %lu is %s '%s', the trace has %s '%s'\n", traceReplayed,
+                        replayCommand(inputStructurep->data8), key,
+                        replayCommand(traceCalls[traceNext].input.data8), expected);
+            } else
+                fprintf(stderr, "replay: call %lu is %s '%s', past the end of the trace\n", traceReplayed,
+                        replayCommand(inputStructurep->data8), key);
+        }
+        for (i = traceNext; i < traceCount && call == NULL; i++) {
+            if (!traceCalls[i].used && replayMatches(i, index, inputStructurep)) {
+                call = &traceCalls[i];
+                traceNext = i + 1;
+            }
+        }
+        for (i = 0; i < traceCount && call == NULL; i++) {
+            if (replayMatches(i, index, inputStructurep))
+                call = &traceCalls[i];
+        }
+    }
+    if (call == NULL) {
+        traceMissing++;
+        pthread_mutex_unlock(&traceLock);
+        return kIOReturnNotFound;
+    }
+    call->used = 1;
+    pthread_mutex_unlock(&traceLock);
+
+    if (traceSpeed > 0) {
+        // Sleeping overshoots by tens of microseconds; wait out the end of the call
+        deadline = SMCTimeNow() + (UInt64)(call->latency / traceSpeed);
+        if (deadline > SMCTimeNow() + SMC_TRACE_SPIN)
+            SMCSleepUntil(deadline - SMC_TRACE_SPIN);
+        while (SMCTimeNow() < deadline)
+            ;
+    }
+    *outputStructurep = call->output;
+    return call->result;
+}
+
+static SMCTransport_t SMCReplayTransport = {
+    "replay", replayOpen, replayClose, replayCall
+};
+
+/*
+ * Answer all SMC calls from the trace 'filename', to be used instead of an SMC
+ * - 'speed' divides the time every call took when recorded; 0 for no delay
+ * Returns kIOReturnSuccess, or an error code after printing an error message.
+ */
+kern_return_t SMCTraceReplay(const char *filename, double speed)
+{
+    SMCTraceHeader_t     header;
+    unsigned char       *buffer;
+    const unsigned char *p, *end, *record, *q;
+    struct stat          st;
+    UInt64               value;
+    unsigned char        check;
+    int                  fd, damaged = 0;
+    ssize_t              n;
+    size_t               done = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error: cannot open trace");
+        return kIOReturnNotFound;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, SMC_TRACE_MAGIC, 4) != 0 || header.version != SMC_TRACE_VERSION) {
+        fprintf(stderr, "Error: '%s' is not an smc trace\n", filename);
+        close(fd);
+        return kIOReturnBadArgument;
+    }
+    if (header.structSize != sizeof(SMCKeyData_t)) {
+        fprintf(stderr, "Error: trace '%s' was recorded with a different SMCKeyData_t (%u bytes, here %u)\n",
+                filename, header.structSize, (unsigned)sizeof(SMCKeyData_t));
+        close(fd);
+        return kIOReturnBadArgument;
+    }
+
+    // Read it all; a call takes at least 1 + 3 + 2 bitmaps + 1 bytes
+    buffer = malloc(st.st_size - sizeof(header) + 1);
+    traceCalls = calloc((st.st_size - sizeof(header)) / (5 + 2 * ((sizeof(SMCKeyData_t) + 7) / 8)) + 1,
+                        sizeof(SMCTraceCall_t));
+    if (buffer == NULL || traceCalls == NULL) {
+        free(buffer);
+        free(traceCalls);
+        close(fd);
+        return kIOReturnNoMemory;
+    }
+    while (done < st.st_size - sizeof(header) && (n = read(fd, buffer + done, st.st_size - sizeof(header) - done)) > 0)
+        done += n;
+    close(fd);
+
+    for (p = buffer, end = buffer + done; p < end; traceCount++) {
+        SMCTraceCall_t *call = &traceCalls[traceCount];
+
+        record = p;
+        call->index = *p++;
+        if ((p = traceGetVarint(p, end, &value)) == NULL ||     // Start; not needed
+            (p = traceGetVarint(p, end, &call->latency)) == NULL ||
+            (p = traceGetVarint(p, end, &value)) == NULL) {
+            damaged = 1;
+            break;
+        }
+        call->result = (kern_return_t)value;
+        p = traceGetStruct(p, end, &call->input);
+        p = traceGetStruct(p, end, &call->output);
+        if (p == NULL || p >= end) {
+            damaged = 1;    // Incomplete
+            break;
+        }
+        for (check = 0, q = record; q < p; q++)
+            check += *q;
+        if (check != *p++) {
+            damaged = 1;
+            break;
+        }
+    }
+    free(buffer);
+    if (damaged)
+        fprintf(stderr, "Warning: trace '%s' is damaged after call %lu; replaying up to there\n",
+                filename, traceCount);
+
+    traceSpeed = speed;
+    transport = &SMCReplayTransport;
+    return kIOReturnSuccess;
+}
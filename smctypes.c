@@ -0,0 +1,473 @@
+/*
+ *  smctypes.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Decoders for the data types of SMC values (see Keytypes.txt)
+ *
+ * Every known type has an entry in a table, sorted on the 32 bit type code
+ * (the four characters of the type, first character as the most significant byte).
+ * An entry tells how to decode a value: as an integer, a fixed point number,
+ * characters, or not at all (flags and the '{' structures are only shown in hex).
+ * For the fixed point types the value of the lowest bit is worked out by the
+ * compiler, so decoding is one multiplication.
+ *
+ * All 16 bit fixed point types are in the table: "fpIF" with I + F = 16 and "spIF"
+ * with 1 + I + F = 16 (see val2float() for the meaning of I and F). Fixed point
+ * types of other sizes are decoded from their name, as before.
+ *
+ * SMCDecodeColumn() decodes many values of one type at once, for recorded samples (-R).
+ *
+ * The conversions between bytes, key names and numbers that everything else uses
+ * (bytes2uint32(), uint32tostr(), ...) are here too, so libsmc.c and the transports
+ * can be built without smc.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECODE_X86
+#endif
+
+#include "smctypes.h"
+
+#define SMC_TYPE(a, b, c, d)  (((UInt32)(a) << 24) | ((UInt32)(b) << 16) | ((UInt32)(c) << 8) | (UInt32)(d))
+#define HEXDIGIT(n)           ((n) < 10 ? '0' + (n) : 'a' + (n) - 10)
+
+// "fpIF" and "spIF" types of 16 bits, with F fraction bits
+#define FP16(f)   { SMC_TYPE('f', 'p', HEXDIGIT(16 - (f)), HEXDIGIT(f)), SMC_DECODE_FIXED, 2, 1.0 / (1 << (f)) }
+#define SP16(f)   { SMC_TYPE('s', 'p', HEXDIGIT(15 - (f)), HEXDIGIT(f)), SMC_DECODE_SIGNED_FIXED, 2, 1.0 / (1 << (f)) }
+
+#define TYPE(name, kind, size)  { SMC_TYPE(name[0], name[1], name[2], name[3]), kind, size, 1.0 }
+
+// Sorted on type code. Within "fp" and "sp" the code rises as the number of fraction bits drops.
+static const SMCDecoder_t decoders[] = {
+    TYPE("ch8*", SMC_DECODE_CHARS, 0),
+    TYPE("char", SMC_DECODE_CHARS, 1),
+    TYPE("flag", SMC_DECODE_NONE, 1),
+    FP16(15), FP16(14), FP16(13), FP16(12), FP16(11), FP16(10), FP16(9), FP16(8),
+    FP16(7), FP16(6), FP16(5), FP16(4), FP16(3), FP16(2), FP16(1),
+    TYPE("hex_", SMC_DECODE_NONE, 0),
+    TYPE("si16", SMC_DECODE_SIGNED, 2),
+    TYPE("si8 ", SMC_DECODE_SIGNED, 1),
+    SP16(15), SP16(14), SP16(13), SP16(12), SP16(11), SP16(10), SP16(9), SP16(8),
+    SP16(7), SP16(6), SP16(5), SP16(4), SP16(3), SP16(2), SP16(1), SP16(0),
+    TYPE("ui16", SMC_DECODE_UNSIGNED, 2),
+    TYPE("ui32", SMC_DECODE_UNSIGNED, 4),
+    TYPE("ui8 ", SMC_DECODE_UNSIGNED, 1),
+    TYPE("{alc", SMC_DECODE_NONE, 16),
+    TYPE("{fds", SMC_DECODE_NONE, 16),
+    TYPE("{lim", SMC_DECODE_NONE, 3),
+    TYPE("{lsc", SMC_DECODE_NONE, 10),
+    TYPE("{lsd", SMC_DECODE_NONE, 8),
+    TYPE("{lsf", SMC_DECODE_NONE, 6),
+    TYPE("{lso", SMC_DECODE_NONE, 2),
+    TYPE("{mss", SMC_DECODE_NONE, 1),
+    TYPE("{pwm", SMC_DECODE_NONE, 2),
+    TYPE("{rev", SMC_DECODE_NONE, 6),
+};
+
+#define DECODERCOUNT  (sizeof(decoders) / sizeof(decoders[0]))
+
+/*
+ * Convert an array of bytes to a UInt32.
+ * - bytes[0] is seen as the most significant byte in the array.
+ * - The 'size' (values 1-4) gives the number of bytes read from 'bytes'.
+ * The conversion is independent of the byte order ("endian-ness") of the system; bytes[0] will
+ * always be the most significant part of the result.
+ *
+ * Renamed from _strtoul() to bytes2uint32() to better reflect the function
+ * Dropped the 'base' parameter. No base conversion takes place, all it does
+ * is move bytes around.
+ * Solves the problem in the original in the cases where it was called with base=10.
+ */
+UInt32 bytes2uint32(char *bytes, int size)
+{
+    UInt32 total = 0;
+    int i;
+    
+    for (i = 0; i < size; i++)
+    {
+        total = total * 256;
+        total += ((unsigned)bytes[i] & 0xff); // Explicitily promote to uint and chop off to prevent sign extension
+    }
+    return total;
+}
+
+/*
+ * Convert the bytes in 'val' to a string in 'str'
+ * - MSB becomes the first character
+ * - LSB becomes the last character
+ * Input 'val' is limited to 32 bits (4 bytes), so output will never be more than 4 characters
+ * However: it might be shorter than 4 characters, by including a '\0' byte.
+ * The string is padded with spaces to fill up 4 characters.
+ */
+void uint32tostr(char *str, UInt32 val)
+{
+    sprintf(str, "%c%c%c%c",
+            (unsigned int) val >> 24,
+            (unsigned int) val >> 16,
+            (unsigned int) val >> 8,
+            (unsigned int) val);
+    // Pad with spaces if shorter than 4 characters
+    for (int i = (int)strlen(str); i < 4; i++) {
+        str[i] = ' ';
+    }
+}
+
+/*
+ * Convert a single hexadecimal character to an int
+ * For non-hex characters return -1.
+ */
+int hex2int(char c)
+{
+    if ('0' <= c && c <= '9') {
+        return c - '0';
+    } else if ('A' <= c && c <= 'F') {
+        return c - 'A' + 10;
+    } else if ('a' <= c && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * Convert an  SMCVal_t value that holds a fixed point value into a double
+ * The exact format is encoded in val.dataType
+ * This has the form "fpIF" or "spIF" where:
+ * - "fp" and "sp" are litteral strings (for unsigned and signed)
+ * - "I" is a hexadecimal digit that gives the number of bits in the integer part
+ * - "F" is a hexadecimal digit that gives the number of bits in the fraction part
+ * For signed fixed point numbers the topmost bit of the first byte is the sign
+ * Example: "fpe2" is an unsigned fixed point number with 0xe=14 integer bits
+ * and 2 fraction bits. Layout in two bytes: i i i i i i i i    i i i i i i f f
+ * Example: "sp69" is a signed fixed point number with 6 integer bits
+ * and 9 fraction bits. Layout in two bytes: s i i i i i i f    f f f f f f f f
+ *
+ * This interpretation of the format was surmised from the way the original version
+ * of this program tried to convert "fpe2" numbers, and looking at all the other,
+ * similar types listed with the -l option.
+ * In all those types the total number of bits adds up to 16, and matches the 2 bytes
+ * in the value. It is unclear if and how a value should be interpreted if the number
+ * of bits in the value does not add up to a multiple of 8. Where will the stuffing bits
+ * be? Before the sign bit? Between the sign bit and the integer bits? Between the
+ * integer bits and the fraction bits? After the fraction bits? Any combination of these?
+ *
+ * For the time being we assume that there are always a whole number of bytes, so our algorithm
+ * can assume that the bits are left-alligned.
+ *
+ * The 16 bit types have a decoder with a precomputed scale (see the table 'decoders' above).
+ * For other sizes, first convert the bytes to a number, then scale it by the number
+ * of bits in the fraction part. Also stick the sign in there somewhere.
+ */
+double val2float(const SMCVal_t *valp)
+{
+    const SMCDecoder_t *decoder;
+    SMCDecoder_t generic;   // Decoder for a type that is not in the table
+    int signbits = 0;   // Number of sign bits (0 or 1)
+    int intbits = 0;    // Number of integer bits
+    int fracbits = 0;   // Number of fraction bits
+
+    decoder = SMCDecoderFor(bytes2uint32((char *)valp->dataType, 4));
+    if (decoder != NULL &&
+        (decoder->kind == SMC_DECODE_FIXED || decoder->kind == SMC_DECODE_SIGNED_FIXED))
+        return SMCDecode(decoder, valp->bytes, valp->dataSize);
+
+    // Analise the data type
+    if (valp->dataType[0]=='s'){  // First letter is an s?
+        signbits = 1;           // Then we have a sign bit
+    }
+    intbits = hex2int(valp->dataType[2]);     // Get the nr of integer bits
+    if (intbits < 0) {
+        fprintf(stderr, "Error: Expected hex digit in fp/sp data type. Found '%c' in '%s'\n", valp->dataType[2], valp->dataType);
+        return 0.0;
+    }
+    fracbits = hex2int(valp->dataType[3]);    // Get the nr of fraction bits
+    if (fracbits < 0) {
+        fprintf(stderr, "Error: Expected hex digit in fp/sp data type. Found '%c' in '%s'\n", valp->dataType[3], valp->dataType);
+        return 0.0;
+    }
+
+    generic.type = bytes2uint32((char *)valp->dataType, 4);
+    generic.kind = signbits ? SMC_DECODE_SIGNED_FIXED : SMC_DECODE_FIXED;
+    generic.size = (signbits + intbits + fracbits) / 8;
+    generic.scale = 1.0 / (1 << fracbits);
+    if (generic.size == 0)
+        generic.size = 1;       // Less than a byte: the bits are in the first byte
+    if (generic.size > 4)
+        return 0.0;
+    return SMCDecode(&generic, valp->bytes, generic.size);
+}
+
+/*
+ * Find the decoder for the data type 'dataType' (a type code, like bytes2uint32("sp78", 4))
+ * Returns NULL for types that are not in the table.
+ */
+const SMCDecoder_t *SMCDecoderFor(UInt32 dataType)
+{
+    int lo = 0, hi = DECODERCOUNT - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (decoders[mid].type == dataType)
+            return &decoders[mid];
+        if (decoders[mid].type < dataType)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/*
+ * Decode the 'size' bytes in 'bytes' into a number with 'decoder'
+ * Returns 0.0 for types that do not hold a number.
+ */
+double SMCDecode(const SMCDecoder_t *decoder, const char *bytes, UInt32 size)
+{
+    UInt32 raw, sign;
+
+    switch (decoder->kind) {
+        case SMC_DECODE_UNSIGNED:
+            return bytes2uint32((char *)bytes, size > 4 ? 4 : size);
+        case SMC_DECODE_SIGNED:
+            if (size == 0)
+                return 0.0;
+            if (size > 4)
+                size = 4;
+            raw = bytes2uint32((char *)bytes, size);
+            sign = (UInt32)1 << (8 * size - 1);
+            return (double)(SInt64)(raw ^ sign) - sign;     // Sign extend
+        case SMC_DECODE_FIXED:
+            return bytes2uint32((char *)bytes, decoder->size) * decoder->scale;
+        case SMC_DECODE_SIGNED_FIXED:
+            // Sign and magnitude, not two's complement
+            raw = bytes2uint32((char *)bytes, decoder->size);
+            sign = (UInt32)1 << (8 * decoder->size - 1);
+            if (raw & sign)
+                return -((raw & ~sign) * decoder->scale);
+            return raw * decoder->scale;
+    }
+    return 0.0;
+}
+
+/*
+ * Encode 'value' into the 'size' bytes at 'bytes' with 'decoder': the reverse of SMCDecode()
+ * The value is rounded to the nearest value the type can hold, and clamped to its range.
+ * Returns kIOReturnSuccess, or kIOReturnUnsupported for types that do not hold a number.
+ */
+kern_return_t SMCEncode(const SMCDecoder_t *decoder, double value, char *bytes, UInt32 size)
+{
+    UInt32 sign = 0;
+    double max;
+    UInt64 raw;
+    int    i;
+
+    switch (decoder->kind) {
+        case SMC_DECODE_UNSIGNED:
+        case SMC_DECODE_SIGNED:
+            if (size == 0 || size > 4)
+                return kIOReturnUnsupported;
+            break;
+        case SMC_DECODE_FIXED:
+        case SMC_DECODE_SIGNED_FIXED:
+            if (size != decoder->size)
+                return kIOReturnUnsupported;
+            value /= decoder->scale;
+            break;
+        default:
+            return kIOReturnUnsupported;
+    }
+
+    max = (double)((UInt64)1 << (8 * size)) - 1;
+    if (decoder->kind == SMC_DECODE_SIGNED) {
+        // Two's complement
+        max = (max - 1) / 2;
+        if (value < -max - 1)
+            value = -max - 1;
+    } else if (decoder->kind == SMC_DECODE_SIGNED_FIXED) {
+        // Sign and magnitude
+        max = (max - 1) / 2;
+        if (value < 0) {
+            sign = (UInt32)1 << (8 * size - 1);
+            value = -value;
+        }
+    } else if (value < 0) {
+        value = 0;
+    }
+    if (value > max)
+        value = max;
+    raw = (UInt64)(SInt64)(value < 0 ? value - 0.5 : value + 0.5);
+    raw |= sign;
+
+    for (i = size - 1; i >= 0; i--) {
+        bytes[i] = raw & 0xff;
+        raw >>= 8;
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Format the value in '*valp' as text in 'buf' (of 'size' bytes):
+ * a number, or characters in double quotes
+ * Returns the length of the text, or 0 if the type of the value has no such form.
+ */
+int SMCFormatValue(const SMCVal_t *valp, char *buf, size_t size)
+{
+    const SMCDecoder_t *decoder;
+    UInt32              i, n = 0;
+
+    decoder = SMCDecoderFor(bytes2uint32((char *)valp->dataType, 4));
+    if (decoder == NULL) {
+        // Fixed point types of unusual sizes are decoded from their name
+        if (strncmp(valp->dataType, DATATYPE_FP, 2) == 0 ||
+            strncmp(valp->dataType, DATATYPE_SP, 2) == 0)
+            return snprintf(buf, size, "%.6g", val2float(valp));
+        return 0;
+    }
+
+    switch (decoder->kind) {
+        case SMC_DECODE_UNSIGNED:
+            return snprintf(buf, size, "%u", (unsigned int) SMCDecode(decoder, valp->bytes, valp->dataSize));
+        case SMC_DECODE_SIGNED:
+            return snprintf(buf, size, "%d", (int) SMCDecode(decoder, valp->bytes, valp->dataSize));
+        case SMC_DECODE_FIXED:
+        case SMC_DECODE_SIGNED_FIXED:
+            return snprintf(buf, size, "%.6g", SMCDecode(decoder, valp->bytes, valp->dataSize));
+        case SMC_DECODE_CHARS:
+            if (size < 3)
+                return 0;
+            buf[n++] = '"';
+            for (i = 0; i < valp->dataSize && i < BYTECOUNT && n < size - 2; i++) {
+                if (valp->bytes[i] == '\0')
+                    break;
+                buf[n++] = (valp->bytes[i] >= ' ' && valp->bytes[i] < 0x7f) ? valp->bytes[i] : '.';
+            }
+            buf[n++] = '"';
+            buf[n] = '\0';
+            return n;
+    }
+    return 0;
+}
+
+/*
+ * Decode 8 values of a 16 bit fixed point type, from big endian 'raw' into 'out'
+ * - 'signMask' is 0x8000 for types with a sign bit, otherwise 0
+ * - 'scale' is the value of the lowest bit
+ * These are compiled for their instruction set whatever the compiler options; the
+ * caller checks that the processor has it.
+ */
+#ifdef DECODE_X86
+__attribute__((target("avx2")))
+static void decodeFixed8AVX2(const char *raw, float *out, short signMask, float scale)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)raw);
+    __m128i mask = _mm_set1_epi16(signMask);
+    __m128i swapped, sign;
+    __m256  magnitude;
+
+    // Byte swap each 16 bit value, and split off the sign
+    swapped = _mm_shuffle_epi8(bytes, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+    sign = _mm_and_si128(swapped, mask);
+    swapped = _mm_andnot_si128(mask, swapped);
+
+    // Widen to 32 bits, convert and scale; then put the sign in the top bit of the float
+    magnitude = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(swapped)), _mm256_set1_ps(scale));
+    magnitude = _mm256_or_ps(magnitude, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(sign), 16)));
+    _mm256_storeu_ps(out, magnitude);
+}
+
+__attribute__((target("sse2")))
+static void decodeFixed8SSE2(const char *raw, float *out, short signMask, float scale)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)raw);
+    __m128i mask = _mm_set1_epi16(signMask);
+    __m128i zero = _mm_setzero_si128();
+    __m128i swapped, sign;
+    __m128  lo, hi;
+
+    // Byte swap each 16 bit value, and split off the sign
+    swapped = _mm_or_si128(_mm_slli_epi16(bytes, 8), _mm_srli_epi16(bytes, 8));
+    sign = _mm_and_si128(swapped, mask);
+    swapped = _mm_andnot_si128(mask, swapped);
+
+    // Widen to 32 bits, convert and scale; then put the sign in the top bit of the float
+    lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(swapped, zero)), _mm_set1_ps(scale));
+    hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(swapped, zero)), _mm_set1_ps(scale));
+    lo = _mm_or_ps(lo, _mm_castsi128_ps(_mm_unpacklo_epi16(zero, sign)));
+    hi = _mm_or_ps(hi, _mm_castsi128_ps(_mm_unpackhi_epi16(zero, sign)));
+    _mm_storeu_ps(out, lo);
+    _mm_storeu_ps(out + 4, hi);
+}
+#endif
+
+/*
+ * Decode a column of 'count' values of one type into floats
+ * - 'raw' holds the values back to back, 'decoder->size' bytes each, as read from the SMC
+ * - 'out' receives 'count' floats
+ * - 'method' is SMC_COLUMN_BEST, or one of the others to compare them (--bench)
+ * The results are the same as those of SMCDecode() (and so of val2float()), converted to float.
+ * On x86 the 16 bit fixed point types are decoded 8 at a time, with AVX2 if the processor
+ * has it, otherwise SSE2. Other types, and other processors, go one value at a time.
+ * Returns kIOReturnBadArgument if the type has no numeric value or no fixed size, and
+ * kIOReturnUnsupported if this processor cannot run 'method'.
+ */
+kern_return_t SMCDecodeColumn(const SMCDecoder_t *decoder, const char *raw, size_t count, float *out, int method)
+{
+    size_t i = 0;
+
+    if (decoder->size == 0 ||
+        (decoder->kind != SMC_DECODE_UNSIGNED && decoder->kind != SMC_DECODE_SIGNED &&
+         decoder->kind != SMC_DECODE_FIXED && decoder->kind != SMC_DECODE_SIGNED_FIXED))
+        return kIOReturnBadArgument;
+
+#ifdef DECODE_X86
+    if (method == SMC_COLUMN_BEST)
+        method = __builtin_cpu_supports("avx2") ? SMC_COLUMN_AVX2 : SMC_COLUMN_SSE2;
+    if ((method == SMC_COLUMN_AVX2 && !__builtin_cpu_supports("avx2")) ||
+        (method == SMC_COLUMN_SSE2 && !__builtin_cpu_supports("sse2")))
+        return kIOReturnUnsupported;
+
+    if (decoder->size == 2 &&
+        (decoder->kind == SMC_DECODE_FIXED || decoder->kind == SMC_DECODE_SIGNED_FIXED))
+    {
+        short signMask = decoder->kind == SMC_DECODE_SIGNED_FIXED ? (short)0x8000 : 0;
+
+        if (method == SMC_COLUMN_AVX2) {
+            for (; i + 8 <= count; i += 8)
+                decodeFixed8AVX2(raw + 2 * i, out + i, signMask, (float)decoder->scale);
+        } else if (method == SMC_COLUMN_SSE2) {
+            for (; i + 8 <= count; i += 8)
+                decodeFixed8SSE2(raw + 2 * i, out + i, signMask, (float)decoder->scale);
+        }
+    }
+#else
+    if (method != SMC_COLUMN_BEST && method != SMC_COLUMN_SCALAR)
+        return kIOReturnUnsupported;
+#endif
+
+    for (; i < count; i++)
+        out[i] = (float)SMCDecode(decoder, raw + i * decoder->size, decoder->size);
+    return kIOReturnSuccess;
+}
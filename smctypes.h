@@ -0,0 +1,214 @@
+/*
+ *  smctypes.h
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * What smc and the programs built on libsmc.h share: the IOKit types (or stand-ins for them),
+ * the commands and result codes of the SMC, the structures exchanged with it, transports,
+ * and the conversions of smctypes.c. Everything else of smc is in smc.h.
+ */
+
+#ifndef __SMCTYPES_H__
+#define __SMCTYPES_H__
+
+#ifdef __APPLE__
+#include <IOKit/IOKitLib.h>
+#else
+/*
+ * Stand-ins for the IOKit types and return codes used by this program.
+ * Without IOKit there is no AppleSMC to talk to, but the program can still be
+ * built and run against the simulated SMC in smcsim.c (option -s).
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t           UInt8;
+typedef uint16_t          UInt16;
+typedef uint32_t          UInt32;
+typedef uint64_t          UInt64;
+typedef int64_t           SInt64;
+typedef int               kern_return_t;
+typedef unsigned int      io_connect_t;
+
+#define kIOReturnSuccess      0
+#define kIOReturnError        ((kern_return_t)0xe00002bc)
+#define kIOReturnNoMemory     ((kern_return_t)0xe00002bd)
+#define kIOReturnIPCError     ((kern_return_t)0xe00002bf)
+#define kIOReturnNoDevice     ((kern_return_t)0xe00002c0)
+#define kIOReturnBadArgument  ((kern_return_t)0xe00002c2)
+#define kIOReturnUnsupported  ((kern_return_t)0xe00002c7)
+#define kIOReturnNotOpen      ((kern_return_t)0xe00002cd)
+#define kIOReturnNotReady     ((kern_return_t)0xe00002d8)
+#define kIOReturnAborted      ((kern_return_t)0xe00002eb)
+#define kIOReturnNotFound     ((kern_return_t)0xe00002f0)
+#endif
+
+#define KERNEL_INDEX_SMC      2
+
+#define SMC_CMD_READ_BYTES    5
+#define SMC_CMD_WRITE_BYTES   6
+#define SMC_CMD_READ_INDEX    8
+#define SMC_CMD_READ_KEYINFO  9
+#define SMC_CMD_READ_PLIMIT   11
+#define SMC_CMD_READ_VERS     12
+
+// Values of the 'result' byte returned by the SMC
+#define SMC_RESULT_SUCCESS            0x00
+#define SMC_RESULT_ERROR              0x01
+#define SMC_RESULT_BAD_COMMAND        0x82
+#define SMC_RESULT_KEY_NOT_FOUND      0x84
+#define SMC_RESULT_KEY_NOT_WRITABLE   0x86
+#define SMC_RESULT_KEY_SIZE_MISMATCH  0x87
+#define SMC_RESULT_KEY_INDEX_RANGE    0xb8
+
+#define DATATYPE_FP           "fp"
+#define DATATYPE_SP           "sp"
+#define DATATYPE_UINT8        "ui8 "
+#define DATATYPE_UINT16       "ui16"
+#define DATATYPE_UINT32       "ui32"
+
+// Number of bytes in an SMCVal_t.bytes array
+#define BYTECOUNT             32
+
+typedef struct {
+    char                  major;
+    char                  minor;
+    char                  build;
+    char                  reserved[1]; 
+    UInt16                release;
+} SMCKeyData_vers_t;
+
+typedef struct {
+    UInt16                version;
+    UInt16                length;
+    UInt32                cpuPLimit;
+    UInt32                gpuPLimit;
+    UInt32                memPLimit;
+} SMCKeyData_pLimitData_t;
+
+typedef struct {
+    UInt32                dataSize;
+    UInt32                dataType;
+    char                  dataAttributes;
+} SMCKeyData_keyInfo_t;
+
+typedef char              SMCBytes_t[BYTECOUNT];
+
+typedef struct {
+    UInt32                  key; 
+    SMCKeyData_vers_t       vers; 
+    SMCKeyData_pLimitData_t pLimitData;
+    SMCKeyData_keyInfo_t    keyInfo;
+    char                    result;
+    char                    status;
+    char                    data8;
+    UInt32                  data32;
+    SMCBytes_t              bytes;
+} SMCKeyData_t;
+
+typedef char              UInt32Char_t[5];
+
+// How a data type is decoded (see smctypes.c)
+enum {
+    SMC_DECODE_NONE,            // Only shown as bytes
+    SMC_DECODE_UNSIGNED,        // Unsigned integer
+    SMC_DECODE_SIGNED,          // Two's complement integer
+    SMC_DECODE_FIXED,           // Unsigned fixed point
+    SMC_DECODE_SIGNED_FIXED,    // Fixed point with a sign bit
+    SMC_DECODE_CHARS            // Characters
+};
+
+typedef struct {
+    UInt32                type;         // Type code: the 4 characters of the type as a UInt32
+    int                   kind;         // SMC_DECODE_...
+    UInt32                size;         // Size in bytes; 0 if it varies
+    double                scale;        // Fixed point: value of the lowest bit
+} SMCDecoder_t;
+
+// How SMCDecodeColumn() decodes
+enum {
+    SMC_COLUMN_BEST,            // The fastest this processor has
+    SMC_COLUMN_SCALAR,          // One value at a time
+    SMC_COLUMN_SSE2,            // 8 at a time (x86)
+    SMC_COLUMN_AVX2             // 8 at a time, in one register (x86 with AVX2)
+};
+
+typedef struct {
+    UInt32Char_t            key;
+    UInt32                  dataSize;
+    UInt32Char_t            dataType;
+    SMCBytes_t              bytes;
+} SMCVal_t;
+
+/*
+ * A transport carries the exchanges with an SMC: those of SMCCall() in smc, and of the
+ * handles of libsmc.c.
+ * - 'open' and 'close' set up and tear down a connection
+ * - 'call' executes one command, see SMCCall()
+ * The default transport talks to the AppleSMC kernel extension through IOKit.
+ * smcsim.c provides a simulated, in-memory SMC.
+ */
+typedef struct {
+    const char    *name;
+    kern_return_t (*open)(io_connect_t *connp);
+    kern_return_t (*close)(io_connect_t conn);
+    kern_return_t (*call)(io_connect_t conn, int index,
+                          SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep);
+} SMCTransport_t;
+
+#ifdef __APPLE__
+extern SMCTransport_t SMCIOKitTransport;    // smciokit.c
+#endif
+
+/*
+ * How SMCReadWith() reads: the key info and the calls of smc, or of a handle
+ * - 'keyInfo' gets the key info of 'key', from its cache unless 'fresh' is set
+ * - 'call' makes one exchange; an answer with a non-zero 'result' byte is still a success
+ * - 'refused' (may be NULL) is told about a key the SMC refused to read with its key info
+ */
+typedef struct {
+    kern_return_t (*keyInfo)(void *context, UInt32 key, SMCKeyData_keyInfo_t *keyInfop, int fresh);
+    kern_return_t (*call)(void *context, SMCKeyData_t *inputStructurep, SMCKeyData_t *outputStructurep);
+    void          (*refused)(void *context, UInt32 key);
+} SMCReader_t;
+
+// libsmc.c
+kern_return_t SMCReadWith(const SMCReader_t *reader, void *context, UInt32 key, SMCVal_t *valp,
+                          SMCKeyData_t *inputp, SMCKeyData_t *outputp);
+
+// smcsim.c
+extern SMCTransport_t SMCSimTransport;
+kern_return_t SMCSimLoad(const char *filename);
+
+// smctypes.c
+UInt32        bytes2uint32(char *bytes, int size);
+void          uint32tostr(char *str, UInt32 val);
+int           hex2int(char c);
+double        val2float(const SMCVal_t *valp);
+const SMCDecoder_t *SMCDecoderFor(UInt32 dataType);
+double        SMCDecode(const SMCDecoder_t *decoder, const char *bytes, UInt32 size);
+kern_return_t SMCEncode(const SMCDecoder_t *decoder, double value, char *bytes, UInt32 size);
+int           SMCFormatValue(const SMCVal_t *valp, char *buf, size_t size);
+kern_return_t SMCDecodeColumn(const SMCDecoder_t *decoder, const char *raw, size_t count, float *out, int method);
+
+#endif /* __SMCTYPES_H__ */
@@ -0,0 +1,525 @@
+/*
+ *  smcwatch.c
+ *  Smc
+ */
+
+/*
+ * Apple System Management Control (SMC) Tool
+ * Copyright (C) 2006 devnull
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Watch mode: sample a set of keys at a fixed interval (-W)
+ *
+ * The sampler runs on a monotonic clock with absolute deadlines: sample n is due at
+ * start + n * interval, however long the earlier samples took. So the timing does not
+ * drift. A sample that cannot be taken before the next one is due is skipped, and
+ * counted as a missed deadline.
+ *
+ * The raw values go into a ring buffer that is allocated before sampling starts.
+ * A second thread decodes and prints them, so slow output does not disturb the timing.
+ * If the printing falls so far behind that the ring is full, samples are dropped
+ * (and counted) rather than waiting for it.
+ *
+ * With a log file (-o, see smclog.c) the printer thread writes the raw values to it instead.
+ *
+ * Change-only output (-D, -H): a value is only printed when it differs from the last value
+ * printed for the key. The raw bytes are compared first, so an unchanged value costs a
+ * memcmp() and is never decoded. A value whose bytes did change is decoded only if the
+ * key has a deadband: then it is printed if it moved by more than the absolute deadband,
+ * or by more than the relative deadband times the last value printed, whichever is more.
+ * A change in the result of reading a key is always printed. Every 'heartbeat' samples
+ * all values are printed, so a reader knows they are still current. Samples without
+ * a value to print give no line at all.
+ *
+ * Multi-rate sampling (-k <key>@<ms>, -B): every key has its own period, and the SMC calls
+ * per second can be limited; see smcsched.c. A sample then holds the keys that were due
+ * together. The other keys have the result kIOReturnNotReady, and are not printed
+ * (or logged) for that sample.
+ *
+ * When done, the achieved sample rate, the number of missed deadlines and dropped
+ * samples, and the largest wake-up delay are printed on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#include "smc.h"
+
+#define WATCH_RINGSECONDS   2       // The ring holds at least this much time of samples
+#define WATCH_RINGMIN       64      // ...and at least this many samples
+#define WATCH_RINGMAX       65536   // ...but no more than this many
+
+// The ring buffer. Slot 's' holds times[s], and vals[] and results[] from s * count on.
+typedef struct {
+    int                   count;        // Keys per sample
+    UInt32                slots;
+    UInt64               *times;        // Nanoseconds since the start of sampling
+    SMCVal_t             *vals;
+    kern_return_t        *results;
+    volatile UInt32       head;         // Samples written; only changed by the sampler
+    volatile UInt32       tail;         // Samples printed; only changed by the printer
+    volatile int          done;         // Sampler has finished
+    UInt64                poll;         // How long the printer sleeps when the ring is empty
+    SMCLog_t             *log;          // Write the samples to this log instead of printing them
+    // Change-only output; 'deadbands' is NULL to print every value
+    const SMCDeadband_t  *deadbands;    // For each key
+    unsigned long         heartbeat;    // Print all values every this many samples; 0 for never
+    SMCVal_t             *last;         // Last value printed for each key
+    kern_return_t        *lastResults;
+    char                 *shown;        // Keys printed at least once; 'last' is only valid for these
+    double               *lastValues;   // Decoded, for the keys with a deadband
+    char                 *print;        // Keys to print for the current sample
+    unsigned long         printed;      // Values printed
+    unsigned long         seen;         // Values sampled
+} SMCWatchRing_t;
+
+static volatile sig_atomic_t watchStopping = 0;
+
+/*
+ * Current time of a monotonic clock, in nanoseconds
+ * The clock starts at an arbitrary point; only differences have a meaning.
+ */
+UInt64 SMCTimeNow(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt64)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Sleep until the monotonic clock (see SMCTimeNow()) reaches 'deadline'
+ * Returns early if interrupted by a signal.
+ */
+void SMCSleepUntil(UInt64 deadline)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    mach_wait_until(deadline * timebase.denom / timebase.numer);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000000u;
+    ts.tv_nsec = deadline % 1000000000u;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+#endif
+}
+
+/*
+ * Print one value in a compact form: a number if the data type is known,
+ * otherwise the bytes in hexadecimal
+ * - 'number' is the value already decoded (see SMCLogPrint()), or NaN
+ */
+static void watchPrintValue(SMCVal_t *valp, kern_return_t result, float number)
+{
+    char text[BYTECOUNT + 3];
+    int  i;
+
+    printf("  %s ", valp->key);
+    if (result != kIOReturnSuccess)
+    {
+        printf("error(%08x)", result);
+    }
+    else if (!isnan(number))
+    {
+        printf("%.6g", number);     // As SMCFormatValue() prints fixed point values
+    }
+    else if (SMCFormatValue(valp, text, sizeof(text)) > 0)
+    {
+        printf("%s", text);
+    }
+    else
+    {
+        for (i = 0; i < valp->dataSize && i < BYTECOUNT; i++)
+            printf("%02x", (unsigned char) valp->bytes[i]);
+    }
+}
+
+/*
+ * Print one sample: its time in seconds, followed by the value of each key
+ * - 'print' selects the keys to print: key i is printed if print[i] is set. NULL prints all.
+ * - 'numbers' holds values already decoded, NaN for the others; NULL if there are none
+ */
+void SMCPrintSample(UInt64 time, SMCVal_t *vals, kern_return_t *results, int count, const char *print,
+                    const float *numbers)
+{
+    int i;
+
+    printf("%12.6f", time / 1e9);
+    for (i = 0; i < count; i++)
+    {
+        if ((print == NULL || print[i]) && results[i] != kIOReturnNotReady)
+            watchPrintValue(&vals[i], results[i], numbers != NULL ? numbers[i] : NAN);
+    }
+    printf("\n");
+}
+
+/*
+ * Decide which values of the sample with number 'n' to print in change-only output
+ * Sets ring->print[i] for the keys to print, and remembers their values.
+ * Returns the number of keys to print.
+ */
+static int watchChanges(SMCWatchRing_t *ring, unsigned long n, SMCVal_t *vals, kern_return_t *results)
+{
+    const SMCDecoder_t *decoder;
+    SMCVal_t           *last;
+    double              value, band, delta;
+    int                 i, count = 0, all;
+
+    all = (n == 0 || (ring->heartbeat > 0 && n % ring->heartbeat == 0));
+    for (i = 0; i < ring->count; i++)
+    {
+        last = &ring->last[i];
+        if (results[i] == kIOReturnNotReady)
+        {
+            ring->print[i] = 0;     // Not read in this sample
+            continue;
+        }
+        ring->seen++;
+        ring->print[i] = 1;
+        if (!all && ring->shown[i] && results[i] == ring->lastResults[i])
+        {
+            // Same bytes, or the same error: nothing new
+            if (results[i] != kIOReturnSuccess ||
+                (vals[i].dataSize == last->dataSize && memcmp(vals[i].bytes, last->bytes, vals[i].dataSize) == 0))
+                ring->print[i] = 0;
+            else if (ring->deadbands[i].absolute > 0 || ring->deadbands[i].relative > 0)
+            {
+                // Changed, but maybe not by enough
+                decoder = SMCDecoderFor(bytes2uint32(vals[i].dataType, 4));
+                if (decoder != NULL && decoder->kind != SMC_DECODE_NONE && decoder->kind != SMC_DECODE_CHARS)
+                {
+                    value = SMCDecode(decoder, vals[i].bytes, vals[i].dataSize);
+                    delta = value - ring->lastValues[i];
+                    band = ring->deadbands[i].relative * (ring->lastValues[i] < 0 ? -ring->lastValues[i] : ring->lastValues[i]);
+                    if (band < ring->deadbands[i].absolute)
+                        band = ring->deadbands[i].absolute;
+                    if (delta <= band && delta >= -band)
+                        ring->print[i] = 0;
+                }
+            }
+        }
+        if (!ring->print[i])
+            continue;
+
+        count++;
+        ring->shown[i] = 1;
+        *last = vals[i];
+        ring->lastResults[i] = results[i];
+        if (results[i] == kIOReturnSuccess && (ring->deadbands[i].absolute > 0 || ring->deadbands[i].relative > 0))
+        {
+            decoder = SMCDecoderFor(bytes2uint32(vals[i].dataType, 4));
+            if (decoder != NULL)
+                ring->lastValues[i] = SMCDecode(decoder, vals[i].bytes, vals[i].dataSize);
+        }
+    }
+    ring->printed += count;
+    return count;
+}
+
+/*
+ * Printer thread: decode and print the samples in the ring, until the sampler is done
+ * and the ring is empty
+ */
+static void *watchPrinter(void *arg)
+{
+    SMCWatchRing_t *ring = arg;
+    UInt32          head, tail, slot;
+    int             done;
+
+    tail = ring->tail;
+    for (;;)
+    {
+        done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == head)
+        {
+            if (done)
+                break;
+            if (ring->log != NULL)
+                SMCLogFlush(ring->log);     // Let readers of the log see the samples so far
+            else
+                fflush(stdout);
+            SMCSleepUntil(SMCTimeNow() + ring->poll);
+            continue;
+        }
+        for (; tail != head; tail++)
+        {
+            slot = tail % ring->slots;
+            if (ring->log != NULL)
+                SMCLogAppend(ring->log, ring->times[slot],
+                             &ring->vals[slot * ring->count], &ring->results[slot * ring->count]);
+            else if (ring->deadbands == NULL)
+                SMCPrintSample(ring->times[slot], &ring->vals[slot * ring->count],
+                               &ring->results[slot * ring->count], ring->count, NULL, NULL);
+            else if (watchChanges(ring, tail, &ring->vals[slot * ring->count], &ring->results[slot * ring->count]) > 0)
+                SMCPrintSample(ring->times[slot], &ring->vals[slot * ring->count],
+                               &ring->results[slot * ring->count], ring->count, ring->print, NULL);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+static void watchStop(int sig)
+{
+    watchStopping = 1;
+}
+
+/*
+ * Read the keys of a multi-rate sample: those with due[i] set
+ * The others get the result kIOReturnNotReady.
+ */
+static void watchReadDue(UInt32Char_t *keys, int count, const char *due, SMCVal_t *vals, kern_return_t *results)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (due[i])
+        {
+            results[i] = SMCReadKey(keys[i], &vals[i]);
+        }
+        else
+        {
+            memset(&vals[i], 0, sizeof(SMCVal_t));
+            memcpy(vals[i].key, keys[i], sizeof(UInt32Char_t));
+            results[i] = kIOReturnNotReady;
+        }
+    }
+}
+
+/*
+ * Sample the 'count' keys in 'keys' every 'interval' nanoseconds, and print the values
+ * - 'samples' is the number of samples to take; 0 means until interrupted (SIGINT, SIGTERM).
+ *   Missed deadlines and dropped samples do not count: they are reported separately.
+ * - 'logfile' is the name of a log to write the samples to (see smclog.c), or NULL to print them
+ * - 'deadbands' holds the deadband of each key for change-only output, or is NULL to print
+ *   every value; 'heartbeat' is the number of samples after which all values are printed
+ *   again, 0 for never
+ * - 'schedule' holds the period and priority of each key for multi-rate sampling, or is NULL
+ *   to read all keys every 'interval'; 'budget' is the largest number of SMC calls per second
+ *   it may make, 0 for no limit. 'samples' then counts the wake-ups that read any key.
+ * Every key is read once before sampling starts, to check it and to fill the key info cache.
+ * Returns kIOReturnSuccess, or the error code of that first read.
+ */
+kern_return_t SMCWatch(UInt32Char_t *keys, int count, UInt64 interval, unsigned long samples,
+                       const char *logfile, const SMCDeadband_t *deadbands, unsigned long heartbeat,
+                       const SMCSchedule_t *schedule, double budget)
+{
+    SMCWatchRing_t   ring;
+    SMCSched_t      *sched = NULL;
+    char            *due = NULL;
+    pthread_t        printer;
+    struct sigaction sa;
+    kern_return_t    result;
+    UInt64           start, deadline, now, late, maxLate = 0, skip, tick = interval;
+    unsigned long    taken = 0, missed = 0, dropped = 0;
+    UInt32           slot;
+    double           elapsed;
+    int              i;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.count = count;
+    if (schedule != NULL)
+    {
+        // Size the ring for the fastest key
+        for (i = 0; i < count; i++)
+            if (schedule[i].period > 0 && schedule[i].period < tick)
+                tick = schedule[i].period;
+        due = malloc(count);
+        if (due == NULL)
+        {
+            result = kIOReturnNoMemory;
+            goto out;
+        }
+    }
+    // A power of 2, so the slot numbers stay in order when 'head' wraps around
+    for (ring.slots = WATCH_RINGMIN;
+         ring.slots < WATCH_RINGMAX && ring.slots * tick < WATCH_RINGSECONDS * 1000000000ull;
+         ring.slots *= 2)
+        ;
+    ring.poll = tick < 1000000 ? 1000000 : (tick > 50000000 ? 50000000 : tick);
+    ring.times = calloc(ring.slots, sizeof(UInt64));
+    ring.vals = calloc((size_t)ring.slots * count, sizeof(SMCVal_t));
+    ring.results = calloc((size_t)ring.slots * count, sizeof(kern_return_t));
+    if (deadbands != NULL)
+    {
+        ring.deadbands = deadbands;
+        ring.heartbeat = heartbeat;
+        ring.last = calloc(count, sizeof(SMCVal_t));
+        ring.lastResults = calloc(count, sizeof(kern_return_t));
+        ring.lastValues = calloc(count, sizeof(double));
+        ring.print = calloc(count, 1);
+        ring.shown = calloc(count, 1);
+        if (ring.last == NULL || ring.lastResults == NULL || ring.lastValues == NULL || ring.print == NULL ||
+            ring.shown == NULL)
+        {
+            result = kIOReturnNoMemory;
+            goto out;
+        }
+    }
+    if (ring.times == NULL || ring.vals == NULL || ring.results == NULL)
+    {
+        result = kIOReturnNoMemory;
+        goto out;
+    }
+
+    // A first read, which checks the keys and takes the key info calls out of the loop
+    result = SMCReadKeys(keys, count, ring.vals, ring.results);
+    if (result != kIOReturnSuccess)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (ring.results[i] == kIOReturnBadArgument)
+                fprintf(stderr, "Error: key '%s' given more than once\n", keys[i]);
+            else if (ring.results[i] != kIOReturnSuccess)
+                fprintf(stderr, "Error: SMCReadKey() = %08x for key '%s'\n", ring.results[i], keys[i]);
+        }
+        goto out;
+    }
+
+    if (logfile != NULL)
+    {
+        ring.log = SMCLogCreate(logfile, ring.vals, count, interval, schedule != NULL);
+        if (ring.log == NULL)
+        {
+            result = kIOReturnError;
+            goto out;
+        }
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    start = deadline = SMCTimeNow();
+    if (schedule != NULL && (sched = SMCSchedCreate(schedule, count, start, budget)) == NULL)
+    {
+        result = kIOReturnNoMemory;
+        goto out;
+    }
+
+    if (pthread_create(&printer, NULL, watchPrinter, &ring) != 0)
+    {
+        result = kIOReturnError;
+        goto out;
+    }
+
+    while (!watchStopping && (samples == 0 || taken < samples))
+    {
+        if (sched != NULL && (deadline = SMCSchedNext(sched)) == 0)
+            break;      // Only keys read once left, and all of them read
+        SMCSleepUntil(deadline);
+        now = SMCTimeNow();
+        if (now < deadline)
+            continue;   // Woken up early by a signal
+        late = now - deadline;
+        if (late > maxLate)
+            maxLate = late;
+
+        if (sched != NULL && SMCSchedTake(sched, now, due) == 0)
+            continue;   // Waiting for the budget
+
+        if (ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) < ring.slots)
+        {
+            slot = ring.head % ring.slots;
+            if (sched != NULL)
+            {
+                ring.times[slot] = now - start;
+                watchReadDue(keys, count, due, &ring.vals[slot * count], &ring.results[slot * count]);
+            }
+            else
+            {
+                ring.times[slot] = deadline - start;
+                SMCReadKeys(keys, count, &ring.vals[slot * count], &ring.results[slot * count]);
+            }
+            __atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+            taken++;
+        }
+        else
+        {
+            dropped++;  // The printer is too far behind
+        }
+        if (sched != NULL)
+            continue;   // The scheduler keeps the deadline of every key
+
+        // Next deadline. Skip the ones that have already passed.
+        deadline += interval;
+        now = SMCTimeNow();
+        if (now > deadline)
+        {
+            skip = (now - deadline) / interval + 1;
+            missed += skip;
+            deadline += skip * interval;
+        }
+    }
+    if (sched != NULL)
+        elapsed = (SMCTimeNow() - start) / 1e9;
+    else
+        elapsed = (deadline - start) / 1e9;     // Whole intervals, up to the next deadline
+
+    __atomic_store_n(&ring.done, 1, __ATOMIC_RELEASE);
+    pthread_join(printer, NULL);
+    if (ring.log != NULL && SMCLogClose(ring.log) != kIOReturnSuccess)
+        result = kIOReturnError;
+
+    fprintf(stderr, "%lu samples in %.3f s: %.1f per second (interval %.3f ms)\n",
+            taken, elapsed, elapsed > 0 ? taken / elapsed : 0.0, interval / 1e6);
+    fprintf(stderr, "Missed deadlines: %lu, dropped samples: %lu, largest wake-up delay: %.3f ms\n",
+            missed, dropped, maxLate / 1e6);
+    if (deadbands != NULL)
+        fprintf(stderr, "Change-only output: %lu of %lu values printed (%.1f%%)\n",
+                ring.printed, ring.seen, ring.seen > 0 ? 100.0 * ring.printed / ring.seen : 0.0);
+    if (sched != NULL)
+        SMCSchedReport(sched, keys, (UInt64)(elapsed * 1e9));
+
+out:
+    SMCSchedFree(sched);
+    free(due);
+    free(ring.last);
+    free(ring.lastResults);
+    free(ring.lastValues);
+    free(ring.print);
+    free(ring.shown);
+    free(ring.times);
+    free(ring.vals);
+    free(ring.results);
+    return result;
+}